@@ -0,0 +1,265 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Concurrent instance creation and destruction through the layer
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Plays the loader for several mock drivers at once: every thread keeps creating instances on its
+ * own driver, calls vkGetRandROutputDisplayEXT and vkGetInstanceProcAddr on them and destroys
+ * them again, while the other threads do the same. Each mock driver checks that the physical
+ * devices it is handed belong to one of its own instances, so a call that went down another
+ * instance's chain fails the test, as does any of the layer's memory left behind. Needs no GPU and
+ * no X server.
+ *
+ * Usage: instance_stress [rounds per thread] [threads]
+ */
+#include <vulkan/vk_layer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "vkdisplayhacksteamvr_alloc.hpp"
+
+extern "C" {
+VkResult VKAPI_CALL vkdisplayhacksteamvr_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
+                                                        const VkAllocationCallbacks *pAllocator,
+                                                        VkInstance *pInstance);
+PFN_vkVoidFunction VKAPI_CALL vkdisplayhacksteamvr_GetInstanceProcAddr(VkInstance instance,
+                                                                       const char *pName);
+}
+
+namespace {
+
+// vkGetRandROutputDisplayEXT without pulling in Xlib, Display and RROutput are opaque here
+typedef VkResult(VKAPI_PTR *PFN_GetRandROutputDisplay)(VkPhysicalDevice physicalDevice,
+                                                        void *dpy,
+                                                        unsigned long rrOutput,
+                                                        VkDisplayKHR *pDisplay);
+
+constexpr uint32_t DRIVERS = 4;
+
+// the instances being created at once by one thread
+constexpr uint32_t LIVE_INSTANCES = 4;
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Mock drivers
+
+struct MockInstance;
+
+// dispatchable handles start with the loader's dispatch pointer, which the layer uses as its key.
+// Physical devices share their instance's.
+struct MockPhysicalDevice
+{
+    const void *loader_data;
+    MockInstance *instance;
+};
+
+struct MockInstance
+{
+    const void *loader_data;
+    uint32_t driver;
+    MockPhysicalDevice gpu;
+};
+
+std::atomic<uint64_t> created[DRIVERS];
+std::atomic<uint64_t> destroyed[DRIVERS];
+std::atomic<uint64_t> wrong_chain{0};
+
+template<uint32_t Driver>
+struct MockDriver
+{
+    static VKAPI_ATTR VkResult VKAPI_CALL CreateInstance(const VkInstanceCreateInfo *,
+                                                         const VkAllocationCallbacks *,
+                                                         VkInstance *pInstance)
+    {
+        MockInstance *inst = new MockInstance;
+        inst->loader_data = inst; // unique per instance, like the loader's dispatch tables
+        inst->driver = Driver;
+        inst->gpu.loader_data = inst->loader_data;
+        inst->gpu.instance = inst;
+        created[Driver].fetch_add(1);
+        *pInstance = (VkInstance) inst;
+        return VK_SUCCESS;
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL DestroyInstance(VkInstance instance,
+                                                      const VkAllocationCallbacks *)
+    {
+        MockInstance *inst = (MockInstance *) instance;
+        if (inst->driver != Driver)
+            wrong_chain.fetch_add(1);
+        destroyed[Driver].fetch_add(1);
+        delete inst;
+    }
+
+    static VKAPI_ATTR VkResult VKAPI_CALL EnumeratePhysicalDevices(VkInstance instance,
+                                                                   uint32_t *pCount,
+                                                                   VkPhysicalDevice *pDevices)
+    {
+        MockInstance *inst = (MockInstance *) instance;
+        if (inst->driver != Driver)
+            wrong_chain.fetch_add(1);
+        if (pDevices != NULL && *pCount > 0)
+            pDevices[0] = (VkPhysicalDevice) &inst->gpu;
+        *pCount = 1;
+        return VK_SUCCESS;
+    }
+
+    // hands out the instance the physical device came from as the display
+    static VKAPI_ATTR VkResult VKAPI_CALL GetRandROutputDisplayEXT(VkPhysicalDevice physicalDevice,
+                                                                   void *,
+                                                                   unsigned long,
+                                                                   VkDisplayKHR *pDisplay)
+    {
+        MockPhysicalDevice *gpu = (MockPhysicalDevice *) physicalDevice;
+        if (gpu->instance->driver != Driver)
+            wrong_chain.fetch_add(1);
+        *pDisplay = (VkDisplayKHR) (uintptr_t) gpu->instance;
+        return VK_SUCCESS;
+    }
+
+    static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetInstanceProcAddr(VkInstance,
+                                                                        const char *pName)
+    {
+        if (strcmp(pName, "vkCreateInstance") == 0)
+            return (PFN_vkVoidFunction) CreateInstance;
+        if (strcmp(pName, "vkDestroyInstance") == 0)
+            return (PFN_vkVoidFunction) DestroyInstance;
+        if (strcmp(pName, "vkEnumeratePhysicalDevices") == 0)
+            return (PFN_vkVoidFunction) EnumeratePhysicalDevices;
+        if (strcmp(pName, "vkGetRandROutputDisplayEXT") == 0)
+            return (PFN_vkVoidFunction) GetRandROutputDisplayEXT;
+        if (strcmp(pName, "vkGetInstanceProcAddr") == 0)
+            return (PFN_vkVoidFunction) GetInstanceProcAddr;
+        return NULL;
+    }
+};
+
+const PFN_vkGetInstanceProcAddr driver_gipa[DRIVERS] = {
+    MockDriver<0>::GetInstanceProcAddr,
+    MockDriver<1>::GetInstanceProcAddr,
+    MockDriver<2>::GetInstanceProcAddr,
+    MockDriver<3>::GetInstanceProcAddr,
+};
+
+const PFN_vkVoidFunction driver_enumerate[DRIVERS] = {
+    (PFN_vkVoidFunction) MockDriver<0>::EnumeratePhysicalDevices,
+    (PFN_vkVoidFunction) MockDriver<1>::EnumeratePhysicalDevices,
+    (PFN_vkVoidFunction) MockDriver<2>::EnumeratePhysicalDevices,
+    (PFN_vkVoidFunction) MockDriver<3>::EnumeratePhysicalDevices,
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Stress
+
+std::atomic<uint64_t> failures{0};
+
+void fail(const char *what, uint32_t driver)
+{
+    if (failures.fetch_add(1) < 10)
+        fprintf(stderr, "driver %u: %s\n", driver, what);
+}
+
+VkInstance create_instance(uint32_t driver)
+{
+    // the loader's side of the chain, for each instance anew since the layer moves it on
+    VkLayerInstanceLink link = {};
+    link.pfnNextGetInstanceProcAddr = driver_gipa[driver];
+
+    VkLayerInstanceCreateInfo link_info = {};
+    link_info.sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO;
+    link_info.function = VK_LAYER_LINK_INFO;
+    link_info.u.pLayerInfo = &link;
+
+    VkInstanceCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    info.pNext = &link_info;
+
+    VkInstance instance = VK_NULL_HANDLE;
+    if (vkdisplayhacksteamvr_CreateInstance(&info, NULL, &instance) != VK_SUCCESS)
+        return VK_NULL_HANDLE;
+    return instance;
+}
+
+void stress(uint32_t driver, uint32_t rounds)
+{
+    PFN_vkGetInstanceProcAddr gipa = vkdisplayhacksteamvr_GetInstanceProcAddr;
+
+    for (uint32_t r = 0; r < rounds; r++) {
+        VkInstance instances[LIVE_INSTANCES];
+        for (VkInstance &instance : instances) {
+            instance = create_instance(driver);
+            if (instance == VK_NULL_HANDLE)
+                fail("layer vkCreateInstance failed", driver);
+        }
+
+        for (VkInstance instance : instances) {
+            if (instance == VK_NULL_HANDLE)
+                continue;
+            MockInstance *inst = (MockInstance *) instance;
+
+            // the pass-through lookup is cached per instance, it must be this driver's function
+            if (gipa(instance, "vkEnumeratePhysicalDevices") != driver_enumerate[driver])
+                fail("vkGetInstanceProcAddr resolved on another instance's chain", driver);
+
+            PFN_GetRandROutputDisplay get_display = (PFN_GetRandROutputDisplay)
+                gipa(instance, "vkGetRandROutputDisplayEXT");
+            VkDisplayKHR display = VK_NULL_HANDLE;
+            if (get_display == NULL
+                || get_display((VkPhysicalDevice) &inst->gpu, NULL, 1, &display) != VK_SUCCESS
+                || display != (VkDisplayKHR) (uintptr_t) inst)
+                fail("vkGetRandROutputDisplayEXT went down another instance's chain", driver);
+        }
+
+        for (VkInstance instance : instances)
+            if (instance != VK_NULL_HANDLE)
+                ((PFN_vkDestroyInstance) gipa(instance, "vkDestroyInstance"))(instance, NULL);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    uint32_t rounds = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : 64;
+    uint32_t num_threads = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10)
+                                    : std::max(2u, std::thread::hardware_concurrency());
+    if (rounds == 0 || num_threads == 0) {
+        fprintf(stderr, "usage: %s [rounds per thread] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    // without an override and without X every vkGetRandROutputDisplayEXT goes down the chain
+    unsetenv("VK_DISPLAY_HACK_STEAMVR");
+    unsetenv("DISPLAY");
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < num_threads; t++)
+        threads.emplace_back(stress, t % DRIVERS, rounds);
+    for (std::thread &th : threads)
+        th.join();
+
+    uint64_t instances = 0;
+    for (uint32_t d = 0; d < DRIVERS; d++) {
+        instances += created[d].load();
+        if (created[d].load() != destroyed[d].load())
+            fail("vkDestroyInstance didn't reach every instance the driver created", d);
+    }
+
+    AllocStats end = alloc_stats();
+    printf("%llu instances on %u threads: %llu failures, %llu calls on the wrong chain, "
+           "%llu bytes still held by the layer\n",
+           (unsigned long long) instances,
+           num_threads,
+           (unsigned long long) failures.load(),
+           (unsigned long long) wrong_chain.load(),
+           (unsigned long long) end.live_bytes);
+    return failures.load() == 0 && wrong_chain.load() == 0 && end.live_bytes == 0 ? 0 : 1;
+}
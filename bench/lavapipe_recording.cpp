@@ -0,0 +1,539 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  End-to-end recording throughput with and without the layer on lavapipe
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Goes through the real loader to mesa's software driver, so no GPU is needed: one instance and
+ * device with VK_LAYER_HAAGCH_vkdisplayhacksteamvr enabled and one without, each recording large
+ * command buffers of draws from 1..N threads through the loader's exported functions. Every call
+ * takes the full path an application's does, loader trampolines included, and the difference in
+ * draws per second and CPU time per draw is what the layer costs.
+ *
+ * The layer is found through VK_LAYER_PATH, which meson points at the build directory. It takes the
+ * first CPU device, so SwiftShader works as well, and without one the benchmark is skipped.
+ * VK_DRIVER_FILES=.../lvp_icd.x86_64.json selects lavapipe when other drivers are installed too.
+ *
+ * Usage: lavapipe_recording [draws per command buffer] [max threads] [max overhead %]
+ *        lavapipe_recording --gpu-timestamps
+ *
+ * With a maximum overhead it fails when the layer costs more than that at any thread count.
+ * --gpu-timestamps instead submits one command buffer with VK_DISPLAY_HACK_STEAMVR_GPU_TIMESTAMPS
+ * set and fails unless the layer logs its GPU time.
+ */
+#include <vulkan/vulkan.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr const char *LAYER_NAME = "VK_LAYER_HAAGCH_vkdisplayhacksteamvr";
+
+// draws of the command buffer the GPU timestamp check submits, and how long it waits for the log
+constexpr uint32_t GPU_CHECK_DRAWS = 10000;
+constexpr uint32_t GPU_CHECK_TIMEOUT_MS = 2000;
+
+// command buffers each thread records per measurement, the best of REPEATS measurements counts
+constexpr uint32_t ROUNDS = 8;
+constexpr uint32_t REPEATS = 3;
+
+// a vertex shader that does nothing, rasterization is discarded so no other stage is needed
+const uint32_t vertex_spirv[] = {
+    0x07230203, 0x00010000, 0, 5, 0, // header, ids 1 to 4
+    0x00020011, 1, // OpCapability Shader
+    0x0003000e, 0, 1, // OpMemoryModel Logical GLSL450
+    0x0005000f, 0, 1, 0x6e69616d, 0, // OpEntryPoint Vertex %1 "main"
+    0x00020013, 2, // %2 = OpTypeVoid
+    0x00030021, 3, 2, // %3 = OpTypeFunction %2
+    0x00050036, 2, 1, 0, 3, // %1 = OpFunction %2 None %3
+    0x000200f8, 4, // %4 = OpLabel
+    0x000100fd, // OpReturn
+    0x00010038, // OpFunctionEnd
+};
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// one instance and device on lavapipe with what recording draws needs, with or without the layer
+struct Context
+{
+    VkInstance instance = VK_NULL_HANDLE;
+    VkDevice device = VK_NULL_HANDLE;
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    VkFramebuffer framebuffer = VK_NULL_HANDLE;
+    VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    uint32_t queueFamily = 0;
+
+    // one pool and command buffer per thread, as recording on several threads requires
+    std::vector<VkCommandPool> pools;
+    std::vector<VkCommandBuffer> commandBuffers;
+};
+
+bool layer_available()
+{
+    uint32_t count = 0;
+    vkEnumerateInstanceLayerProperties(&count, NULL);
+    std::vector<VkLayerProperties> layers(count);
+    vkEnumerateInstanceLayerProperties(&count, layers.data());
+    for (const VkLayerProperties &l : layers)
+        if (strcmp(l.layerName, LAYER_NAME) == 0)
+            return true;
+    return false;
+}
+
+// 0 on success, 77 (skipped) without a lavapipe device, 1 on error
+int context_create(Context *ctx, bool layer, uint32_t max_threads)
+{
+    VkApplicationInfo application_info = {};
+    application_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    application_info.pApplicationName = "lavapipe_recording";
+    application_info.apiVersion = VK_API_VERSION_1_0;
+
+    VkInstanceCreateInfo instance_info = {};
+    instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instance_info.pApplicationInfo = &application_info;
+    instance_info.enabledLayerCount = layer ? 1 : 0;
+    instance_info.ppEnabledLayerNames = &LAYER_NAME;
+
+    if (vkCreateInstance(&instance_info, NULL, &ctx->instance) != VK_SUCCESS) {
+        fprintf(stderr, "vkCreateInstance %s the layer failed\n", layer ? "with" : "without");
+        return 1;
+    }
+
+    uint32_t count = 0;
+    vkEnumeratePhysicalDevices(ctx->instance, &count, NULL);
+    std::vector<VkPhysicalDevice> physicalDevices(count);
+    vkEnumeratePhysicalDevices(ctx->instance, &count, physicalDevices.data());
+
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    for (VkPhysicalDevice pd : physicalDevices) {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(pd, &props);
+        if (props.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU) {
+            physicalDevice = pd;
+            break;
+        }
+    }
+    if (physicalDevice == VK_NULL_HANDLE) {
+        fprintf(stderr, "no CPU device, install mesa's lavapipe or set VK_DRIVER_FILES\n");
+        return 77;
+    }
+
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, NULL);
+    std::vector<VkQueueFamilyProperties> families(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, families.data());
+    while (ctx->queueFamily < count
+           && !(families[ctx->queueFamily].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+        ctx->queueFamily++;
+    if (ctx->queueFamily == count) {
+        fprintf(stderr, "lavapipe has no graphics queue\n");
+        return 1;
+    }
+
+    float priority = 1.0f;
+    VkDeviceQueueCreateInfo queue_info = {};
+    queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_info.queueFamilyIndex = ctx->queueFamily;
+    queue_info.queueCount = 1;
+    queue_info.pQueuePriorities = &priority;
+
+    VkDeviceCreateInfo device_info = {};
+    device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_info.queueCreateInfoCount = 1;
+    device_info.pQueueCreateInfos = &queue_info;
+
+    if (vkCreateDevice(physicalDevice, &device_info, NULL, &ctx->device) != VK_SUCCESS) {
+        fprintf(stderr, "vkCreateDevice %s the layer failed\n", layer ? "with" : "without");
+        return 1;
+    }
+    VkDevice device = ctx->device;
+
+    // a render pass and framebuffer without attachments, the draws produce nothing
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+
+    VkRenderPassCreateInfo render_pass_info = {};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.subpassCount = 1;
+    render_pass_info.pSubpasses = &subpass;
+
+    if (vkCreateRenderPass(device, &render_pass_info, NULL, &ctx->renderPass) != VK_SUCCESS) {
+        fprintf(stderr, "vkCreateRenderPass failed\n");
+        return 1;
+    }
+
+    VkFramebufferCreateInfo framebuffer_info = {};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = ctx->renderPass;
+    framebuffer_info.width = 64;
+    framebuffer_info.height = 64;
+    framebuffer_info.layers = 1;
+
+    VkPipelineLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+
+    VkShaderModuleCreateInfo module_info = {};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = sizeof(vertex_spirv);
+    module_info.pCode = vertex_spirv;
+
+    VkShaderModule vertex = VK_NULL_HANDLE;
+    if (vkCreateFramebuffer(device, &framebuffer_info, NULL, &ctx->framebuffer) != VK_SUCCESS
+        || vkCreatePipelineLayout(device, &layout_info, NULL, &ctx->pipelineLayout) != VK_SUCCESS
+        || vkCreateShaderModule(device, &module_info, NULL, &vertex) != VK_SUCCESS) {
+        fprintf(stderr, "creating the framebuffer, pipeline layout or shader failed\n");
+        return 1;
+    }
+
+    VkPipelineShaderStageCreateInfo stage = {};
+    stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stage.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stage.module = vertex;
+    stage.pName = "main";
+
+    VkPipelineVertexInputStateCreateInfo vertex_input = {};
+    vertex_input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly = {};
+    input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+
+    VkPipelineRasterizationStateCreateInfo rasterization = {};
+    rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization.rasterizerDiscardEnable = VK_TRUE;
+    rasterization.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization.lineWidth = 1.0f;
+
+    VkGraphicsPipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info.stageCount = 1;
+    pipeline_info.pStages = &stage;
+    pipeline_info.pVertexInputState = &vertex_input;
+    pipeline_info.pInputAssemblyState = &input_assembly;
+    pipeline_info.pRasterizationState = &rasterization;
+    pipeline_info.layout = ctx->pipelineLayout;
+    pipeline_info.renderPass = ctx->renderPass;
+
+    VkResult result = vkCreateGraphicsPipelines(device,
+                                                VK_NULL_HANDLE,
+                                                1,
+                                                &pipeline_info,
+                                                NULL,
+                                                &ctx->pipeline);
+    vkDestroyShaderModule(device, vertex, NULL);
+    if (result != VK_SUCCESS) {
+        fprintf(stderr, "vkCreateGraphicsPipelines failed: %d\n", result);
+        return 1;
+    }
+
+    ctx->pools.resize(max_threads);
+    ctx->commandBuffers.resize(max_threads);
+    for (uint32_t t = 0; t < max_threads; t++) {
+        VkCommandPoolCreateInfo pool_info = {};
+        pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        pool_info.queueFamilyIndex = ctx->queueFamily;
+
+        if (vkCreateCommandPool(device, &pool_info, NULL, &ctx->pools[t]) != VK_SUCCESS) {
+            fprintf(stderr, "vkCreateCommandPool failed\n");
+            return 1;
+        }
+
+        VkCommandBufferAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = ctx->pools[t];
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandBufferCount = 1;
+
+        if (vkAllocateCommandBuffers(device, &alloc_info, &ctx->commandBuffers[t]) != VK_SUCCESS) {
+            fprintf(stderr, "vkAllocateCommandBuffers failed\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void context_destroy(Context *ctx)
+{
+    if (ctx->device != VK_NULL_HANDLE) {
+        for (VkCommandPool pool : ctx->pools)
+            vkDestroyCommandPool(ctx->device, pool, NULL);
+        vkDestroyPipeline(ctx->device, ctx->pipeline, NULL);
+        vkDestroyPipelineLayout(ctx->device, ctx->pipelineLayout, NULL);
+        vkDestroyFramebuffer(ctx->device, ctx->framebuffer, NULL);
+        vkDestroyRenderPass(ctx->device, ctx->renderPass, NULL);
+        vkDestroyDevice(ctx->device, NULL);
+    }
+    if (ctx->instance != VK_NULL_HANDLE)
+        vkDestroyInstance(ctx->instance, NULL);
+    *ctx = Context();
+}
+
+// records one command buffer of draws, the way a renderer records a big pass
+void record(const Context &ctx, uint32_t thread, uint32_t draws)
+{
+    VkCommandBuffer cb = ctx.commandBuffers[thread];
+    vkResetCommandPool(ctx.device, ctx.pools[thread], 0);
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    VkRenderPassBeginInfo pass_info = {};
+    pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    pass_info.renderPass = ctx.renderPass;
+    pass_info.framebuffer = ctx.framebuffer;
+    pass_info.renderArea.extent = {64, 64};
+
+    vkBeginCommandBuffer(cb, &begin_info);
+    vkCmdBeginRenderPass(cb, &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, ctx.pipeline);
+    for (uint32_t i = 0; i < draws; i++)
+        vkCmdDraw(cb, 3, 1, i, 0);
+    vkCmdEndRenderPass(cb);
+    vkEndCommandBuffer(cb);
+}
+
+struct Result
+{
+    double draws_per_sec;
+    double cpu_ns_per_draw;
+};
+
+// every thread records ROUNDS command buffers at once, the best of REPEATS runs
+Result run(const Context &ctx, uint32_t num_threads, uint32_t draws)
+{
+    Result best = {0.0, 0.0};
+    for (uint32_t r = 0; r < REPEATS; r++) {
+        std::atomic<uint32_t> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<uint64_t> cpu(num_threads);
+        std::vector<std::thread> threads;
+
+        for (uint32_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t] {
+                // warm up the driver's command memory and the layer's per command buffer state
+                record(ctx, t, draws);
+                ready.fetch_add(1);
+                while (!go.load())
+                    std::this_thread::yield();
+
+                uint64_t start = thread_cpu_ns();
+                for (uint32_t i = 0; i < ROUNDS; i++)
+                    record(ctx, t, draws);
+                cpu[t] = thread_cpu_ns() - start;
+            });
+        }
+
+        while (ready.load() != num_threads)
+            std::this_thread::yield();
+        uint64_t start = now_ns();
+        go.store(true);
+        for (std::thread &th : threads)
+            th.join();
+        uint64_t elapsed = now_ns() - start;
+
+        uint64_t cpu_total = 0;
+        for (uint64_t c : cpu)
+            cpu_total += c;
+
+        double total_draws = (double) draws * ROUNDS * num_threads;
+        Result res;
+        res.draws_per_sec = total_draws / ((double) elapsed * 1e-9);
+        res.cpu_ns_per_draw = (double) cpu_total / total_draws;
+        if (r == 0 || res.draws_per_sec > best.draws_per_sec)
+            best.draws_per_sec = res.draws_per_sec;
+        if (r == 0 || res.cpu_ns_per_draw < best.cpu_ns_per_draw)
+            best.cpu_ns_per_draw = res.cpu_ns_per_draw;
+    }
+    return best;
+}
+
+// true once the log has a gpu_commandbuffer record with a GPU time
+bool gpu_time_logged(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+
+    bool found = false;
+    char line[512];
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long gpu_ns = 0;
+        if (strncmp(line, "gpu_commandbuffer,", 18) == 0
+            && sscanf(line, "%*[^,],%*[^,],%*[^,],%*[^,],%llu", &gpu_ns) == 1)
+            found = gpu_ns != 0;
+    }
+    fclose(f);
+    return found;
+}
+
+// records and submits one command buffer with GPU timestamps on, the layer reads the results back
+// and logs them from background threads, 0 once they show up, 77 without lavapipe
+int gpu_timestamps_check()
+{
+    char path[] = "/tmp/lavapipe_recording-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    // the layer reads these when it first logs and when the device is created
+    setenv("VK_DISPLAY_HACK_STEAMVR_LOG", path, 1);
+    setenv("VK_DISPLAY_HACK_STEAMVR_LOG_FORMAT", "csv", 1);
+    setenv("VK_DISPLAY_HACK_STEAMVR_GPU_TIMESTAMPS", "1", 1);
+
+    Context ctx;
+    int ret = context_create(&ctx, true, 1);
+    if (ret == 0) {
+        VkQueue queue = VK_NULL_HANDLE;
+        vkGetDeviceQueue(ctx.device, ctx.queueFamily, 0, &queue);
+        record(ctx, 0, GPU_CHECK_DRAWS);
+
+        VkFenceCreateInfo fence_info = {};
+        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+        VkSubmitInfo submit = {};
+        submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit.commandBufferCount = 1;
+        submit.pCommandBuffers = &ctx.commandBuffers[0];
+
+        VkFence fence = VK_NULL_HANDLE;
+        if (vkCreateFence(ctx.device, &fence_info, NULL, &fence) != VK_SUCCESS
+            || vkQueueSubmit(queue, 1, &submit, fence) != VK_SUCCESS
+            || vkWaitForFences(ctx.device, 1, &fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            fprintf(stderr, "submitting the command buffer failed\n");
+            ret = 1;
+        } else {
+            uint64_t deadline = now_ns() + GPU_CHECK_TIMEOUT_MS * 1000000ull;
+            while (!gpu_time_logged(path) && now_ns() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (!gpu_time_logged(path)) {
+                fprintf(stderr,
+                        "no gpu_commandbuffer record with a GPU time in %u ms\n",
+                        GPU_CHECK_TIMEOUT_MS);
+                ret = 1;
+            }
+        }
+        vkDestroyFence(ctx.device, fence, NULL);
+    }
+
+    context_destroy(&ctx);
+    unlink(path);
+    if (ret == 0)
+        printf("gpu_commandbuffer logged with a GPU time\n");
+    return ret;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--gpu-timestamps") == 0) {
+        if (!layer_available()) {
+            fprintf(stderr,
+                    "%s not found, is VK_LAYER_PATH set to the build directory?\n",
+                    LAYER_NAME);
+            return 1;
+        }
+        return gpu_timestamps_check();
+    }
+
+    uint32_t draws = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : 100000;
+    uint32_t max_threads = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10)
+                                    : std::max(1u, std::thread::hardware_concurrency());
+    double max_overhead = argc > 3 ? strtod(argv[3], NULL) : 0.0;
+    if (draws == 0 || max_threads == 0) {
+        fprintf(stderr,
+                "usage: %s [draws per command buffer] [max threads] [max overhead %%]\n",
+                argv[0]);
+        return 1;
+    }
+
+    // the per command buffer stats would go to stdout otherwise, the layer still produces them
+    setenv("VK_DISPLAY_HACK_STEAMVR_LOG", "/dev/null", 0);
+
+    if (!layer_available()) {
+        fprintf(stderr, "%s not found, is VK_LAYER_PATH set to the build directory?\n", LAYER_NAME);
+        return 1;
+    }
+
+    Context baseline, layered;
+    int ret = context_create(&baseline, false, max_threads);
+    if (ret == 0)
+        ret = context_create(&layered, true, max_threads);
+    if (ret != 0) {
+        context_destroy(&layered);
+        context_destroy(&baseline);
+        return ret;
+    }
+
+    std::vector<uint32_t> thread_counts;
+    for (uint32_t t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    printf("%u draws per command buffer, %u command buffers per thread, best of %u\n\n",
+           draws,
+           ROUNDS,
+           REPEATS);
+    printf("%7s %14s %14s %10s %13s %13s %10s\n",
+           "threads",
+           "base draws/s",
+           "layer draws/s",
+           "overhead",
+           "base cpu ns",
+           "layer cpu ns",
+           "cpu added");
+
+    double worst = 0.0;
+    for (uint32_t t : thread_counts) {
+        Result b = run(baseline, t, draws);
+        Result l = run(layered, t, draws);
+        double overhead = (b.draws_per_sec / l.draws_per_sec - 1.0) * 100.0;
+        double cpu_overhead = (l.cpu_ns_per_draw / b.cpu_ns_per_draw - 1.0) * 100.0;
+        worst = std::max(worst, std::max(overhead, cpu_overhead));
+        printf("%7u %14.0f %14.0f %9.1f%% %13.2f %13.2f %9.1f%%\n",
+               t,
+               b.draws_per_sec,
+               l.draws_per_sec,
+               overhead,
+               b.cpu_ns_per_draw,
+               l.cpu_ns_per_draw,
+               cpu_overhead);
+    }
+
+    context_destroy(&layered);
+    context_destroy(&baseline);
+
+    if (max_overhead > 0.0 && worst > max_overhead) {
+        printf("\nlayer overhead of %.1f%% is above the allowed %.1f%%\n", worst, max_overhead);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,571 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Per-call overhead of the layer's entry points against a no-op next layer
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Plays the loader: creates an instance and a device through the layer with link info pointing at a
+ * mock next layer whose entry points do nothing, then times the layer's hot entry points from 1..N
+ * threads next to the same calls made straight into the mock. Needs no GPU and no X server.
+ *
+ * Usage: layer_overhead [iterations per thread] [max threads]
+ *
+ * With VK_DISPLAY_HACK_STEAMVR_INTERCEPT=display the layer hands out the mock's draw and recording
+ * functions, the added time of those rows then shows the pass-through costs nothing.
+ *
+ * The instance and device are created with allocation callbacks, and after the timings whole
+ * frames are recorded, submitted and presented while counting heap allocations: the layer's should
+ * all have gone through the callbacks, and the steady frame loop should make none at all.
+ */
+#include <vulkan/vk_layer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "vkdisplayhacksteamvr_alloc.hpp"
+
+// every operator new of the process, the layer's containers would show up here
+static std::atomic<uint64_t> heap_allocations{0};
+
+void *operator new(size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size > 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+extern "C" {
+VkResult VKAPI_CALL vkdisplayhacksteamvr_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
+                                                        const VkAllocationCallbacks *pAllocator,
+                                                        VkInstance *pInstance);
+void VKAPI_CALL vkdisplayhacksteamvr_DestroyInstance(VkInstance instance,
+                                                     const VkAllocationCallbacks *pAllocator);
+VkResult VKAPI_CALL vkdisplayhacksteamvr_CreateDevice(VkPhysicalDevice physicalDevice,
+                                                      const VkDeviceCreateInfo *pCreateInfo,
+                                                      const VkAllocationCallbacks *pAllocator,
+                                                      VkDevice *pDevice);
+PFN_vkVoidFunction VKAPI_CALL vkdisplayhacksteamvr_GetDeviceProcAddr(VkDevice device,
+                                                                     const char *pName);
+PFN_vkVoidFunction VKAPI_CALL vkdisplayhacksteamvr_GetInstanceProcAddr(VkInstance instance,
+                                                                       const char *pName);
+}
+
+namespace {
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Mock next layer
+
+// dispatchable handles start with the loader's dispatch pointer, which the layer uses as its key
+struct MockDispatchable
+{
+    const void *loader_data;
+};
+
+const char instance_key = 0, device_key = 0;
+MockDispatchable mock_instance = {&instance_key};
+MockDispatchable mock_physical_device = {&instance_key};
+MockDispatchable mock_device = {&device_key};
+MockDispatchable mock_queue = {&device_key};
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_CreateInstance(const VkInstanceCreateInfo *,
+                                                   const VkAllocationCallbacks *,
+                                                   VkInstance *pInstance)
+{
+    *pInstance = (VkInstance) &mock_instance;
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL mock_DestroyInstance(VkInstance, const VkAllocationCallbacks *) {}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_EnumerateDeviceExtensionProperties(VkPhysicalDevice,
+                                                                       const char *,
+                                                                       uint32_t *pPropertyCount,
+                                                                       VkExtensionProperties *)
+{
+    *pPropertyCount = 0;
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_CreateDevice(VkPhysicalDevice,
+                                                 const VkDeviceCreateInfo *,
+                                                 const VkAllocationCallbacks *,
+                                                 VkDevice *pDevice)
+{
+    *pDevice = (VkDevice) &mock_device;
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL mock_DestroyDevice(VkDevice, const VkAllocationCallbacks *) {}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_AllocateCommandBuffers(VkDevice,
+                                                           const VkCommandBufferAllocateInfo *pInfo,
+                                                           VkCommandBuffer *pCommandBuffers)
+{
+    for (uint32_t i = 0; i < pInfo->commandBufferCount; i++)
+        pCommandBuffers[i] = (VkCommandBuffer) new MockDispatchable{&device_key};
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL mock_FreeCommandBuffers(VkDevice,
+                                                   VkCommandPool,
+                                                   uint32_t commandBufferCount,
+                                                   const VkCommandBuffer *pCommandBuffers)
+{
+    for (uint32_t i = 0; i < commandBufferCount; i++)
+        delete (MockDispatchable *) pCommandBuffers[i];
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_ResetCommandPool(VkDevice, VkCommandPool, VkCommandPoolResetFlags)
+{
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL mock_DestroyCommandPool(VkDevice, VkCommandPool, const VkAllocationCallbacks *)
+{}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_BeginCommandBuffer(VkCommandBuffer, const VkCommandBufferBeginInfo *)
+{
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_EndCommandBuffer(VkCommandBuffer)
+{
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL mock_CmdDraw(VkCommandBuffer, uint32_t, uint32_t, uint32_t, uint32_t) {}
+
+VKAPI_ATTR void VKAPI_CALL
+mock_CmdDrawIndexed(VkCommandBuffer, uint32_t, uint32_t, uint32_t, int32_t, uint32_t)
+{}
+
+VKAPI_ATTR void VKAPI_CALL
+mock_CmdSetViewport(VkCommandBuffer, uint32_t, uint32_t, const VkViewport *)
+{}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_QueueSubmit(VkQueue, uint32_t, const VkSubmitInfo *, VkFence)
+{
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL mock_QueuePresentKHR(VkQueue, const VkPresentInfoKHR *)
+{
+    return VK_SUCCESS;
+}
+
+struct MockFunction
+{
+    const char *name;
+    PFN_vkVoidFunction pfn;
+};
+
+#define MOCK(func) {"vk" #func, (PFN_vkVoidFunction) mock_##func}
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL mock_GetDeviceProcAddr(VkDevice, const char *pName);
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL mock_GetInstanceProcAddr(VkInstance, const char *pName);
+
+const MockFunction mock_device_functions[] = {
+    MOCK(GetDeviceProcAddr),
+    MOCK(DestroyDevice),
+    MOCK(AllocateCommandBuffers),
+    MOCK(FreeCommandBuffers),
+    MOCK(ResetCommandPool),
+    MOCK(DestroyCommandPool),
+    MOCK(BeginCommandBuffer),
+    MOCK(EndCommandBuffer),
+    MOCK(CmdDraw),
+    MOCK(CmdDrawIndexed),
+    MOCK(CmdSetViewport),
+    MOCK(QueueSubmit),
+    MOCK(QueuePresentKHR),
+};
+
+const MockFunction mock_instance_functions[] = {
+    MOCK(GetInstanceProcAddr),
+    MOCK(CreateInstance),
+    MOCK(DestroyInstance),
+    MOCK(EnumerateDeviceExtensionProperties),
+    MOCK(CreateDevice),
+};
+
+#undef MOCK
+
+template<size_t N>
+PFN_vkVoidFunction lookup(const MockFunction (&functions)[N], const char *pName)
+{
+    for (const MockFunction &f : functions)
+        if (strcmp(f.name, pName) == 0)
+            return f.pfn;
+    return NULL;
+}
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL mock_GetDeviceProcAddr(VkDevice, const char *pName)
+{
+    return lookup(mock_device_functions, pName);
+}
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL mock_GetInstanceProcAddr(VkInstance, const char *pName)
+{
+    if (PFN_vkVoidFunction pfn = lookup(mock_instance_functions, pName))
+        return pfn;
+    return lookup(mock_device_functions, pName);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Benchmark cases
+
+// entry points as seen by the application: either the layer's or the mock's directly
+struct EntryPoints
+{
+    VkInstance instance;
+    VkDevice device;
+    PFN_vkGetInstanceProcAddr GetInstanceProcAddr;
+    PFN_vkGetDeviceProcAddr GetDeviceProcAddr;
+    PFN_vkBeginCommandBuffer BeginCommandBuffer;
+    PFN_vkCmdDraw CmdDraw;
+    PFN_vkCmdDrawIndexed CmdDrawIndexed;
+};
+
+// hides a value from the optimizer so calls through it are not folded away
+template<typename T>
+T opaque(T v)
+{
+    asm volatile("" : "+r"(v));
+    return v;
+}
+
+typedef void (*CaseFunc)(const EntryPoints &ep, VkCommandBuffer commandBuffer, uint64_t iterations);
+
+struct Case
+{
+    const char *name;
+    CaseFunc run;
+};
+
+VkCommandBufferBeginInfo begin_info = {};
+
+const Case cases[] = {
+    {"vkCmdDraw",
+     [](const EntryPoints &ep, VkCommandBuffer cb, uint64_t n) {
+         for (uint64_t i = 0; i < n; i++)
+             opaque(ep.CmdDraw)(cb, 3, 1, 0, 0);
+     }},
+    {"vkCmdDrawIndexed",
+     [](const EntryPoints &ep, VkCommandBuffer cb, uint64_t n) {
+         for (uint64_t i = 0; i < n; i++)
+             opaque(ep.CmdDrawIndexed)(cb, 6, 2, 0, 0, 0);
+     }},
+    {"vkBeginCommandBuffer",
+     [](const EntryPoints &ep, VkCommandBuffer cb, uint64_t n) {
+         for (uint64_t i = 0; i < n; i++)
+             opaque(ep.BeginCommandBuffer)(cb, &begin_info);
+     }},
+    {"vkGetDeviceProcAddr (intercepted)",
+     [](const EntryPoints &ep, VkCommandBuffer, uint64_t n) {
+         for (uint64_t i = 0; i < n; i++)
+             opaque(ep.GetDeviceProcAddr)(ep.device, "vkCmdDraw");
+     }},
+    {"vkGetDeviceProcAddr (pass-through)",
+     [](const EntryPoints &ep, VkCommandBuffer, uint64_t n) {
+         for (uint64_t i = 0; i < n; i++)
+             opaque(ep.GetDeviceProcAddr)(ep.device, "vkCmdSetViewport");
+     }},
+    {"vkGetInstanceProcAddr (intercepted)",
+     [](const EntryPoints &ep, VkCommandBuffer, uint64_t n) {
+         for (uint64_t i = 0; i < n; i++)
+             opaque(ep.GetInstanceProcAddr)(ep.instance, "vkGetRandROutputDisplayEXT");
+     }},
+};
+
+// the application's allocation callbacks, counting what the layer asked them for
+std::atomic<uint64_t> callback_allocations{0};
+
+VKAPI_ATTR void *VKAPI_CALL
+callback_allocation(void *, size_t size, size_t alignment, VkSystemAllocationScope)
+{
+    callback_allocations.fetch_add(1, std::memory_order_relaxed);
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+VKAPI_ATTR void *VKAPI_CALL
+callback_reallocation(void *, void *, size_t, size_t, VkSystemAllocationScope)
+{
+    return NULL; // the layer never reallocates
+}
+
+VKAPI_ATTR void VKAPI_CALL callback_free(void *, void *p)
+{
+    free(p);
+}
+
+// the functions of one frame, through the layer
+struct FrameEntryPoints
+{
+    PFN_vkBeginCommandBuffer BeginCommandBuffer;
+    PFN_vkCmdDraw CmdDraw;
+    PFN_vkEndCommandBuffer EndCommandBuffer;
+    PFN_vkQueueSubmit QueueSubmit;
+    PFN_vkQueuePresentKHR QueuePresentKHR;
+};
+
+void run_frames(const FrameEntryPoints &ep, VkCommandBuffer cb, VkQueue queue, uint32_t frames)
+{
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &cb;
+
+    VkPresentInfoKHR present = {};
+    present.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+
+    for (uint32_t f = 0; f < frames; f++) {
+        ep.BeginCommandBuffer(cb, &begin_info);
+        for (uint32_t i = 0; i < 100; i++)
+            ep.CmdDraw(cb, 3, 1, 0, 0);
+        ep.EndCommandBuffer(cb);
+        ep.QueueSubmit(queue, 1, &submit, VK_NULL_HANDLE);
+        ep.QueuePresentKHR(queue, &present);
+    }
+}
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct Result
+{
+    double ns_per_call;
+    double calls_per_sec;
+};
+
+// every thread records into its own command buffer, as the spec requires
+Result run_case(const Case &c,
+                const EntryPoints &ep,
+                const std::vector<VkCommandBuffer> &commandBuffers,
+                uint32_t num_threads,
+                uint64_t iterations)
+{
+    std::atomic<uint32_t> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<uint64_t> elapsed(num_threads);
+    std::vector<std::thread> threads;
+
+    for (uint32_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            // warm up caches and the layer's lazily created state before the clock starts
+            c.run(ep, commandBuffers[t], iterations / 64 + 1);
+            ready.fetch_add(1);
+            while (!go.load())
+                std::this_thread::yield();
+
+            uint64_t start = now_ns();
+            c.run(ep, commandBuffers[t], iterations);
+            elapsed[t] = now_ns() - start;
+        });
+    }
+
+    while (ready.load() != num_threads)
+        std::this_thread::yield();
+    go.store(true);
+    for (std::thread &th : threads)
+        th.join();
+
+    uint64_t total = 0, slowest = 0;
+    for (uint64_t e : elapsed) {
+        total += e;
+        slowest = std::max(slowest, e);
+    }
+
+    Result r;
+    r.ns_per_call = (double) total / ((double) iterations * num_threads);
+    r.calls_per_sec = (double) iterations * num_threads / ((double) slowest * 1e-9);
+    return r;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 1u << 21;
+    uint32_t max_threads = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10)
+                                    : std::max(1u, std::thread::hardware_concurrency());
+    if (iterations == 0 || max_threads == 0) {
+        fprintf(stderr, "usage: %s [iterations per thread] [max threads]\n", argv[0]);
+        return 1;
+    }
+
+    // the loader's side of the chain: link info pointing at the mock
+    VkLayerInstanceLink instance_link = {};
+    instance_link.pfnNextGetInstanceProcAddr = mock_GetInstanceProcAddr;
+
+    VkLayerInstanceCreateInfo instance_link_info = {};
+    instance_link_info.sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO;
+    instance_link_info.function = VK_LAYER_LINK_INFO;
+    instance_link_info.u.pLayerInfo = &instance_link;
+
+    VkInstanceCreateInfo instance_info = {};
+    instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instance_info.pNext = &instance_link_info;
+
+    VkAllocationCallbacks callbacks = {};
+    callbacks.pfnAllocation = callback_allocation;
+    callbacks.pfnReallocation = callback_reallocation;
+    callbacks.pfnFree = callback_free;
+
+    uint64_t heap_before_create = heap_allocations.load();
+    VkInstance instance;
+    if (vkdisplayhacksteamvr_CreateInstance(&instance_info, &callbacks, &instance) != VK_SUCCESS) {
+        fprintf(stderr, "layer vkCreateInstance failed\n");
+        return 1;
+    }
+
+    VkLayerDeviceLink device_link = {};
+    device_link.pfnNextGetInstanceProcAddr = mock_GetInstanceProcAddr;
+    device_link.pfnNextGetDeviceProcAddr = mock_GetDeviceProcAddr;
+
+    VkLayerDeviceCreateInfo device_link_info = {};
+    device_link_info.sType = VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO;
+    device_link_info.function = VK_LAYER_LINK_INFO;
+    device_link_info.u.pLayerInfo = &device_link;
+
+    VkDeviceCreateInfo device_info = {};
+    device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_info.pNext = &device_link_info;
+
+    VkDevice device;
+    if (vkdisplayhacksteamvr_CreateDevice((VkPhysicalDevice) &mock_physical_device,
+                                          &device_info,
+                                          &callbacks,
+                                          &device)
+        != VK_SUCCESS) {
+        fprintf(stderr, "layer vkCreateDevice failed\n");
+        return 1;
+    }
+
+    printf("vkCreateInstance and vkCreateDevice: %llu allocations through the callbacks, "
+           "%llu on the heap\n",
+           (unsigned long long) callback_allocations.load(),
+           (unsigned long long) (heap_allocations.load() - heap_before_create));
+
+    PFN_vkGetDeviceProcAddr gdpa = vkdisplayhacksteamvr_GetDeviceProcAddr;
+
+    EntryPoints layer;
+    layer.instance = instance;
+    layer.device = device;
+    layer.GetInstanceProcAddr = vkdisplayhacksteamvr_GetInstanceProcAddr;
+    layer.GetDeviceProcAddr = gdpa;
+    layer.BeginCommandBuffer = (PFN_vkBeginCommandBuffer) gdpa(device, "vkBeginCommandBuffer");
+    layer.CmdDraw = (PFN_vkCmdDraw) gdpa(device, "vkCmdDraw");
+    layer.CmdDrawIndexed = (PFN_vkCmdDrawIndexed) gdpa(device, "vkCmdDrawIndexed");
+
+    EntryPoints next;
+    next.instance = instance;
+    next.device = device;
+    next.GetInstanceProcAddr = mock_GetInstanceProcAddr;
+    next.GetDeviceProcAddr = mock_GetDeviceProcAddr;
+    next.BeginCommandBuffer = mock_BeginCommandBuffer;
+    next.CmdDraw = mock_CmdDraw;
+    next.CmdDrawIndexed = mock_CmdDrawIndexed;
+
+    // allocated through the layer so that it tracks stats for them
+    VkCommandPool pool = (VkCommandPool) 1;
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = max_threads;
+
+    std::vector<VkCommandBuffer> commandBuffers(max_threads);
+    ((PFN_vkAllocateCommandBuffers) gdpa(device, "vkAllocateCommandBuffers"))(device,
+                                                                               &alloc_info,
+                                                                               commandBuffers.data());
+
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    std::vector<uint32_t> thread_counts;
+    for (uint32_t t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    printf("%llu iterations per thread, up to %u threads\n\n", (unsigned long long) iterations, max_threads);
+    printf("%-36s %7s %10s %10s %10s %14s\n",
+           "entry point",
+           "threads",
+           "layer ns",
+           "next ns",
+           "added ns",
+           "layer calls/s");
+
+    for (const Case &c : cases) {
+        for (uint32_t t : thread_counts) {
+            Result l = run_case(c, layer, commandBuffers, t, iterations);
+            Result n = run_case(c, next, commandBuffers, t, iterations);
+            printf("%-36s %7u %10.2f %10.2f %10.2f %14.0f\n",
+                   c.name,
+                   t,
+                   l.ns_per_call,
+                   n.ns_per_call,
+                   l.ns_per_call - n.ns_per_call,
+                   l.calls_per_sec);
+        }
+    }
+
+    FrameEntryPoints frame;
+    frame.BeginCommandBuffer = layer.BeginCommandBuffer;
+    frame.CmdDraw = layer.CmdDraw;
+    frame.EndCommandBuffer = (PFN_vkEndCommandBuffer) gdpa(device, "vkEndCommandBuffer");
+    frame.QueueSubmit = (PFN_vkQueueSubmit) gdpa(device, "vkQueueSubmit");
+    frame.QueuePresentKHR = (PFN_vkQueuePresentKHR) gdpa(device, "vkQueuePresentKHR");
+
+    // the first frames may still set up per-thread state like the log ring
+    const uint32_t frames = 10000;
+    run_frames(frame, commandBuffers[0], (VkQueue) &mock_queue, 100);
+    uint64_t heap_before = heap_allocations.load();
+    AllocStats layer_before = alloc_stats();
+    run_frames(frame, commandBuffers[0], (VkQueue) &mock_queue, frames);
+    uint64_t heap = heap_allocations.load() - heap_before;
+    uint64_t layer_allocations = alloc_stats().allocations - layer_before.allocations;
+    printf("\nsteady state, %u frames of 100 draws: %llu heap allocations, %llu by the layer%s\n",
+           frames,
+           (unsigned long long) heap,
+           (unsigned long long) layer_allocations,
+           heap == 0 && layer_allocations == 0 ? "" : " (expected none)");
+
+    ((PFN_vkFreeCommandBuffers) gdpa(device, "vkFreeCommandBuffers"))(device,
+                                                                       pool,
+                                                                       max_threads,
+                                                                       commandBuffers.data());
+    ((PFN_vkDestroyCommandPool) gdpa(device, "vkDestroyCommandPool"))(device, pool, NULL);
+    ((PFN_vkDestroyDevice) gdpa(device, "vkDestroyDevice"))(device, &callbacks);
+    ((PFN_vkDestroyInstance) vkdisplayhacksteamvr_GetInstanceProcAddr(instance,
+                                                                      "vkDestroyInstance"))(instance,
+                                                                                             &callbacks);
+
+    AllocStats end = alloc_stats();
+    printf("after vkDestroyInstance: %llu bytes still held by the layer\n",
+           (unsigned long long) end.live_bytes);
+    return heap == 0 && layer_allocations == 0 && end.live_bytes == 0 ? 0 : 1;
+}
@@ -0,0 +1,474 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  RandR enumeration latency against an in-process fake X server
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * The xcb and Xlib-xcb functions used by the RandR walk are defined here instead of being linked
+ * from libxcb, answering from a generated topology. Replies are only delivered after an injected
+ * round trip latency, and like a real connection one wait delivers everything sent before it, so
+ * pipelining shows up in the timings the same way it does against a remote X server.
+ *
+ * Next to the full inventory, where every output is resolved on the driver, it times what the
+ * layer does: the walk alone, picking the non-desktop output and resolving only that one.
+ *
+ * Usage: randr_enumeration [runs per configuration]
+ */
+
+// clock_gettime, nanosleep, dup
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
+#include <xcb/xcb.h>
+
+#include "vkdisplayhacksteamvr.h"
+
+#define MODES_PER_OUTPUT 16
+#define REQUEST_RING 4096
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Fake X server
+
+static struct
+{
+  // topology
+  uint32_t num_outputs;
+  uint32_t num_modes;
+  xcb_randr_mode_info_t *modes;
+  uint32_t minor_version;
+
+  // connection
+  uint64_t latency_ns;
+  unsigned int sent;
+  unsigned int answered;
+  uint32_t request_arg[REQUEST_RING];
+
+  // what the last enumeration cost
+  uint32_t round_trips;
+  uint32_t requests;
+  uint32_t driver_calls;
+} server;
+
+static xcb_setup_t fake_setup;
+static xcb_screen_t fake_screen = {.root = 1};
+
+static void server_setup(uint32_t num_outputs, uint64_t latency_ns)
+{
+  server.num_outputs = num_outputs;
+  server.latency_ns = latency_ns;
+  server.minor_version = 6;
+
+  // outputs share a pool of modes, listed out of id order like a real server does
+  server.num_modes = MODES_PER_OUTPUT * 2;
+  free(server.modes);
+  server.modes = calloc(server.num_modes, sizeof(xcb_randr_mode_info_t));
+  for (uint32_t i = 0; i < server.num_modes; i++) {
+    xcb_randr_mode_info_t *m = &server.modes[i];
+    m->id = 0x200 + (i * 7) % server.num_modes;
+    m->width = 1920 + 64 * (m->id & 0xff);
+    m->height = 1080 + 32 * (m->id & 0xff);
+    m->dot_clock = 148500000;
+    m->htotal = m->width + 280;
+    m->vtotal = m->height + 45;
+  }
+}
+
+static xcb_randr_output_t output_id(uint32_t index)
+{
+  return 0x40 + index;
+}
+
+// every fourth output is disconnected and has no modes, output 1 is the HMD
+static bool output_connected(uint32_t index)
+{
+  return index % 4 != 3;
+}
+
+static unsigned int server_send(uint32_t arg)
+{
+  server.requests++;
+  server.sent++;
+  server.request_arg[server.sent % REQUEST_RING] = arg;
+  return server.sent;
+}
+
+// blocks for one round trip unless the reply came back with an earlier one
+static uint32_t server_wait(unsigned int sequence)
+{
+  if (sequence > server.answered) {
+    if (server.latency_ns > 0) {
+      struct timespec ts = {
+          .tv_sec = server.latency_ns / 1000000000ull,
+          .tv_nsec = server.latency_ns % 1000000000ull,
+      };
+      nanosleep(&ts, NULL);
+    }
+    server.round_trips++;
+    server.answered = server.sent;
+  }
+  return server.request_arg[sequence % REQUEST_RING];
+}
+
+xcb_connection_t *XGetXCBConnection(Display *dpy)
+{
+  (void) dpy;
+  return (xcb_connection_t *) &server;
+}
+
+const struct xcb_setup_t *xcb_get_setup(xcb_connection_t *c)
+{
+  (void) c;
+  return &fake_setup;
+}
+
+xcb_screen_iterator_t xcb_setup_roots_iterator(const xcb_setup_t *R)
+{
+  (void) R;
+  xcb_screen_iterator_t iter = {.data = &fake_screen, .rem = 1, .index = 0};
+  return iter;
+}
+
+void xcb_screen_next(xcb_screen_iterator_t *i)
+{
+  i->data++;
+  i->rem--;
+  i->index += sizeof(xcb_screen_t);
+}
+
+xcb_randr_query_version_cookie_t
+xcb_randr_query_version(xcb_connection_t *c, uint32_t major_version, uint32_t minor_version)
+{
+  (void) c;
+  (void) major_version;
+  (void) minor_version;
+  xcb_randr_query_version_cookie_t cookie = {server_send(0)};
+  return cookie;
+}
+
+xcb_randr_query_version_reply_t *xcb_randr_query_version_reply(
+    xcb_connection_t *c, xcb_randr_query_version_cookie_t cookie, xcb_generic_error_t **e)
+{
+  (void) c;
+  (void) e;
+  server_wait(cookie.sequence);
+  xcb_randr_query_version_reply_t *reply = calloc(1, sizeof(*reply));
+  reply->major_version = 1;
+  reply->minor_version = server.minor_version;
+  return reply;
+}
+
+xcb_intern_atom_cookie_t
+xcb_intern_atom(xcb_connection_t *c, uint8_t only_if_exists, uint16_t name_len, const char *name)
+{
+  (void) c;
+  (void) only_if_exists;
+  (void) name_len;
+  (void) name;
+  xcb_intern_atom_cookie_t cookie = {server_send(0)};
+  return cookie;
+}
+
+xcb_intern_atom_reply_t *
+xcb_intern_atom_reply(xcb_connection_t *c, xcb_intern_atom_cookie_t cookie, xcb_generic_error_t **e)
+{
+  (void) c;
+  if (e != NULL)
+    *e = NULL;
+  server_wait(cookie.sequence);
+  xcb_intern_atom_reply_t *reply = calloc(1, sizeof(*reply));
+  reply->atom = 0x123;
+  return reply;
+}
+
+// both resources replies: the reply struct followed by the outputs and then the modes
+#define FAKE_SCREEN_RESOURCES(prefix)                                                           \
+  prefix##_cookie_t prefix(xcb_connection_t *c, xcb_window_t window)                            \
+  {                                                                                             \
+    (void) c;                                                                                   \
+    prefix##_cookie_t cookie = {server_send(window)};                                           \
+    return cookie;                                                                              \
+  }                                                                                             \
+                                                                                                \
+  prefix##_reply_t *prefix##_reply(xcb_connection_t *c,                                         \
+                                   prefix##_cookie_t cookie,                                    \
+                                   xcb_generic_error_t **e)                                     \
+  {                                                                                             \
+    (void) c;                                                                                   \
+    (void) e;                                                                                   \
+    server_wait(cookie.sequence);                                                               \
+    prefix##_reply_t *reply = calloc(1,                                                         \
+                                     sizeof(*reply)                                             \
+                                         + sizeof(xcb_randr_output_t) * server.num_outputs      \
+                                         + sizeof(xcb_randr_mode_info_t) * server.num_modes);   \
+    reply->num_outputs = server.num_outputs;                                                    \
+    reply->num_modes = server.num_modes;                                                        \
+    xcb_randr_output_t *outputs = (xcb_randr_output_t *) (reply + 1);                           \
+    for (uint32_t i = 0; i < server.num_outputs; i++)                                           \
+      outputs[i] = output_id(i);                                                                \
+    memcpy(outputs + server.num_outputs,                                                        \
+           server.modes,                                                                        \
+           sizeof(xcb_randr_mode_info_t) * server.num_modes);                                   \
+    return reply;                                                                               \
+  }                                                                                             \
+                                                                                                \
+  xcb_randr_output_t *prefix##_outputs(const prefix##_reply_t *R)                               \
+  {                                                                                             \
+    return (xcb_randr_output_t *) (R + 1);                                                      \
+  }                                                                                             \
+                                                                                                \
+  int prefix##_outputs_length(const prefix##_reply_t *R)                                        \
+  {                                                                                             \
+    return R->num_outputs;                                                                      \
+  }                                                                                             \
+                                                                                                \
+  xcb_randr_mode_info_t *prefix##_modes(const prefix##_reply_t *R)                              \
+  {                                                                                             \
+    return (xcb_randr_mode_info_t *) (prefix##_outputs(R) + R->num_outputs);                    \
+  }                                                                                             \
+                                                                                                \
+  int prefix##_modes_length(const prefix##_reply_t *R)                                          \
+  {                                                                                             \
+    return R->num_modes;                                                                        \
+  }
+
+FAKE_SCREEN_RESOURCES(xcb_randr_get_screen_resources)
+FAKE_SCREEN_RESOURCES(xcb_randr_get_screen_resources_current)
+
+#undef FAKE_SCREEN_RESOURCES
+
+xcb_randr_get_output_info_cookie_t
+xcb_randr_get_output_info(xcb_connection_t *c, xcb_randr_output_t output, xcb_timestamp_t config_timestamp)
+{
+  (void) c;
+  (void) config_timestamp;
+  xcb_randr_get_output_info_cookie_t cookie = {server_send(output)};
+  return cookie;
+}
+
+// the reply struct followed by the mode ids and the name
+xcb_randr_get_output_info_reply_t *xcb_randr_get_output_info_reply(
+    xcb_connection_t *c, xcb_randr_get_output_info_cookie_t cookie, xcb_generic_error_t **e)
+{
+  (void) c;
+  (void) e;
+  uint32_t index = server_wait(cookie.sequence) - output_id(0);
+
+  char name[16];
+  int name_len = snprintf(name, sizeof(name), "DP-%u", index);
+  uint32_t num_modes = output_connected(index) ? MODES_PER_OUTPUT : 0;
+
+  xcb_randr_get_output_info_reply_t *reply
+      = calloc(1, sizeof(*reply) + sizeof(xcb_randr_mode_t) * num_modes + name_len);
+  reply->num_modes = num_modes;
+  reply->num_preferred = num_modes > 0 ? 1 : 0;
+  reply->name_len = name_len;
+
+  xcb_randr_mode_t *modes = (xcb_randr_mode_t *) (reply + 1);
+  for (uint32_t j = 0; j < num_modes; j++)
+    modes[j] = server.modes[(index + j) % server.num_modes].id;
+  memcpy(modes + num_modes, name, name_len);
+  return reply;
+}
+
+xcb_randr_mode_t *xcb_randr_get_output_info_modes(const xcb_randr_get_output_info_reply_t *R)
+{
+  return (xcb_randr_mode_t *) (R + 1);
+}
+
+int xcb_randr_get_output_info_modes_length(const xcb_randr_get_output_info_reply_t *R)
+{
+  return R->num_modes;
+}
+
+uint8_t *xcb_randr_get_output_info_name(const xcb_randr_get_output_info_reply_t *R)
+{
+  return (uint8_t *) (xcb_randr_get_output_info_modes(R) + R->num_modes);
+}
+
+int xcb_randr_get_output_info_name_length(const xcb_randr_get_output_info_reply_t *R)
+{
+  return R->name_len;
+}
+
+xcb_randr_get_output_property_cookie_t xcb_randr_get_output_property(xcb_connection_t *c,
+                                                                     xcb_randr_output_t output,
+                                                                     xcb_atom_t property,
+                                                                     xcb_atom_t type,
+                                                                     uint32_t long_offset,
+                                                                     uint32_t long_length,
+                                                                     uint8_t _delete,
+                                                                     uint8_t pending)
+{
+  (void) c;
+  (void) property;
+  (void) type;
+  (void) long_offset;
+  (void) long_length;
+  (void) _delete;
+  (void) pending;
+  xcb_randr_get_output_property_cookie_t cookie = {server_send(output)};
+  return cookie;
+}
+
+// the non-desktop property: one 32 bit integer after the reply struct
+xcb_randr_get_output_property_reply_t *xcb_randr_get_output_property_reply(
+    xcb_connection_t *c, xcb_randr_get_output_property_cookie_t cookie, xcb_generic_error_t **e)
+{
+  (void) c;
+  if (e != NULL)
+    *e = NULL;
+  uint32_t index = server_wait(cookie.sequence) - output_id(0);
+
+  xcb_randr_get_output_property_reply_t *reply = calloc(1, sizeof(*reply) + sizeof(uint32_t));
+  reply->type = XCB_ATOM_INTEGER;
+  reply->format = 32;
+  reply->num_items = 1;
+  *(uint32_t *) (reply + 1) = index == 1 ? 1 : 0;
+  return reply;
+}
+
+uint8_t *xcb_randr_get_output_property_data(const xcb_randr_get_output_property_reply_t *R)
+{
+  return (uint8_t *) (R + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Vulkan mock
+
+static VKAPI_ATTR VkResult VKAPI_CALL mock_GetRandROutputDisplayEXT(VkPhysicalDevice physicalDevice,
+                                                                    Display *dpy,
+                                                                    RROutput rrOutput,
+                                                                    VkDisplayKHR *pDisplay)
+{
+  (void) physicalDevice;
+  (void) dpy;
+  server.driver_calls++;
+  *pDisplay = (VkDisplayKHR) (uintptr_t) rrOutput;
+  return VK_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+static int u64_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t runs = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : 15;
+  if (runs == 0) {
+    fprintf(stderr, "usage: %s [runs per configuration]\n", argv[0]);
+    return 1;
+  }
+
+  static const uint32_t output_counts[] = {2, 4, 8, 16, 32, 64};
+  static const uint64_t latencies_us[] = {0, 50, 250, 1000};
+
+  // the walk reports every display on stdout, keep that out of the results
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr, "could not redirect stdout\n");
+    return 1;
+  }
+
+  VkPhysicalDevice physical_device = (VkPhysicalDevice) (uintptr_t) 0x1000;
+  Display *dpy = (Display *) &server;
+  struct randr_display_inventory inv = {0};
+  uint64_t *samples = calloc(runs, sizeof(uint64_t));
+  uint64_t *targeted = calloc(runs, sizeof(uint64_t));
+
+  fprintf(report, "%u runs per configuration, %u modes per output\n\n", runs, MODES_PER_OUTPUT);
+  fprintf(report,
+          "%7s %9s %8s %11s %8s %10s %10s %10s %8s %12s %12s\n",
+          "outputs",
+          "displays",
+          "rtt us",
+          "round trips",
+          "requests",
+          "min ms",
+          "median ms",
+          "max ms",
+          "vk calls",
+          "targeted ms",
+          "target calls");
+
+  for (size_t l = 0; l < sizeof(latencies_us) / sizeof(latencies_us[0]); l++) {
+    for (size_t o = 0; o < sizeof(output_counts) / sizeof(output_counts[0]); o++) {
+      server_setup(output_counts[o], latencies_us[l] * 1000);
+
+      uint32_t targeted_calls = 0;
+      for (uint32_t r = 0; r < runs; r++) {
+        server.driver_calls = 0;
+        uint64_t start_ns = now_ns();
+        struct comp_window_direct_randr_display *d = NULL;
+        if (randr_inventory_walk(&inv, dpy) != 0
+            || (d = randr_inventory_select(&inv, "non-desktop")) == NULL
+            || randr_inventory_resolve(d, physical_device, mock_GetRandROutputDisplayEXT, dpy)
+                   == VK_NULL_HANDLE) {
+          fprintf(stderr, "targeted resolve of %u outputs failed\n", output_counts[o]);
+          return 1;
+        }
+        targeted[r] = now_ns() - start_ns;
+        targeted_calls = server.driver_calls;
+
+        server.driver_calls = 0;
+        server.round_trips = 0;
+        server.requests = 0;
+        if (randr_inventory_enumerate(&inv, &physical_device, 1, mock_GetRandROutputDisplayEXT, dpy, false)
+            != 0) {
+          fprintf(stderr, "enumeration of %u outputs failed\n", output_counts[o]);
+          return 1;
+        }
+        if (inv.round_trips != server.round_trips)
+          fprintf(report,
+                  "warning: inventory counted %u round trips, the server saw %u\n",
+                  inv.round_trips,
+                  server.round_trips);
+        samples[r] = inv.enumeration_ns;
+      }
+
+      qsort(samples, runs, sizeof(uint64_t), u64_cmp);
+      qsort(targeted, runs, sizeof(uint64_t), u64_cmp);
+      fprintf(report,
+              "%7u %9u %8llu %11u %8u %10.3f %10.3f %10.3f %8u %12.3f %12u\n",
+              output_counts[o],
+              inv.num_displays,
+              (unsigned long long) latencies_us[l],
+              server.round_trips,
+              server.requests,
+              samples[0] / 1e6,
+              samples[runs / 2] / 1e6,
+              samples[runs - 1] / 1e6,
+              server.driver_calls,
+              targeted[runs / 2] / 1e6,
+              targeted_calls);
+    }
+  }
+
+  randr_inventory_destroy(&inv);
+  free(samples);
+  free(targeted);
+  free(server.modes);
+  fclose(report);
+  return 0;
+}
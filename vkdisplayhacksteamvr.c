@@ -8,10 +8,20 @@
  * xcb/randr code taken from monado
  */
 
+// clock_gettime, nanosleep, kill, shm_open
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include <vulkan/vulkan.h>
 
 #include <X11/Xlib-xcb.h>
@@ -22,6 +32,9 @@
 #include <X11/extensions/Xrandr.h>
 #include <vulkan/vulkan_xlib_xrandr.h>
 
+#include "vkdisplayhacksteamvr.h"
+#include "vkdisplayhacksteamvr_telemetry.h"
+
 static int display_info(VkInstance instance, VkPhysicalDevice *physical_devices,
                         uint32_t num_physical_devices) {
   VkResult result = VK_ERROR_UNKNOWN;
@@ -131,267 +144,57 @@ static int display2_info(VkInstance instance,
   return 0;
 }
 
-struct comp_window_direct_randr_display
+static uint64_t now_ns(void)
 {
-  char *name;
-  xcb_randr_output_t output;
-  xcb_randr_mode_info_t primary_mode;
-  VkDisplayKHR display;
-};
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-VkDisplayKHR get_display(VkInstance instance,
-                         PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
-                         char *override)
+// the steps between starting a Vulkan application and knowing its displays, timed by --bench
+enum phase
 {
-  VkResult result;
-
-  uint32_t num_physical_devices = 0;
-  result = vkEnumeratePhysicalDevices(instance, &num_physical_devices, NULL);
-  if (result != VK_SUCCESS) {
-    printf("Failed to get number of physical devices\n");
-    return VK_NULL_HANDLE;
-  }
-
-  VkPhysicalDevice *physical_devices = malloc(sizeof(VkPhysicalDevice) * num_physical_devices);
-  result = vkEnumeratePhysicalDevices(instance, &num_physical_devices, physical_devices);
-  if (result != VK_SUCCESS) {
-    printf("Failed to get physical devices\n");
-    return VK_NULL_HANDLE;
-  }
-
-  Display *dpy = XOpenDisplay(NULL);
-  if (dpy == NULL) {
-    printf("Could not open X display.");
-    return VK_NULL_HANDLE;
-  }
-
-  xcb_connection_t *connection = XGetXCBConnection(dpy);
-
-  uint32_t display_count = 0;
-  struct comp_window_direct_randr_display displays[100] = {0};
-
-  // comp_window_direct_randr_init
-  {
-    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(connection));
-
-    xcb_screen_t *screen = NULL;
-    while (iter.rem > 0 && display_count == 0) {
-      screen = iter.data;
-
-      // comp_window_direct_randr_get_outputs
-      {
-        xcb_connection_t *connection = XGetXCBConnection(dpy);
-        xcb_randr_query_version_cookie_t version_cookie
-            = xcb_randr_query_version(connection, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
-        xcb_randr_query_version_reply_t *version_reply
-            = xcb_randr_query_version_reply(connection, version_cookie, NULL);
-
-        if (version_reply == NULL) {
-            printf("Could not get RandR version.\n");
-            return VK_NULL_HANDLE;
-        }
-
-        printf("RandR version %d.%d\n", version_reply->major_version, version_reply->minor_version);
-
-        if (version_reply->major_version < 1 || version_reply->minor_version < 6) {
-            printf("RandR version below 1.6.\n");
-        }
-
-        free(version_reply);
-
-        xcb_generic_error_t *error = NULL;
-        xcb_intern_atom_cookie_t non_desktop_cookie = xcb_intern_atom(connection,
-                                                                      1,
-                                                                      strlen("non-desktop"),
-                                                                      "non-desktop\n");
-        xcb_intern_atom_reply_t *non_desktop_reply = xcb_intern_atom_reply(connection,
-                                                                           non_desktop_cookie,
-                                                                           &error);
-
-        if (error != NULL) {
-            free(non_desktop_reply);
-            printf("xcb_intern_atom_reply returned error %d\n", error->error_code);
-            return VK_NULL_HANDLE;
-        }
-
-        if (non_desktop_reply == NULL) {
-            printf("non-desktop reply NULL\n");
-            return VK_NULL_HANDLE;
-        }
-
-        if (non_desktop_reply->atom == XCB_NONE) {
-            free(non_desktop_reply);
-            printf("No output has non-desktop property\n");
-            return VK_NULL_HANDLE;
-        }
-
-        xcb_randr_get_screen_resources_cookie_t resources_cookie
-            = xcb_randr_get_screen_resources(connection, screen->root);
-        xcb_randr_get_screen_resources_reply_t *resources_reply
-            = xcb_randr_get_screen_resources_reply(connection, resources_cookie, NULL);
-        xcb_randr_output_t *xcb_outputs = xcb_randr_get_screen_resources_outputs(resources_reply);
-
-        int count = xcb_randr_get_screen_resources_outputs_length(resources_reply);
-        if (count < 1) {
-            printf("failed to retrieve randr outputs\n");
-        }
-
-        for (int i = 0; i < count; i++) {
-            xcb_randr_get_output_info_cookie_t output_cookie
-                = xcb_randr_get_output_info(connection, xcb_outputs[i], XCB_CURRENT_TIME);
-            xcb_randr_get_output_info_reply_t *output_reply
-                = xcb_randr_get_output_info_reply(connection, output_cookie, NULL);
-
-            // Only outputs with an available mode should be used
-            // (it is possible to see 'ghost' outputs with non-desktop=1).
-            if (output_reply->num_modes == 0) {
-                free(output_reply);
-                continue;
-            }
-
-            // Find the first output that has the non-desktop property set.
-            xcb_randr_get_output_property_cookie_t prop_cookie;
-            prop_cookie = xcb_randr_get_output_property(connection,
-                                                        xcb_outputs[i],
-                                                        non_desktop_reply->atom,
-                                                        XCB_ATOM_NONE,
-                                                        0,
-                                                        4,
-                                                        0,
-                                                        0);
-            xcb_randr_get_output_property_reply_t *prop_reply = NULL;
-            prop_reply = xcb_randr_get_output_property_reply(connection, prop_cookie, &error);
-            if (error != NULL) {
-                printf("xcb_randr_get_output_property_reply "
-                       "returned error %d\n",
-                       error->error_code);
-                free(prop_reply);
-                continue;
-            }
-
-            if (prop_reply == NULL) {
-                printf("property reply == NULL\n");
-                free(prop_reply);
-                continue;
-            }
-
-            if (prop_reply->type != XCB_ATOM_INTEGER || prop_reply->num_items != 1
-                || prop_reply->format != 32) {
-                printf("Invalid non-desktop reply\n");
-                free(prop_reply);
-                continue;
-            }
-
-            uint8_t non_desktop = *xcb_randr_get_output_property_data(prop_reply);
-            if (non_desktop == 1 || true) {
-                // append_randr_display
-                {
-                    xcb_randr_mode_t *output_modes = xcb_randr_get_output_info_modes(output_reply);
-
-                    uint8_t *name = xcb_randr_get_output_info_name(output_reply);
-                    int name_len = xcb_randr_get_output_info_name_length(output_reply);
-
-                    int mode_count = xcb_randr_get_output_info_modes_length(output_reply);
-                    if (mode_count == 0) {
-                        printf("%s does not have any modes "
-                               "available. "
-                               "Check `xrandr --prop`.\n",
-                               name);
-                    }
-
-                    xcb_randr_mode_info_t *mode_infos = xcb_randr_get_screen_resources_modes(
-                        resources_reply);
-
-                    int n = xcb_randr_get_screen_resources_modes_length(resources_reply);
-
-                    xcb_randr_mode_info_t *mode_info = NULL;
-                    for (int i = 0; i < n; i++)
-                        if (mode_infos[i].id == output_modes[0])
-                            mode_info = &mode_infos[i];
-
-                    if (mode_info == NULL)
-                        printf("No mode with id %d found??\n", output_modes[0]);
-
-                    struct comp_window_direct_randr_display d = {
-                        .name = malloc(sizeof(char) * (name_len + 1)),
-                        .output = xcb_outputs[i],
-                        .primary_mode = *mode_info,
-                        .display = VK_NULL_HANDLE,
-                    };
-
-                    memcpy(d.name, name, name_len);
-                    d.name[name_len] = '\0';
-
-                    {
-                        // TODO: other physical devices?
-                        VkResult ret = _vkGetRandROutputDisplayEXT(physical_devices[0],
-                                                                   dpy,
-                                                                   d.output,
-                                                                   &d.display);
-                        if (ret != VK_SUCCESS) {
-                            printf("vkGetRandROutputDisplayEXT failed: %d\n", ret);
-                            return VK_NULL_HANDLE;
-                        }
-
-                        if (d.display == VK_NULL_HANDLE) {
-                            printf("vkGetRandROutputDisplayEXT returned a null display for %s, "
-                                   "ignoring...\n",
-                                   d.name);
-                            continue;
-                        }
-                    }
-
-                    display_count += 1;
-
-                    displays[display_count - 1] = d;
-                    printf("randr display #%d: %s with primary mode %dx%d\n",
-                           display_count - 1,
-                           displays[display_count - 1].name,
-                           displays[display_count - 1].primary_mode.width,
-                           displays[display_count - 1].primary_mode.height);
-                }
-            }
-
-            free(prop_reply);
-            free(output_reply);
-        }
-
-        free(non_desktop_reply);
-        free(resources_reply);
-      }
-      xcb_screen_next(&iter);
-    }
-  }
-
-  for (uint32_t i = 0; i < display_count; i++) {
-    if (override != NULL && strcmp(displays[i].name, override) == 0) {
-      printf("override found: returning VkDisplayKHR for %s\n", displays[i].name);
-      return displays[i].display;
-    }
-  }
-
-  int ret = 0;
-  //
-  //    if (exts.display2) {
-  //      printf("Using vkGetPhysicalDeviceDisplayProperties2KHR\n");
-  //      display2_info(instance, physical_devices, num_physical_devices);
-  //    } else {
-  //      printf("Using vkGetPhysicalDeviceDisplayPropertiesKHR\n");
-  //      display_info(instance, physical_devices, num_physical_devices);
-  //    }
-
-  free(physical_devices);
-
-  vkDestroyInstance(instance, NULL);
+  PHASE_EXTENSIONS,
+  PHASE_CREATE_INSTANCE,
+  PHASE_PHYSICAL_DEVICES,
+  PHASE_OPEN_DISPLAY,
+  PHASE_RANDR_VERSION,
+  PHASE_RANDR_RESOURCES,
+  PHASE_RANDR_OUTPUTS,
+  PHASE_RESOLVE,
+  PHASE_TOTAL,
+  PHASE_COUNT
+};
 
-  return NULL;
-}
+static const struct
+{
+  const char *name;
+  const char *key; // in the JSON report
+} phases[PHASE_COUNT] = {
+    {"vkEnumerateInstanceExtensionProperties", "extensions"},
+    {"vkCreateInstance", "create_instance"},
+    {"vkEnumeratePhysicalDevices", "physical_devices"},
+    {"XOpenDisplay", "open_display"},
+    {"RandR version and atom", "randr_version"},
+    {"RandR screen resources", "randr_resources"},
+    {"RandR output queries", "randr_outputs"},
+    {"vkGetRandROutputDisplayEXT", "resolve"},
+    {"total", "total"},
+};
 
-int main(void)
+// everything one run resolves, from the instance down to the displays
+struct inventory
 {
-  printf("vkdisplayhacksteamvr\n");
-  printf("=============\n");
+  VkInstance instance;
+  VkPhysicalDevice *physical_devices;
+  uint32_t num_physical_devices;
+  Display *dpy;
+  struct randr_display_inventory randr;
+};
 
+// an instance with the display extensions the driver has
+static int instance_create(VkInstance *instance, uint64_t times[PHASE_COUNT])
+{
   VkResult result;
 
   struct
@@ -402,6 +205,7 @@ int main(void)
   } exts = {false};
 
   {
+    uint64_t start = now_ns();
     uint32_t num_supported_exts = 0;
     result = vkEnumerateInstanceExtensionProperties(NULL, &num_supported_exts, NULL);
     if (result != VK_SUCCESS) {
@@ -411,8 +215,10 @@ int main(void)
 
     VkExtensionProperties *ext_props = malloc(sizeof(VkExtensionProperties) * num_supported_exts);
     result = vkEnumerateInstanceExtensionProperties(NULL, &num_supported_exts, ext_props);
+    times[PHASE_EXTENSIONS] = now_ns() - start;
     if (result != VK_SUCCESS) {
       printf("Failed to get supported extensions\n");
+      free(ext_props);
       return 1;
     }
 
@@ -430,6 +236,7 @@ int main(void)
         printf("instance extension %s is supported\n", VK_KHR_SURFACE_EXTENSION_NAME);
       }
     }
+    free(ext_props);
   }
 
   if (!exts.surface) {
@@ -477,16 +284,437 @@ int main(void)
 
   };
 
-  VkInstance instance;
-  result = vkCreateInstance(&instance_info, NULL, &instance);
+  uint64_t start = now_ns();
+  result = vkCreateInstance(&instance_info, NULL, instance);
+  times[PHASE_CREATE_INSTANCE] = now_ns() - start;
   if (result != VK_SUCCESS) {
     printf("Failed to create vulkan instance\n");
     return 1;
   }
+  return 0;
+}
+
+static void inventory_destroy(struct inventory *inv)
+{
+  randr_inventory_destroy(&inv->randr);
+  if (inv->dpy != NULL)
+    XCloseDisplay(inv->dpy);
+  free(inv->physical_devices);
+  if (inv->instance != VK_NULL_HANDLE)
+    vkDestroyInstance(inv->instance, NULL);
+  memset(inv, 0, sizeof(*inv));
+}
 
-  PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT = _vkGetRandROutputDisplayEXT
-      = (PFN_vkGetRandROutputDisplayEXT) vkGetInstanceProcAddr(instance,
-                                                               "vkGetRandROutputDisplayEXT");
+// resolves which outputs have a VkDisplayKHR on which GPU, timing each step. inv must be zeroed,
+// and is left for inventory_destroy() even on failure.
+static int inventory_build(struct inventory *inv, uint64_t times[PHASE_COUNT])
+{
+  uint64_t start = now_ns();
+  if (instance_create(&inv->instance, times) != 0)
+    return 1;
+
+  uint64_t phase_start = now_ns();
+  VkResult result = vkEnumeratePhysicalDevices(inv->instance, &inv->num_physical_devices, NULL);
+  if (result != VK_SUCCESS || inv->num_physical_devices == 0) {
+    printf("Failed to get number of physical devices\n");
+    return 1;
+  }
+
+  inv->physical_devices = malloc(sizeof(VkPhysicalDevice) * inv->num_physical_devices);
+  result = vkEnumeratePhysicalDevices(inv->instance,
+                                      &inv->num_physical_devices,
+                                      inv->physical_devices);
+  times[PHASE_PHYSICAL_DEVICES] = now_ns() - phase_start;
+  if (result != VK_SUCCESS) {
+    printf("Failed to get physical devices\n");
+    return 1;
+  }
+
+  PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT = (PFN_vkGetRandROutputDisplayEXT)
+      vkGetInstanceProcAddr(inv->instance, "vkGetRandROutputDisplayEXT");
+  if (_vkGetRandROutputDisplayEXT == NULL) {
+    printf("Failed to get vkGetRandROutputDisplayEXT function\n");
+    return 1;
+  }
+
+  phase_start = now_ns();
+  inv->dpy = XOpenDisplay(NULL);
+  times[PHASE_OPEN_DISPLAY] = now_ns() - phase_start;
+  if (inv->dpy == NULL) {
+    printf("Could not open X display.\n");
+    return 1;
+  }
+
+  // main() called XInitThreads(), so the GPUs can be probed in parallel
+  int ret = randr_inventory_enumerate(&inv->randr,
+                                      inv->physical_devices,
+                                      inv->num_physical_devices,
+                                      _vkGetRandROutputDisplayEXT,
+                                      inv->dpy,
+                                      true);
+  times[PHASE_RANDR_VERSION] = inv->randr.version_ns;
+  times[PHASE_RANDR_RESOURCES] = inv->randr.resources_ns;
+  times[PHASE_RANDR_OUTPUTS] = inv->randr.outputs_ns;
+  times[PHASE_RESOLVE] = inv->randr.resolve_ns;
+  times[PHASE_TOTAL] = now_ns() - start;
+
+  return ret == 0 ? 0 : 1;
+}
+
+// prints which outputs resolve to a VkDisplayKHR on which GPU
+static void inventory_print(const struct inventory *inv)
+{
+  printf("RandR version %u.%u\n", inv->randr.version_major, inv->randr.version_minor);
+  if (inv->randr.version_major < 1
+      || (inv->randr.version_major == 1 && inv->randr.version_minor < 6))
+    printf("RandR version below 1.6.\n");
+  printf("RandR enumeration took %u round trips, %.3f ms, %.3f ms of it resolving displays\n",
+         inv->randr.round_trips,
+         inv->randr.enumeration_ns / 1e6,
+         inv->randr.resolve_ns / 1e6);
+
+  printf("\n");
+  for (uint32_t p = 0; p < inv->num_physical_devices; p++) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(inv->physical_devices[p], &props);
+    printf("GPU %u: %s\n", p, props.deviceName);
+
+    for (uint32_t i = 0; i < inv->randr.num_displays; i++) {
+      struct comp_window_direct_randr_display *d = &inv->randr.displays[i];
+      if (d->physical_device != inv->physical_devices[p])
+        continue;
+
+      printf("  %s (RROutput %u%s) -> VkDisplayKHR %p, %dx%d, %u modes\n",
+             d->name,
+             d->output,
+             d->non_desktop ? ", non-desktop" : "",
+             (void *) d->display,
+             d->primary_mode.width,
+             d->primary_mode.height,
+             d->num_modes);
+    }
+  }
+}
+
+static void json_string(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+// from the mode's timings like xrandr does, 0 for a mode without them
+static double mode_refresh_hz(const xcb_randr_mode_info_t *m)
+{
+  double vtotal = m->vtotal;
+  if (m->mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN)
+    vtotal *= 2;
+  if (m->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE)
+    vtotal /= 2;
+  return m->htotal > 0 && vtotal > 0 ? m->dot_clock / (m->htotal * vtotal) : 0.0;
+}
+
+// the full GPU, output and mode inventory, modes in RandR order with the preferred ones first
+static void inventory_print_json(FILE *out, const struct inventory *inv)
+{
+  fprintf(out, "{\"gpus\": [");
+  for (uint32_t p = 0; p < inv->num_physical_devices; p++) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(inv->physical_devices[p], &props);
+    fprintf(out, "%s\n  {\"index\": %u, \"name\": ", p > 0 ? "," : "", p);
+    json_string(out, props.deviceName);
+    fprintf(out,
+            ", \"vendor_id\": %u, \"device_id\": %u, \"outputs\": [",
+            props.vendorID,
+            props.deviceID);
+
+    bool first = true;
+    for (uint32_t i = 0; i < inv->randr.num_displays; i++) {
+      const struct comp_window_direct_randr_display *d = &inv->randr.displays[i];
+      if (d->physical_device != inv->physical_devices[p])
+        continue;
+
+      fprintf(out, "%s\n    {\"name\": ", first ? "" : ",");
+      json_string(out, d->name);
+      fprintf(out,
+              ", \"output\": %u, \"non_desktop\": %s, \"display\": \"0x%llx\", \"modes\": [",
+              d->output,
+              d->non_desktop ? "true" : "false",
+              (unsigned long long) (uintptr_t) d->display);
+      for (uint32_t m = 0; m < d->num_modes; m++)
+        fprintf(out,
+                "%s\n      {\"id\": %u, \"width\": %u, \"height\": %u, \"refresh_hz\": %.3f}",
+                m > 0 ? "," : "",
+                d->modes[m].id,
+                d->modes[m].width,
+                d->modes[m].height,
+                mode_refresh_hz(&d->modes[m]));
+      fprintf(out, "]}");
+      first = false;
+    }
+    fprintf(out, "]}");
+  }
+  fprintf(out,
+          "],\n \"round_trips\": %u, \"enumeration_ms\": %.3f}\n",
+          inv->randr.round_trips,
+          inv->randr.enumeration_ns / 1e6);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t va = *(const uint64_t *) a;
+  uint64_t vb = *(const uint64_t *) b;
+  return va < vb ? -1 : va > vb;
+}
+
+// nearest rank on sorted values
+static uint64_t percentile(const uint64_t *sorted, uint32_t count, double p)
+{
+  uint32_t rank = (uint32_t) (p * count);
+  return sorted[rank < count ? rank : count - 1];
+}
+
+// builds the inventory from scratch iterations times and reports min, median and p99 per phase
+static int bench(FILE *out, uint32_t iterations, bool json)
+{
+  uint64_t *samples = calloc((size_t) PHASE_COUNT * iterations, sizeof(uint64_t));
+  uint32_t done = 0;
+  for (; done < iterations; done++) {
+    uint64_t times[PHASE_COUNT] = {0};
+    struct inventory inv = {0};
+    int ret = inventory_build(&inv, times);
+    inventory_destroy(&inv);
+    if (ret != 0)
+      break;
+    for (uint32_t p = 0; p < PHASE_COUNT; p++)
+      samples[(size_t) p * iterations + done] = times[p];
+  }
+  if (done < iterations) {
+    fprintf(stderr, "iteration %u failed, run without --bench to see why\n", done);
+    free(samples);
+    return 1;
+  }
+
+  if (json)
+    fprintf(out, "{\"iterations\": %u, \"phases\": [", iterations);
+  else
+    fprintf(out,
+            "%u iterations\n\n%-40s %12s %12s %12s\n",
+            iterations,
+            "phase",
+            "min ms",
+            "median ms",
+            "p99 ms");
+
+  for (uint32_t p = 0; p < PHASE_COUNT; p++) {
+    uint64_t *s = &samples[(size_t) p * iterations];
+    qsort(s, iterations, sizeof(uint64_t), compare_u64);
+    double min = s[0] / 1e6;
+    double median = percentile(s, iterations, 0.5) / 1e6;
+    double p99 = percentile(s, iterations, 0.99) / 1e6;
+    if (json)
+      fprintf(out,
+              "%s\n  {\"phase\": \"%s\", \"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f}",
+              p > 0 ? "," : "",
+              phases[p].key,
+              min,
+              median,
+              p99);
+    else
+      fprintf(out, "%-40s %12.4f %12.4f %12.4f\n", phases[p].name, min, median, p99);
+  }
+  if (json)
+    fprintf(out, "]}\n");
+
+  free(samples);
+  return 0;
+}
+
+static bool process_alive(int pid)
+{
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// the telemetry segment of the first live process that has one
+static int monitor_find_pid(void)
+{
+  DIR *dir = opendir("/dev/shm");
+  if (dir == NULL)
+    return 0;
+
+  int pid = 0;
+  struct dirent *entry;
+  while (pid == 0 && (entry = readdir(dir)) != NULL) {
+    int candidate;
+    if (sscanf(entry->d_name, TELEMETRY_NAME_FORMAT + 1, &candidate) == 1 && process_alive(candidate))
+      pid = candidate;
+  }
+  closedir(dir);
+  return pid;
+}
+
+// attaches to the layer's telemetry segment and prints the live rates of every device once a second
+static int monitor(int pid)
+{
+  if (pid == 0)
+    pid = monitor_find_pid();
+  if (pid == 0) {
+    printf("No process with a vkdisplayhacksteamvr telemetry segment found\n");
+    return 1;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), TELEMETRY_NAME_FORMAT, pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    printf("Could not open telemetry segment %s\n", name);
+    return 1;
+  }
+  const struct telemetry_segment *segment
+      = mmap(NULL, sizeof(struct telemetry_segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    printf("Could not map telemetry segment %s\n", name);
+    return 1;
+  }
+
+  if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC
+      || segment->version != TELEMETRY_VERSION) {
+    printf("Telemetry segment %s has an unknown layout\n", name);
+    munmap((void *) segment, sizeof(struct telemetry_segment));
+    return 1;
+  }
+
+  printf("Monitoring pid %d, ctrl+c to stop\n", pid);
+
+  struct telemetry_device prev[TELEMETRY_MAX_DEVICES] = {0};
+  bool have_prev[TELEMETRY_MAX_DEVICES] = {false};
+  double prev_s[TELEMETRY_MAX_DEVICES] = {0};
+
+  while (process_alive(pid)) {
+    struct timespec interval = {.tv_sec = 1, .tv_nsec = 0};
+    nanosleep(&interval, NULL);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now_s = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    for (uint32_t i = 0; i < TELEMETRY_MAX_DEVICES; i++) {
+      struct telemetry_device cur;
+      enum telemetry_read_result res = telemetry_read_device(&segment->devices[i], &cur);
+      if (res == TELEMETRY_READ_BUSY)
+        continue; // skipped this time, the next rates cover the longer interval
+      if (res == TELEMETRY_READ_UNUSED) {
+        have_prev[i] = false;
+        continue;
+      }
+
+      // a new device in the slot starts from scratch
+      if (!have_prev[i] || prev[i].device != cur.device) {
+        prev[i] = cur;
+        prev_s[i] = now_s;
+        have_prev[i] = true;
+        continue;
+      }
+
+      const struct telemetry_device *p = &prev[i];
+      double dt = now_s - prev_s[i];
+      uint64_t overhead_calls = cur.overhead_calls - p->overhead_calls;
+      printf("device 0x%llx: %8.0f cmdbufs/s %10.0f draws/s %8.2f Mverts/s %6.1f fps "
+             "%6llu draws/frame | layer %.3f%% cpu, %.0f ns/call, %.0f allocs/s, %llu KiB held\n",
+             (unsigned long long) cur.device,
+             (cur.command_buffers - p->command_buffers) / dt,
+             (cur.draws - p->draws) / dt,
+             (cur.vertices - p->vertices) / dt / 1e6,
+             (cur.frames - p->frames) / dt,
+             (unsigned long long) cur.frame_draws,
+             (cur.overhead_ns - p->overhead_ns) / (dt * 1e9) * 100.0,
+             overhead_calls > 0 ? (double) (cur.overhead_ns - p->overhead_ns) / overhead_calls : 0.0,
+             (cur.layer_allocations - p->layer_allocations) / dt,
+             (unsigned long long) (cur.layer_live_bytes / 1024));
+      prev[i] = cur;
+      prev_s[i] = now_s;
+    }
+    fflush(stdout);
+  }
+
+  printf("Process %d exited\n", pid);
+  munmap((void *) segment, sizeof(struct telemetry_segment));
+  return 0;
+}
+
+static void usage(const char *argv0)
+{
+  printf("Usage: %s [--json] [--bench <iterations>]\n"
+         "       %s --monitor [pid]\n",
+         argv0,
+         argv0);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "--monitor") == 0)
+    return monitor(argc > 2 ? atoi(argv[2]) : 0);
+
+  bool json = false;
+  uint32_t bench_iterations = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc
+               && (bench_iterations = (uint32_t) strtoul(argv[i + 1], NULL, 10)) > 0) {
+      i++;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // before any other Xlib call, the display map probes GPUs from several threads
+  XInitThreads();
+
+  // The report goes to stdout on its own so it can be parsed. What the walk, the loader and the
+  // drivers print goes to stderr, or nowhere while benchmarking.
+  FILE *out = stdout;
+  if (json || bench_iterations > 0) {
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    bool redirected = bench_iterations > 0 ? freopen("/dev/null", "w", stdout) != NULL
+                                           : dup2(STDERR_FILENO, STDOUT_FILENO) >= 0;
+    if (out == NULL || !redirected) {
+      fprintf(stderr, "could not redirect stdout\n");
+      return 1;
+    }
+  }
+
+  if (bench_iterations > 0) {
+    int ret = bench(out, bench_iterations, json);
+    fclose(out);
+    return ret;
+  }
+
+  printf("vkdisplayhacksteamvr\n");
+  printf("=============\n");
+
+  uint64_t times[PHASE_COUNT] = {0};
+  struct inventory inv = {0};
+  int ret = inventory_build(&inv, times);
+  if (ret == 0) {
+    if (json)
+      inventory_print_json(out, &inv);
+    else
+      inventory_print(&inv);
+  }
+  inventory_destroy(&inv);
 
-  VkDisplayKHR d = get_display(instance, _vkGetRandROutputDisplayEXT, false);
+  if (out != stdout)
+    fclose(out);
+  return ret;
 }
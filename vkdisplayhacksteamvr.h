@@ -0,0 +1,118 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  RandR output to VkDisplayKHR resolution, shared by the CLI and the layer
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+#include <xcb/randr.h>
+#include <vulkan/vulkan_xlib_xrandr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct comp_window_direct_randr_display
+{
+  char *name;
+  xcb_randr_output_t output;
+  bool non_desktop;
+  xcb_randr_mode_info_t primary_mode;
+  // every mode of the output, in RandR order with the preferred modes first
+  xcb_randr_mode_info_t *modes;
+  uint32_t num_modes;
+  // the GPU the display was resolved on, VK_NULL_HANDLE until then
+  VkPhysicalDevice physical_device;
+  VkDisplayKHR display;
+};
+
+// RandR outputs with modes and their VkDisplayKHR per physical device, grows as needed
+struct randr_display_inventory
+{
+  struct comp_window_direct_randr_display *displays;
+  uint32_t num_displays;
+  uint32_t capacity;
+
+  // RandR version the X server reported, 0.0 until a walk got that far
+  uint32_t version_major;
+  uint32_t version_minor;
+
+  // cost of the last enumeration
+  uint32_t round_trips;
+  uint64_t enumeration_ns;
+  // where it went: RandR version and non-desktop atom, screen resources, output info and
+  // properties, and vkGetRandROutputDisplayEXT on every physical device
+  uint64_t version_ns;
+  uint64_t resources_ns;
+  uint64_t outputs_ns;
+  uint64_t resolve_ns;
+};
+
+/*!
+ * Walk the RandR outputs of @p dpy without calling into the driver: every output that has modes,
+ * with its name, non-desktop property and modes, but no physical device or VkDisplayKHR yet.
+ *
+ * Replaces the previous contents of @p inv, which must be zero initialized before first use.
+ * Returns 0 on success, -1 on error with @p inv left empty.
+ */
+int randr_inventory_walk(struct randr_display_inventory *inv, Display *dpy);
+
+/*!
+ * The full inventory: walk the RandR outputs of @p dpy and resolve the VkDisplayKHR of every
+ * output that has modes on each of the given physical devices, an output shows up once per device
+ * it resolves on.
+ *
+ * With @p parallel the devices are probed from one thread each, which requires XInitThreads().
+ * Same contract as randr_inventory_walk().
+ */
+int randr_inventory_enumerate(struct randr_display_inventory *inv,
+                              const VkPhysicalDevice *physical_devices,
+                              uint32_t num_physical_devices,
+                              PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
+                              Display *dpy,
+                              bool parallel);
+
+/*!
+ * The output of a walked inventory that @p selector asks for: the output of that name, or with
+ * "non-desktop" the first output that has the non-desktop property set. NULL if there is none.
+ */
+struct comp_window_direct_randr_display *
+randr_inventory_select(const struct randr_display_inventory *inv, const char *selector);
+
+/*!
+ * Resolve one output of a walked inventory on @p physical_device, with a single
+ * vkGetRandROutputDisplayEXT call the first time. The result, VK_NULL_HANDLE if the device has no
+ * display for the output, is kept in @p d, so an inventory is meant for one physical device.
+ */
+VkDisplayKHR randr_inventory_resolve(struct comp_window_direct_randr_display *d,
+                                     VkPhysicalDevice physical_device,
+                                     PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
+                                     Display *dpy);
+
+// drops all displays but keeps the storage for the next enumeration
+void randr_inventory_clear(struct randr_display_inventory *inv);
+
+void randr_inventory_destroy(struct randr_display_inventory *inv);
+
+// lookups match any physical device when physical_device is VK_NULL_HANDLE
+struct comp_window_direct_randr_display *
+randr_inventory_find_name(const struct randr_display_inventory *inv,
+                          VkPhysicalDevice physical_device,
+                          const char *name);
+
+struct comp_window_direct_randr_display *
+randr_inventory_find_output(const struct randr_display_inventory *inv,
+                            VkPhysicalDevice physical_device,
+                            xcb_randr_output_t output);
+
+#ifdef __cplusplus
+}
+#endif
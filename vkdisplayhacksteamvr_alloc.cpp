@@ -0,0 +1,194 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Allocations of the layer's own bookkeeping
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#include "vkdisplayhacksteamvr_alloc.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> frees{0};
+std::atomic<uint64_t> live_bytes{0};
+std::atomic<uint64_t> callback_allocations{0};
+
+} // namespace
+
+AllocStats alloc_stats()
+{
+    AllocStats s;
+    s.allocations = allocations.load(std::memory_order_relaxed);
+    s.frees = frees.load(std::memory_order_relaxed);
+    s.live_bytes = live_bytes.load(std::memory_order_relaxed);
+    s.callback_allocations = callback_allocations.load(std::memory_order_relaxed);
+    return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// LayerAllocator
+
+LayerAllocator::LayerAllocator(const VkAllocationCallbacks *callbacks, VkSystemAllocationScope scope)
+    : scope(scope)
+{
+    if (callbacks != NULL && callbacks->pfnAllocation != NULL && callbacks->pfnFree != NULL) {
+        vk_callbacks = *callbacks;
+        has_callbacks = true;
+    }
+}
+
+void *LayerAllocator::allocate(size_t size, size_t alignment)
+{
+    void *p = NULL;
+    if (has_callbacks) {
+        p = vk_callbacks.pfnAllocation(vk_callbacks.pUserData, size, alignment, scope);
+        if (p != NULL)
+            callback_allocations.fetch_add(1, std::memory_order_relaxed);
+    } else if (posix_memalign(&p, std::max(alignment, sizeof(void *)), size) != 0) {
+        p = NULL;
+    }
+    if (p == NULL)
+        return NULL;
+
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    live_bytes.fetch_add(size, std::memory_order_relaxed);
+    return p;
+}
+
+void LayerAllocator::free(void *p, size_t size)
+{
+    if (p == NULL)
+        return;
+
+    frees.fetch_add(1, std::memory_order_relaxed);
+    live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    if (has_callbacks)
+        vk_callbacks.pfnFree(vk_callbacks.pUserData, p);
+    else
+        ::free(p);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Arena
+
+Arena::~Arena()
+{
+    while (cleanups != nullptr) {
+        cleanups->destroy(cleanups->object);
+        cleanups = cleanups->next;
+    }
+
+    while (large != nullptr) {
+        Large *next = large->next;
+        alloc.free(large, large->size);
+        large = next;
+    }
+
+    while (chunks != nullptr) {
+        Chunk *next = chunks->next;
+        alloc.free(chunks, CHUNK_SIZE);
+        chunks = next;
+    }
+}
+
+void *Arena::bump(size_t size)
+{
+    if ((size_t) (end - cursor) < size) {
+        // what is left of the old chunk is too small for the size classes that didn't fit
+        Chunk *chunk = (Chunk *) alloc.allocate(CHUNK_SIZE, SIZE_CLASS);
+        if (chunk == nullptr)
+            return nullptr;
+        chunk->next = chunks;
+        chunks = chunk;
+        cursor = (char *) chunk + SIZE_CLASS;
+        end = (char *) chunk + CHUNK_SIZE;
+    }
+
+    void *p = cursor;
+    cursor += size;
+    return p;
+}
+
+void *Arena::allocate(size_t size, size_t alignment)
+{
+    if (!isSmall(size, alignment)) {
+        size_t header = largeHeader(alignment);
+        Large *l = (Large *) alloc.allocate(header + size, header);
+        if (l == nullptr)
+            return nullptr;
+        std::lock_guard<std::mutex> guard(lock);
+        l->size = header + size;
+        l->prev = nullptr;
+        l->next = large;
+        if (large != nullptr)
+            large->prev = l;
+        large = l;
+        return (char *) l + header;
+    }
+
+    size_t index = size > 0 ? (size - 1) / SIZE_CLASS : 0;
+    std::lock_guard<std::mutex> l(lock);
+    if (FreeBlock *b = free_lists[index]) {
+        free_lists[index] = b->next;
+        return b;
+    }
+    return bump((index + 1) * SIZE_CLASS);
+}
+
+void Arena::free(void *p, size_t size, size_t alignment)
+{
+    if (p == nullptr)
+        return;
+    if (!isSmall(size, alignment)) {
+        size_t header = largeHeader(alignment);
+        Large *l = (Large *) ((char *) p - header);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (l->prev != nullptr)
+                l->prev->next = l->next;
+            else
+                large = l->next;
+            if (l->next != nullptr)
+                l->next->prev = l->prev;
+        }
+        alloc.free(l, l->size);
+        return;
+    }
+
+    size_t index = size > 0 ? (size - 1) / SIZE_CLASS : 0;
+    FreeBlock *b = (FreeBlock *) p;
+    std::lock_guard<std::mutex> l(lock);
+    b->next = free_lists[index];
+    free_lists[index] = b;
+}
+
+const char *Arena::copyString(const char *s, size_t length)
+{
+    char *copy = (char *) allocate(length + 1, 1);
+    if (copy == nullptr)
+        return nullptr;
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+bool Arena::addCleanup(void (*destroy)(void *), void *object)
+{
+    Cleanup *c = (Cleanup *) allocate(sizeof(Cleanup), alignof(Cleanup));
+    if (c == nullptr)
+        return false;
+    c->destroy = destroy;
+    c->object = object;
+
+    std::lock_guard<std::mutex> l(lock);
+    c->next = cleanups;
+    cleanups = c;
+    return true;
+}
@@ -0,0 +1,308 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Allocations of the layer's own bookkeeping
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Everything the layer keeps per instance and per device is allocated through a LayerAllocator,
+ * which uses the VkAllocationCallbacks the application passed to the vkCreateInstance or
+ * vkCreateDevice the state belongs to, or the C heap without them. On top of it an Arena holds
+ * the dispatch tables, lookup caches and display state of one instance or device and releases
+ * them all at once when it goes away, and ObjectPools recycle the records of objects that come
+ * and go, like swapchains, without going back to the allocator.
+ *
+ * Allocations through a LayerAllocator are counted process wide, so a steady frame loop can be
+ * checked to not allocate at all.
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+#include <set>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct AllocStats
+{
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t callback_allocations; // of the allocations, the ones made by the application's callbacks
+};
+
+// everything allocated through a LayerAllocator so far
+AllocStats alloc_stats();
+
+class LayerAllocator
+{
+public:
+    // callbacks may be NULL, they are copied
+    LayerAllocator(const VkAllocationCallbacks *callbacks, VkSystemAllocationScope scope);
+
+    // NULL when the callbacks or the heap fail, never throws through the application's calls
+    void *allocate(size_t size, size_t alignment);
+    void free(void *p, size_t size);
+
+    template<typename T, typename... Args>
+    T *create(Args &&...args)
+    {
+        void *p = allocate(sizeof(T), alignof(T));
+        if (p == nullptr)
+            return nullptr;
+        return new (p) T(std::forward<Args>(args)...);
+    }
+
+    template<typename T>
+    void destroy(T *object)
+    {
+        if (object == nullptr)
+            return;
+        object->~T();
+        free(object, sizeof(T));
+    }
+
+    // for the Vulkan objects the layer creates on the application's behalf, NULL without any
+    const VkAllocationCallbacks *callbacks() const
+    {
+        return has_callbacks ? &vk_callbacks : NULL;
+    }
+
+private:
+    VkAllocationCallbacks vk_callbacks = {};
+    bool has_callbacks = false;
+    VkSystemAllocationScope scope;
+};
+
+// Memory of one instance or device. Small blocks are carved out of chunks and recycled per size
+// class when they are freed back, so the display cache's containers can churn without growing the
+// arena, bigger ones come from the allocator one by one. Whatever is still allocated goes back
+// when the arena is destroyed. Thread-safe.
+class Arena
+{
+public:
+    explicit Arena(const LayerAllocator &allocator) : alloc(allocator) {}
+
+    // runs the destructors of the objects created in the arena, newest first, then frees it all
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // NULL when the allocator fails
+    void *allocate(size_t size, size_t alignment);
+    void free(void *p, size_t size, size_t alignment);
+
+    // lives until the arena is destroyed, NULL when the allocator fails
+    template<typename T, typename... Args>
+    T *create(Args &&...args)
+    {
+        void *p = allocate(sizeof(T), alignof(T));
+        if (p == nullptr)
+            return nullptr;
+        if (!std::is_trivially_destructible<T>::value
+            && !addCleanup([](void *o) { static_cast<T *>(o)->~T(); }, p)) {
+            free(p, sizeof(T), alignof(T));
+            return nullptr;
+        }
+        return new (p) T(std::forward<Args>(args)...);
+    }
+
+    // a copy of the name, lives until the arena is destroyed, NULL when the allocator fails
+    const char *copyString(const char *s, size_t length);
+
+    const LayerAllocator &allocator() const
+    {
+        return alloc;
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 16384;
+    static constexpr size_t SMALL_MAX = 256;
+    static constexpr size_t SIZE_CLASS = 16;
+
+    struct Chunk
+    {
+        Chunk *next;
+    };
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    // in front of each large block
+    struct Large
+    {
+        Large *prev;
+        Large *next;
+        size_t size; // with the header
+    };
+
+    struct Cleanup
+    {
+        Cleanup *next;
+        void (*destroy)(void *);
+        void *object;
+    };
+
+    static bool isSmall(size_t size, size_t alignment)
+    {
+        return size <= SMALL_MAX && alignment <= SIZE_CLASS;
+    }
+
+    // keeps the block behind the header aligned
+    static size_t largeHeader(size_t alignment)
+    {
+        static_assert(sizeof(Large) <= 2 * SIZE_CLASS, "header doesn't fit");
+        return std::max(alignment, 2 * SIZE_CLASS);
+    }
+
+    // called with lock held
+    void *bump(size_t size);
+    bool addCleanup(void (*destroy)(void *), void *object);
+
+    LayerAllocator alloc;
+    std::mutex lock;
+    Chunk *chunks = nullptr;
+    char *cursor = nullptr;
+    char *end = nullptr;
+    FreeBlock *free_lists[SMALL_MAX / SIZE_CLASS] = {};
+    Large *large = nullptr;
+    Cleanup *cleanups = nullptr;
+};
+
+// Standard containers in an arena. They need an allocator that throws, so growing one can throw
+// std::bad_alloc, the layer catches it around every container it grows from an entry point.
+template<typename T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena *arena) : arena(arena) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena)
+    {}
+
+    T *allocate(size_t n)
+    {
+        if (void *p = arena->allocate(n * sizeof(T), alignof(T)))
+            return (T *) p;
+        throw std::bad_alloc();
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        arena->free(p, n * sizeof(T), alignof(T));
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U> &other) const
+    {
+        return arena == other.arena;
+    }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const
+    {
+        return arena != other.arena;
+    }
+
+    Arena *arena;
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+template<typename T>
+using ArenaSet = std::set<T, std::less<T>, ArenaAllocator<T>>;
+
+template<typename Key, typename Value>
+using ArenaMap = std::map<Key, Value, std::less<Key>, ArenaAllocator<std::pair<const Key, Value>>>;
+
+// Fixed-size slots for the records of objects that come and go. Freed slots go on a free list,
+// the slabs of SLAB_SIZE slots are only given back when the pool goes away, by which time every
+// object must have been destroyed.
+template<typename T, uint32_t SLAB_SIZE>
+class ObjectPool
+{
+public:
+    explicit ObjectPool(const LayerAllocator &allocator) : alloc(allocator) {}
+
+    ~ObjectPool()
+    {
+        while (slabs != nullptr) {
+            Slab *next = slabs->next;
+            alloc.free(slabs, sizeof(Slab));
+            slabs = next;
+        }
+    }
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    // NULL when the allocator fails
+    template<typename... Args>
+    T *create(Args &&...args)
+    {
+        Slot *slot;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (free_slots == nullptr && !addSlab())
+                return nullptr;
+            slot = free_slots;
+            free_slots = slot->next;
+        }
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *object)
+    {
+        object->~T();
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        std::lock_guard<std::mutex> l(lock);
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+
+private:
+    union Slot
+    {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Slab
+    {
+        Slab *next;
+        Slot slots[SLAB_SIZE];
+    };
+
+    // called with lock held
+    bool addSlab()
+    {
+        Slab *slab = (Slab *) alloc.allocate(sizeof(Slab), alignof(Slab));
+        if (slab == nullptr)
+            return false;
+        slab->next = slabs;
+        slabs = slab;
+        for (uint32_t i = SLAB_SIZE; i > 0; i--) {
+            slab->slots[i - 1].next = free_slots;
+            free_slots = &slab->slots[i - 1];
+        }
+        return true;
+    }
+
+    LayerAllocator alloc;
+    std::mutex lock;
+    Slab *slabs = nullptr;
+    Slot *free_slots = nullptr;
+};
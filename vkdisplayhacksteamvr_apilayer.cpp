@@ -12,14 +12,39 @@
 #include <vulkan/generated/vk_layer_dispatch_table.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 
 // #include "vulkan/vulkan.h"
 
 #include <assert.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <map>
 #include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// meson's stats option, 0 builds the display override alone: no command, frame or telemetry hooks
+#ifndef VKDISPLAYHACKSTEAMVR_STATS
+#define VKDISPLAYHACKSTEAMVR_STATS 1
+#endif
+
+#include "vkdisplayhacksteamvr.h"
+#include "vkdisplayhacksteamvr_alloc.hpp"
+#include "vkdisplayhacksteamvr_handlemap.hpp"
+#include "vkdisplayhacksteamvr_log.hpp"
+#include "vkdisplayhacksteamvr_trace.hpp"
+#if VKDISPLAYHACKSTEAMVR_STATS
+#include "vkdisplayhacksteamvr_gputime.hpp"
+#include "vkdisplayhacksteamvr_pacing.hpp"
+#include "vkdisplayhacksteamvr_telemetry.hpp"
+#endif
+
+#include <X11/Xlib-xcb.h>
 
 #undef VK_LAYER_EXPORT
 #if defined(WIN32)
@@ -28,8 +53,6 @@
 #define VK_LAYER_EXPORT extern "C"
 #endif
 
-// single global lock, for simplicity
-std::mutex global_lock;
 typedef std::lock_guard<std::mutex> scoped_lock;
 
 // use the loader's dispatch table pointer as a key for dispatch map lookups
@@ -39,28 +62,485 @@ void *GetKey(DispatchableType inst)
     return *(void **) inst;
 }
 
-// layer book-keeping information, to store dispatch tables by key
-std::map<void *, VkLayerInstanceDispatchTable> instance_dispatch;
-std::map<void *, VkLayerDispatchTable> device_dispatch;
+// Grows one of the arena containers, false if the application's callbacks ran out of memory. No
+// exception may unwind through the application's Vulkan calls, whatever doesn't fit is left out
+// and the call goes on as if the layer weren't tracking it.
+template<typename Grow>
+static bool arena_grow(Grow grow)
+{
+    try {
+        grow();
+        return true;
+    } catch (const std::bad_alloc &) {
+        return false;
+    }
+}
+
+// everything below that belongs to an instance or device lives in its arena, with the
+// application's allocation callbacks
+HandleMap<Arena> device_arenas;
+
+// layer book-keeping information, to store dispatch tables by key.
+// written only on device creation and destruction, read lock-free from every entry point
+HandleMap<VkLayerDispatchTable> device_dispatch;
+
+// FNV-1a, constexpr so it can label the cases of the lookup switches below, the cache of the
+// functions they don't list is keyed by it too
+constexpr uint32_t HashName(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (uint8_t) *name) * 16777619u;
+    return h;
+}
+
+// pass-through function pointers already resolved from the next layer, so repeated
+// Get*ProcAddr queries for functions we don't intercept never go back down the chain.
+// Open-addressed on the name hash and read lock-free like HandleMap: entries never change once
+// published, the writer mutex serializes inserts and a full table is replaced by a bigger one.
+// Everything lives in the arena, replaced tables too, readers may still be walking them.
+struct ProcAddrCache
+{
+    struct Entry
+    {
+        uint32_t hash;
+        const char *name; // copy in the arena
+        PFN_vkVoidFunction function;
+    };
+
+    struct Table
+    {
+        uint32_t mask;
+        std::atomic<Entry *> *slots;
+    };
+
+    explicit ProcAddrCache(Arena *arena) : arena(arena) {}
 
-// actual data we're recording in this layer
+    Arena *arena;
+    std::mutex writer_lock;
+    std::atomic<Table *> table{nullptr};
+    uint32_t used = 0; // entries, under writer_lock
+
+    // hash is HashName(pName)
+    template<typename Resolve>
+    PFN_vkVoidFunction get(const char *pName, uint32_t hash, Resolve resolve)
+    {
+        if (const Table *t = table.load(std::memory_order_acquire))
+            if (const Entry *e = find(t, pName, hash))
+                return e->function;
+
+        std::lock_guard<std::mutex> l(writer_lock);
+        Table *t = table.load(std::memory_order_relaxed);
+        if (t != nullptr)
+            if (const Entry *e = find(t, pName, hash))
+                return e->function;
+
+        // NULL results are cached too, those are the names SteamVR keeps probing for
+        PFN_vkVoidFunction function = resolve();
+        // out of memory it just isn't cached, what was allocated goes with the arena
+        size_t length = strlen(pName);
+        Entry *e = arena->create<Entry>();
+        const char *copy = arena->copyString(pName, length);
+        if (e == nullptr || copy == nullptr)
+            return function;
+        // keep at least half the slots empty so probe chains stay short and always terminate
+        if (t == nullptr || (used + 1) * 2 > t->mask + 1) {
+            t = grow(t);
+            if (t == nullptr)
+                return function;
+        }
+
+        e->hash = hash;
+        e->name = copy;
+        e->function = function;
+        place(t, e);
+        used++;
+        return function;
+    }
+
+private:
+    static const Entry *find(const Table *t, const char *pName, uint32_t hash)
+    {
+        for (uint32_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+            const Entry *e = t->slots[i].load(std::memory_order_acquire);
+            if (e == nullptr || (e->hash == hash && strcmp(e->name, pName) == 0))
+                return e;
+        }
+    }
+
+    static void place(Table *t, Entry *e)
+    {
+        uint32_t i = e->hash & t->mask;
+        while (t->slots[i].load(std::memory_order_relaxed) != nullptr)
+            i = (i + 1) & t->mask;
+        t->slots[i].store(e, std::memory_order_release);
+    }
+
+    // publishes a table twice the size with the entries of the old one, NULL out of memory
+    Table *grow(Table *old)
+    {
+        uint32_t size = old != nullptr ? (old->mask + 1) * 2 : 64;
+        Table *t = arena->create<Table>();
+        void *slots = arena->allocate(size * sizeof(std::atomic<Entry *>),
+                                      alignof(std::atomic<Entry *>));
+        if (t == nullptr || slots == nullptr)
+            return nullptr;
+
+        t->mask = size - 1;
+        t->slots = (std::atomic<Entry *> *) slots;
+        for (uint32_t i = 0; i < size; i++)
+            new (&t->slots[i]) std::atomic<Entry *>(nullptr);
+        if (old != nullptr)
+            for (uint32_t i = 0; i <= old->mask; i++)
+                if (Entry *e = old->slots[i].load(std::memory_order_relaxed))
+                    place(t, e);
+
+        table.store(t, std::memory_order_release);
+        return t;
+    }
+};
+
+HandleMap<ProcAddrCache> device_procs;
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+// actual data we're recording in this layer. Only the thread recording the command buffer
+// touches them, so they are plain per-thread counters without atomics.
 struct CommandStats
 {
     uint32_t drawCount = 0, instanceCount = 0, vertCount = 0;
+    uint32_t indirectDraws = 0; // upper bound for the *Count variants, the real count is on the GPU
+    uint32_t dispatches = 0;
+    uint32_t pipelineBinds = 0, descriptorSetBinds = 0;
+    uint32_t renderPasses = 0;
+
+    // rolls an executed secondary's stats into its primary
+    void add(const CommandStats &o)
+    {
+        drawCount += o.drawCount;
+        instanceCount += o.instanceCount;
+        vertCount += o.vertCount;
+        indirectDraws += o.indirectDraws;
+        dispatches += o.dispatches;
+        pipelineBinds += o.pipelineBinds;
+        descriptorSetBinds += o.descriptorSetBinds;
+        renderPasses += o.renderPasses;
+    }
+};
+
+// slab entry backing one command buffer, recycled through its pool's free list
+struct CommandBufferRecord
+{
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    bool primary = true;
+    bool gpu_timestamps = false; // its pool's queue family can write them
+    uint32_t gpu_slot = GpuTimestamps::NO_SLOT; // kept across recordings until freed
+    CommandStats stats;
+    CommandBufferRecord *next_free = nullptr; // on the pool's free list
+};
+
+// records are carved out of fixed-size slabs owned by the VkCommandPool the buffers come from, so
+// freeing or destroying the pool hands them back without touching the heap per command buffer.
+// The slabs come from the device's arena.
+struct CommandPoolRecords
+{
+    static constexpr uint32_t SLAB_SIZE = 64;
+
+    struct Slab
+    {
+        Slab *next = nullptr;
+        CommandBufferRecord records[SLAB_SIZE];
+    };
+
+    Arena *arena;
+    Slab *slabs = nullptr;
+    CommandBufferRecord *free_records = nullptr;
+    bool gpu_timestamps = false; // set by vkCreateCommandPool for a timestamp queue family
+
+    explicit CommandPoolRecords(Arena *arena) : arena(arena) {}
+
+    ~CommandPoolRecords()
+    {
+        while (slabs != nullptr) {
+            Slab *next = slabs->next;
+            arena->free(slabs, sizeof(Slab), alignof(Slab));
+            slabs = next;
+        }
+    }
+
+    CommandPoolRecords(const CommandPoolRecords &) = delete;
+    CommandPoolRecords &operator=(const CommandPoolRecords &) = delete;
+
+    // NULL when the arena is out of memory, the command buffer then goes without stats
+    CommandBufferRecord *acquire(VkCommandBuffer commandBuffer)
+    {
+        if (free_records == nullptr) {
+            void *p = arena->allocate(sizeof(Slab), alignof(Slab));
+            if (p == nullptr)
+                return nullptr;
+            Slab *slab = new (p) Slab;
+            slab->next = slabs;
+            slabs = slab;
+            for (uint32_t i = SLAB_SIZE; i > 0; i--) {
+                slab->records[i - 1].next_free = free_records;
+                free_records = &slab->records[i - 1];
+            }
+        }
+
+        CommandBufferRecord *r = free_records;
+        free_records = r->next_free;
+        r->commandBuffer = commandBuffer;
+        r->primary = true;
+        r->gpu_timestamps = gpu_timestamps;
+        r->gpu_slot = GpuTimestamps::NO_SLOT;
+        r->stats = CommandStats();
+        return r;
+    }
+
+    void release(CommandBufferRecord *r)
+    {
+        r->commandBuffer = VK_NULL_HANDLE;
+        r->next_free = free_records;
+        free_records = r;
+    }
+
+    template<typename Func>
+    void forEachLive(Func func)
+    {
+        for (Slab *slab = slabs; slab != nullptr; slab = slab->next)
+            for (uint32_t i = 0; i < SLAB_SIZE; i++)
+                if (slab->records[i].commandBuffer != VK_NULL_HANDLE)
+                    func(&slab->records[i]);
+    }
+};
+
+// per-command-buffer stats, read lock-free while recording
+HandleMap<CommandBufferRecord> commandbuffer_records;
+#endif
+
+// what the background worker started at vkCreateInstance resolved, handed over to the cache
+struct DisplayPrewarm
+{
+    Display *dpy = NULL;
+    uint8_t randr_event_base = 0;
+    std::map<VkPhysicalDevice, randr_display_inventory> inventories;
+
+    VkInstance instance = VK_NULL_HANDLE;
+    uint64_t ready_ns = 0;
+    uint32_t physical_devices = 0;
+    bool found = false; // the VK_DISPLAY_HACK_STEAMVR output resolved on a physical device
+};
+
+// RandR output -> VkDisplayKHR resolutions of one instance. Lives on its own persistent X
+// connection and is only thrown away when RandR reports that the screen or an output changed.
+struct DisplayCache
+{
+    // the containers' memory, the inventories themselves come from the randr code's malloc
+    explicit DisplayCache(Arena *arena)
+        : arena(arena), inventories(ArenaAllocator<int>(arena)),
+          overridden_displays(ArenaAllocator<int>(arena)),
+          overridden_modes(ArenaAllocator<int>(arena)),
+          overridden_surfaces(ArenaAllocator<int>(arena)),
+          display_modes(ArenaAllocator<int>(arena)),
+          display_snapshots(ArenaAllocator<int>(arena))
+    {}
+
+    Arena *arena;
+    PFN_vkGetRandROutputDisplayEXT next_GetRandROutputDisplayEXT = NULL;
+
+    Display *dpy = NULL;
+    uint8_t randr_event_base = 0;
+    bool connect_failed = false; // only tried once without an override
+
+    // one RandR walk per physical device the application asked about, each output resolved on
+    // the driver only once a call asks for it
+    ArenaMap<VkPhysicalDevice, randr_display_inventory> inventories;
+
+    // displays handed out by the override, with their modes and surfaces and the refresh rate in
+    // mHz, so swapchains on them get frame pacing stats. Kept across invalidations, the handles
+    // stay valid for the instance's lifetime.
+    ArenaSet<VkDisplayKHR> overridden_displays;
+    ArenaMap<VkDisplayModeKHR, uint32_t> overridden_modes;
+    ArenaMap<VkSurfaceKHR, uint32_t> overridden_surfaces;
+
+    // the driver's modes of the overridden displays, preferred mode first
+    ArenaMap<VkDisplayKHR, ArenaVector<VkDisplayModePropertiesKHR>> display_modes;
+
+    // the driver's displays per physical device, overridden display first, valid while their
+    // generation matches. Rebuilt in place, so a change of the displays doesn't reallocate.
+    struct DisplaySnapshot
+    {
+        explicit DisplaySnapshot(Arena *arena) : displays(ArenaAllocator<int>(arena)) {}
+
+        uint64_t generation = 0;
+        ArenaVector<VkDisplayPropertiesKHR> displays;
+    };
+    ArenaMap<VkPhysicalDevice, DisplaySnapshot> display_snapshots;
+    uint64_t generation = 0;
+    uint64_t last_poll_ns = 0;
+
+    // the X connection and the inventories are being prepared in the background until the first
+    // call that needs them takes them over
+    std::future<DisplayPrewarm> prewarm;
+    std::atomic<bool> prewarm_cancel{false};
+    uint64_t created_ns = 0;
+
+    void invalidate()
+    {
+        for (auto &it : inventories)
+            randr_inventory_destroy(&it.second);
+        inventories.clear();
+        display_modes.clear();
+        generation++;
+    }
+
+    ~DisplayCache()
+    {
+        invalidate();
+        if (dpy != NULL)
+            XCloseDisplay(dpy);
+    }
+};
+
+// Everything the layer keeps for one instance, in the instance's arena. Found from the instance
+// and from its physical devices, which share its dispatch key, so a call always goes down the
+// chain of the instance it was made on. The display state has a lock per instance: instances of
+// different threads don't wait for each other, and none sees another's X connection or displays.
+struct InstanceContext
+{
+    InstanceContext(Arena *arena,
+                    VkInstance instance,
+                    PFN_vkGetInstanceProcAddr next_GetInstanceProcAddr,
+                    const VkLayerInstanceDispatchTable &dispatch)
+        : arena(arena), instance(instance), next_GetInstanceProcAddr(next_GetInstanceProcAddr),
+          dispatch(dispatch), procs(arena), display(arena)
+    {}
+
+    Arena *arena; // the instance's, the context lives in it too
+    VkInstance instance;
+    PFN_vkGetInstanceProcAddr next_GetInstanceProcAddr;
+    VkLayerInstanceDispatchTable dispatch;
+    ProcAddrCache procs;
+
+    std::mutex display_lock; // guards display
+    DisplayCache display;
 };
 
-std::map<VkCommandBuffer, CommandStats> commandbuffer_stats;
+// written only on instance creation and destruction, read lock-free from every entry point
+HandleMap<InstanceContext> instance_contexts;
+
+// the context of an instance or of one of its physical devices
+template<typename DispatchableType>
+static InstanceContext *instance_context(DispatchableType handle)
+{
+    return instance_contexts.get(GetKey(handle));
+}
+
+// with the display override below
+static void display_prewarm_start(InstanceContext *ctx);
+static void display_prewarm_settle(DisplayCache *cache);
+
+// with the present control below
+static bool present_override_active();
+
+// groups of device functions the layer hooks, chosen per device at vkCreateDevice. The
+// functions of a group that is off are the next layer's, so they cost the application nothing.
+enum InterceptGroup : uint32_t
+{
+    InterceptCommands = 1u << 0, // command buffer lifetime, recording and draw stats
+    InterceptFrames = 1u << 1,   // swapchains, submits and presents for pacing and frame rollups
+    InterceptPresent = 1u << 2,  // swapchain creation, with a present override configured
+};
+
+// what this build can intercept at all
+#if VKDISPLAYHACKSTEAMVR_STATS
+constexpr uint32_t INTERCEPT_BUILT = InterceptCommands | InterceptFrames;
+#else
+constexpr uint32_t INTERCEPT_BUILT = 0;
+#endif
+
+// per-device pacing and telemetry bookkeeping, queues and command buffers share the device's
+// key so they find it too
+struct DeviceState
+{
+    explicit DeviceState(Arena *arena)
+#if VKDISPLAYHACKSTEAMVR_STATS
+        : arena(arena), command_pools(ArenaAllocator<int>(arena)), pacing_records(arena->allocator())
+#else
+        : arena(arena)
+#endif
+    {}
+
+    Arena *arena; // the device's, the state lives in it too
+    VkDevice device = VK_NULL_HANDLE;
+    InstanceContext *instance = NULL; // of the physical device the device was created on
+    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+    bool display_timing = false; // VK_GOOGLE_display_timing is enabled
+    uint32_t intercept = 0;      // InterceptGroup bits
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+    // live counters in the shared telemetry segment, NULL if there is no slot for the device
+    telemetry_device *telemetry = NULL;
+
+    // only with VK_DISPLAY_HACK_STEAMVR_GPU_TIMESTAMPS on a device that supports them, in the arena
+    GpuTimestamps *gpu_timestamps = NULL;
+    uint32_t gpu_timestamp_families = 0; // bit per queue family whose pools get them
+
+    // command pool handles are only unique per device
+    std::mutex command_pools_lock;
+    ArenaMap<VkCommandPool, CommandPoolRecords> command_pools;
+
+    // of the device's paced swapchains
+    ObjectPool<FramePacing, 4> pacing_records;
+
+    // submits are only timestamped while a swapchain of the device is paced
+    std::atomic<uint32_t> paced_swapchains{0};
+    std::atomic<uint64_t> last_submit_ns{0};
+
+    // workload of the command buffers submitted since the last present, from any queue
+    struct FrameWorkload
+    {
+        std::atomic<uint64_t> submits{0}, command_buffers{0};
+        std::atomic<uint64_t> draws{0}, indirect_draws{0}, vertices{0};
+        std::atomic<uint64_t> dispatches{0}, pipeline_binds{0}, descriptor_set_binds{0};
+        std::atomic<uint64_t> render_passes{0};
+    } frame;
+#endif
+};
+
+HandleMap<DeviceState> device_states;
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+// swapchains created on surfaces of the overridden display
+HandleMap<FramePacing> swapchain_pacing;
+
+static void *SwapchainKey(VkSwapchainKHR swapchain)
+{
+    return (void *) (uintptr_t) swapchain;
+}
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////////////////
 // Layer init and shutdown
 
-static VkInstance g_lastCreatedInstance = VK_NULL_HANDLE;
-static PFN_vkGetInstanceProcAddr g_pfnNextGetInstanceProcAddr = VK_NULL_HANDLE;
+// the layer's own allocations so far, logged whenever an instance or device went away
+static void alloc_log(uint64_t handle)
+{
+    AllocStats a = alloc_stats();
+    log_push(LogRecordType::Allocations,
+             handle,
+             a.allocations,
+             a.frees,
+             a.live_bytes,
+             a.callback_allocations);
+}
+
 VK_LAYER_EXPORT VkResult VKAPI_CALL
 vkdisplayhacksteamvr_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
                                     const VkAllocationCallbacks *pAllocator,
                                     VkInstance *pInstance)
 {
+    trace_open();
+    TraceScope trace(TRACE_CreateInstance, 0);
     VkLayerInstanceCreateInfo *layerCreateInfo = (VkLayerInstanceCreateInfo *) pCreateInfo->pNext;
 
     // step through the chain of pNext until we get to the link info
@@ -76,13 +556,14 @@ vkdisplayhacksteamvr_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
     }
 
     PFN_vkGetInstanceProcAddr gpa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
-    g_pfnNextGetInstanceProcAddr = gpa;
     // move chain on for next layer
     layerCreateInfo->u.pLayerInfo = layerCreateInfo->u.pLayerInfo->pNext;
 
     PFN_vkCreateInstance createFunc = (PFN_vkCreateInstance) gpa(VK_NULL_HANDLE, "vkCreateInstance");
 
     VkResult ret = createFunc(pCreateInfo, pAllocator, pInstance);
+    if (ret != VK_SUCCESS)
+        return ret;
 
     // fetch our own dispatch table for the functions we need, into the next layer
     VkLayerInstanceDispatchTable dispatchTable;
@@ -91,14 +572,53 @@ vkdisplayhacksteamvr_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
     dispatchTable.DestroyInstance = (PFN_vkDestroyInstance) gpa(*pInstance, "vkDestroyInstance");
     dispatchTable.EnumerateDeviceExtensionProperties = (PFN_vkEnumerateDeviceExtensionProperties)
         gpa(*pInstance, "vkEnumerateDeviceExtensionProperties");
-
-    // store the table by key
-    {
-        scoped_lock l(global_lock);
-        instance_dispatch[GetKey(*pInstance)] = dispatchTable;
+    dispatchTable.GetPhysicalDeviceDisplayPropertiesKHR
+        = (PFN_vkGetPhysicalDeviceDisplayPropertiesKHR)
+            gpa(*pInstance, "vkGetPhysicalDeviceDisplayPropertiesKHR");
+    dispatchTable.GetPhysicalDeviceDisplayProperties2KHR
+        = (PFN_vkGetPhysicalDeviceDisplayProperties2KHR)
+            gpa(*pInstance, "vkGetPhysicalDeviceDisplayProperties2KHR");
+    dispatchTable.GetDisplayModePropertiesKHR = (PFN_vkGetDisplayModePropertiesKHR)
+        gpa(*pInstance, "vkGetDisplayModePropertiesKHR");
+    dispatchTable.GetDisplayModeProperties2KHR = (PFN_vkGetDisplayModeProperties2KHR)
+        gpa(*pInstance, "vkGetDisplayModeProperties2KHR");
+    dispatchTable.CreateDisplayModeKHR = (PFN_vkCreateDisplayModeKHR)
+        gpa(*pInstance, "vkCreateDisplayModeKHR");
+    dispatchTable.CreateDisplayPlaneSurfaceKHR = (PFN_vkCreateDisplayPlaneSurfaceKHR)
+        gpa(*pInstance, "vkCreateDisplayPlaneSurfaceKHR");
+    dispatchTable.DestroySurfaceKHR = (PFN_vkDestroySurfaceKHR) gpa(*pInstance,
+                                                                    "vkDestroySurfaceKHR");
+    dispatchTable.GetPhysicalDeviceSurfaceCapabilitiesKHR
+        = (PFN_vkGetPhysicalDeviceSurfaceCapabilitiesKHR)
+            gpa(*pInstance, "vkGetPhysicalDeviceSurfaceCapabilitiesKHR");
+    dispatchTable.GetPhysicalDeviceSurfacePresentModesKHR
+        = (PFN_vkGetPhysicalDeviceSurfacePresentModesKHR)
+            gpa(*pInstance, "vkGetPhysicalDeviceSurfacePresentModesKHR");
+    dispatchTable.GetPhysicalDeviceProperties = (PFN_vkGetPhysicalDeviceProperties)
+        gpa(*pInstance, "vkGetPhysicalDeviceProperties");
+    dispatchTable.GetPhysicalDeviceQueueFamilyProperties
+        = (PFN_vkGetPhysicalDeviceQueueFamilyProperties)
+            gpa(*pInstance, "vkGetPhysicalDeviceQueueFamilyProperties");
+
+    // everything kept for the instance, released at once by vkDestroyInstance
+    LayerAllocator allocator(pAllocator, VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+    Arena *arena = allocator.create<Arena>(allocator);
+    InstanceContext *ctx = NULL;
+    if (arena != NULL)
+        ctx = arena->create<InstanceContext>(arena, *pInstance, gpa, dispatchTable);
+    if (ctx == NULL) {
+        allocator.destroy(arena);
+        dispatchTable.DestroyInstance(*pInstance, pAllocator);
+        *pInstance = VK_NULL_HANDLE;
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
     }
+    ctx->display.next_GetRandROutputDisplayEXT = (PFN_vkGetRandROutputDisplayEXT)
+        gpa(*pInstance, "vkGetRandROutputDisplayEXT");
+    display_prewarm_start(ctx);
 
-    g_lastCreatedInstance = *pInstance;
+    // store the context by key
+    instance_contexts.insert(GetKey(*pInstance), ctx);
+    trace.handle = trace_handle(*pInstance);
 
     return VK_SUCCESS;
 }
@@ -106,9 +626,118 @@ vkdisplayhacksteamvr_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
 VK_LAYER_EXPORT void VKAPI_CALL
 vkdisplayhacksteamvr_DestroyInstance(VkInstance instance, const VkAllocationCallbacks *pAllocator)
 {
-    scoped_lock l(global_lock);
-    instance_dispatch.erase(GetKey(instance));
+    TraceScope trace(TRACE_DestroyInstance, trace_handle(instance));
+    InstanceContext *ctx = instance_contexts.erase(GetKey(instance));
+    if (ctx == NULL)
+        return;
+
+    // the pre-warm worker may still be enumerating on the instance
+    {
+        scoped_lock l(ctx->display_lock);
+        ctx->display.prewarm_cancel.store(true);
+        display_prewarm_settle(&ctx->display);
+    }
+    PFN_vkDestroyInstance destroy = ctx->dispatch.DestroyInstance;
+
+    // takes the display cache, the dispatch table and the lookups with it
+    LayerAllocator allocator = ctx->arena->allocator();
+    allocator.destroy(ctx->arena);
+
+    destroy(instance, pAllocator);
+    alloc_log((uint64_t) (uintptr_t) instance);
+}
+
+// VK_DISPLAY_HACK_STEAMVR_INTERCEPT=all (the default), display for the display override alone,
+// or a comma separated list of commands and frames
+static uint32_t intercept_parse()
+{
+    const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_INTERCEPT");
+    if (env == NULL || strcmp(env, "all") == 0)
+        return INTERCEPT_BUILT;
+    if (strcmp(env, "display") == 0)
+        return 0;
+
+    uint32_t groups = 0;
+    std::string list(env);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string group = list.substr(start, end - start);
+        if (group == "commands") {
+            groups |= InterceptCommands;
+        } else if (group == "frames") {
+            groups |= InterceptFrames;
+        } else {
+            printf("vkdisplayhacksteamvr: ignoring VK_DISPLAY_HACK_STEAMVR_INTERCEPT=%s, expected "
+                   "all, display or a list of commands and frames\n",
+                   env);
+            return INTERCEPT_BUILT;
+        }
+        start = end + 1;
+    }
+
+    if ((groups & ~INTERCEPT_BUILT) != 0)
+        printf("vkdisplayhacksteamvr: built without stats, only the display override is "
+               "intercepted\n");
+    return groups & INTERCEPT_BUILT;
+}
+
+static uint32_t intercept_groups()
+{
+    static const uint32_t groups = intercept_parse();
+    return groups;
+}
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+// the query reset in front of the first timestamp needs a graphics or compute queue, so only
+// pools of those families with valid timestamp bits get them, *families has a bit for each
+static GpuTimestamps *gpu_timestamps_create(InstanceContext *ctx,
+                                            VkPhysicalDevice physicalDevice,
+                                            VkDevice device,
+                                            VkLayerDispatchTable *dispatch,
+                                            Arena *arena,
+                                            uint32_t *families)
+{
+    const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_GPU_TIMESTAMPS");
+    if (env == NULL || strcmp(env, "1") != 0)
+        return NULL;
+
+    VkLayerInstanceDispatchTable *instance = &ctx->dispatch;
+    VkPhysicalDeviceProperties props;
+    instance->GetPhysicalDeviceProperties(physicalDevice, &props);
+
+    uint32_t num_families = 0;
+    instance->GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &num_families, NULL);
+    std::vector<VkQueueFamilyProperties> properties(num_families);
+    instance->GetPhysicalDeviceQueueFamilyProperties(physicalDevice,
+                                                     &num_families,
+                                                     properties.data());
+
+    uint32_t valid_bits = 64;
+    *families = 0;
+    for (uint32_t i = 0; i < num_families && i < 32; i++) {
+        const VkQueueFamilyProperties &f = properties[i];
+        if (!(f.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+            || f.timestampValidBits == 0)
+            continue;
+        valid_bits = std::min(valid_bits, f.timestampValidBits);
+        *families |= 1u << i;
+    }
+
+    if (*families == 0 || props.limits.timestampPeriod == 0.0f) {
+        printf("vkdisplayhacksteamvr: %s has no graphics or compute queue with timestamps, GPU "
+               "timestamps off\n",
+               props.deviceName);
+        return NULL;
+    }
+
+    return arena->create<GpuTimestamps>(arena,
+                                        device,
+                                        dispatch,
+                                        props.limits.timestampPeriod,
+                                        valid_bits);
 }
+#endif
 
 VK_LAYER_EXPORT VkResult VKAPI_CALL
 vkdisplayhacksteamvr_CreateDevice(VkPhysicalDevice physicalDevice,
@@ -116,6 +745,7 @@ vkdisplayhacksteamvr_CreateDevice(VkPhysicalDevice physicalDevice,
                                   const VkAllocationCallbacks *pAllocator,
                                   VkDevice *pDevice)
 {
+    TraceScope trace(TRACE_CreateDevice, 0, trace_handle(physicalDevice));
     VkLayerDeviceCreateInfo *layerCreateInfo = (VkLayerDeviceCreateInfo *) pCreateInfo->pNext;
 
     // step through the chain of pNext until we get to the link info
@@ -138,6 +768,8 @@ vkdisplayhacksteamvr_CreateDevice(VkPhysicalDevice physicalDevice,
     PFN_vkCreateDevice createFunc = (PFN_vkCreateDevice) gipa(VK_NULL_HANDLE, "vkCreateDevice");
 
     VkResult ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
+    if (ret != VK_SUCCESS)
+        return ret;
 
     // fetch our own dispatch table for the functions we need, into the next layer
     VkLayerDispatchTable dispatchTable;
@@ -148,13 +780,111 @@ vkdisplayhacksteamvr_CreateDevice(VkPhysicalDevice physicalDevice,
                                                                        "vkBeginCommandBuffer");
     dispatchTable.CmdDraw = (PFN_vkCmdDraw) gdpa(*pDevice, "vkCmdDraw");
     dispatchTable.CmdDrawIndexed = (PFN_vkCmdDrawIndexed) gdpa(*pDevice, "vkCmdDrawIndexed");
+    dispatchTable.CmdDrawIndirect = (PFN_vkCmdDrawIndirect) gdpa(*pDevice, "vkCmdDrawIndirect");
+    dispatchTable.CmdDrawIndexedIndirect = (PFN_vkCmdDrawIndexedIndirect)
+        gdpa(*pDevice, "vkCmdDrawIndexedIndirect");
+    dispatchTable.CmdDrawIndirectCount = (PFN_vkCmdDrawIndirectCount)
+        gdpa(*pDevice, "vkCmdDrawIndirectCount");
+    dispatchTable.CmdDrawIndirectCountKHR = (PFN_vkCmdDrawIndirectCountKHR)
+        gdpa(*pDevice, "vkCmdDrawIndirectCountKHR");
+    dispatchTable.CmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCount)
+        gdpa(*pDevice, "vkCmdDrawIndexedIndirectCount");
+    dispatchTable.CmdDrawIndexedIndirectCountKHR = (PFN_vkCmdDrawIndexedIndirectCountKHR)
+        gdpa(*pDevice, "vkCmdDrawIndexedIndirectCountKHR");
+    dispatchTable.CmdDispatch = (PFN_vkCmdDispatch) gdpa(*pDevice, "vkCmdDispatch");
+    dispatchTable.CmdDispatchIndirect = (PFN_vkCmdDispatchIndirect) gdpa(*pDevice,
+                                                                         "vkCmdDispatchIndirect");
+    dispatchTable.CmdBindPipeline = (PFN_vkCmdBindPipeline) gdpa(*pDevice, "vkCmdBindPipeline");
+    dispatchTable.CmdBindDescriptorSets = (PFN_vkCmdBindDescriptorSets)
+        gdpa(*pDevice, "vkCmdBindDescriptorSets");
+    dispatchTable.CmdBeginRenderPass = (PFN_vkCmdBeginRenderPass) gdpa(*pDevice,
+                                                                       "vkCmdBeginRenderPass");
+    dispatchTable.CmdBeginRenderPass2 = (PFN_vkCmdBeginRenderPass2) gdpa(*pDevice,
+                                                                         "vkCmdBeginRenderPass2");
+    dispatchTable.CmdBeginRenderPass2KHR = (PFN_vkCmdBeginRenderPass2KHR)
+        gdpa(*pDevice, "vkCmdBeginRenderPass2KHR");
+    dispatchTable.CmdBeginRendering = (PFN_vkCmdBeginRendering) gdpa(*pDevice,
+                                                                     "vkCmdBeginRendering");
+    dispatchTable.CmdBeginRenderingKHR = (PFN_vkCmdBeginRenderingKHR)
+        gdpa(*pDevice, "vkCmdBeginRenderingKHR");
+    dispatchTable.CmdExecuteCommands = (PFN_vkCmdExecuteCommands) gdpa(*pDevice,
+                                                                       "vkCmdExecuteCommands");
     dispatchTable.EndCommandBuffer = (PFN_vkEndCommandBuffer) gdpa(*pDevice, "vkEndCommandBuffer");
+    dispatchTable.AllocateCommandBuffers = (PFN_vkAllocateCommandBuffers)
+        gdpa(*pDevice, "vkAllocateCommandBuffers");
+    dispatchTable.FreeCommandBuffers = (PFN_vkFreeCommandBuffers) gdpa(*pDevice,
+                                                                       "vkFreeCommandBuffers");
+    dispatchTable.CreateCommandPool = (PFN_vkCreateCommandPool) gdpa(*pDevice,
+                                                                     "vkCreateCommandPool");
+    dispatchTable.ResetCommandPool = (PFN_vkResetCommandPool) gdpa(*pDevice, "vkResetCommandPool");
+    dispatchTable.DestroyCommandPool = (PFN_vkDestroyCommandPool) gdpa(*pDevice,
+                                                                       "vkDestroyCommandPool");
+    dispatchTable.QueueSubmit = (PFN_vkQueueSubmit) gdpa(*pDevice, "vkQueueSubmit");
+    dispatchTable.QueueSubmit2 = (PFN_vkQueueSubmit2) gdpa(*pDevice, "vkQueueSubmit2");
+    dispatchTable.QueueSubmit2KHR = (PFN_vkQueueSubmit2KHR) gdpa(*pDevice, "vkQueueSubmit2KHR");
+    dispatchTable.CreateSwapchainKHR = (PFN_vkCreateSwapchainKHR) gdpa(*pDevice,
+                                                                       "vkCreateSwapchainKHR");
+    dispatchTable.DestroySwapchainKHR = (PFN_vkDestroySwapchainKHR) gdpa(*pDevice,
+                                                                         "vkDestroySwapchainKHR");
+    dispatchTable.AcquireNextImageKHR = (PFN_vkAcquireNextImageKHR) gdpa(*pDevice,
+                                                                         "vkAcquireNextImageKHR");
+    dispatchTable.QueuePresentKHR = (PFN_vkQueuePresentKHR) gdpa(*pDevice, "vkQueuePresentKHR");
+    dispatchTable.GetRefreshCycleDurationGOOGLE = (PFN_vkGetRefreshCycleDurationGOOGLE)
+        gdpa(*pDevice, "vkGetRefreshCycleDurationGOOGLE");
+    dispatchTable.GetPastPresentationTimingGOOGLE = (PFN_vkGetPastPresentationTimingGOOGLE)
+        gdpa(*pDevice, "vkGetPastPresentationTimingGOOGLE");
+    dispatchTable.CreateQueryPool = (PFN_vkCreateQueryPool) gdpa(*pDevice, "vkCreateQueryPool");
+    dispatchTable.DestroyQueryPool = (PFN_vkDestroyQueryPool) gdpa(*pDevice, "vkDestroyQueryPool");
+    dispatchTable.GetQueryPoolResults = (PFN_vkGetQueryPoolResults) gdpa(*pDevice,
+                                                                         "vkGetQueryPoolResults");
+    dispatchTable.CmdResetQueryPool = (PFN_vkCmdResetQueryPool) gdpa(*pDevice,
+                                                                     "vkCmdResetQueryPool");
+    dispatchTable.CmdWriteTimestamp = (PFN_vkCmdWriteTimestamp) gdpa(*pDevice,
+                                                                     "vkCmdWriteTimestamp");
+
+    // everything kept for the device, released at once by vkDestroyDevice
+    LayerAllocator allocator(pAllocator, VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+    Arena *arena = allocator.create<Arena>(allocator);
+    VkLayerDispatchTable *table = NULL;
+    if (arena != NULL)
+        table = arena->create<VkLayerDispatchTable>(dispatchTable);
+    ProcAddrCache *procs = table != NULL ? arena->create<ProcAddrCache>(arena) : NULL;
+    DeviceState *state = procs != NULL ? arena->create<DeviceState>(arena) : NULL;
+    if (state == NULL) {
+        allocator.destroy(arena);
+        dispatchTable.DestroyDevice(*pDevice, pAllocator);
+        *pDevice = VK_NULL_HANDLE;
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
 
     // store the table by key
-    {
-        scoped_lock l(global_lock);
-        device_dispatch[GetKey(*pDevice)] = dispatchTable;
-    }
+    device_arenas.insert(GetKey(*pDevice), arena);
+    device_dispatch.insert(GetKey(*pDevice), table);
+    device_procs.insert(GetKey(*pDevice), procs);
+
+    state->device = *pDevice;
+    state->instance = instance_context(physicalDevice);
+    state->physical_device = physicalDevice;
+    for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++)
+        if (strcmp(pCreateInfo->ppEnabledExtensionNames[i], VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME)
+            == 0)
+            state->display_timing = true;
+    state->intercept = intercept_groups();
+    if (present_override_active())
+        state->intercept |= InterceptPresent;
+#if VKDISPLAYHACKSTEAMVR_STATS
+    if (state->intercept != 0)
+        state->telemetry = telemetry_claim((uint64_t) (uintptr_t) *pDevice);
+    if (state->intercept & InterceptCommands)
+        state->gpu_timestamps = gpu_timestamps_create(state->instance,
+                                                      physicalDevice,
+                                                      *pDevice,
+                                                      table,
+                                                      arena,
+                                                      &state->gpu_timestamp_families);
+#endif
+    device_states.insert(GetKey(*pDevice), state);
+    trace.handle = trace_handle(*pDevice);
 
     return VK_SUCCESS;
 }
@@ -162,8 +892,183 @@ vkdisplayhacksteamvr_CreateDevice(VkPhysicalDevice physicalDevice,
 VK_LAYER_EXPORT void VKAPI_CALL
 vkdisplayhacksteamvr_DestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator)
 {
-    scoped_lock l(global_lock);
-    device_dispatch.erase(GetKey(device));
+    TraceScope trace(TRACE_DestroyDevice, trace_handle(device));
+    // destroying VK_NULL_HANDLE does nothing, and it has no key to look up
+    if (device == VK_NULL_HANDLE)
+        return;
+
+    DeviceState *state = device_states.erase(GetKey(device));
+#if VKDISPLAYHACKSTEAMVR_STATS
+    // destroying the device implicitly destroys its command pools, their records go with the arena
+    if (state != NULL) {
+        {
+            scoped_lock l(state->command_pools_lock);
+            for (auto &pool : state->command_pools)
+                pool.second.forEachLive([](CommandBufferRecord *r) {
+                    commandbuffer_records.erase(r->commandBuffer);
+                });
+        }
+
+        if (state->telemetry != NULL)
+            telemetry_release(state->telemetry);
+    }
+#else
+    (void) state;
+#endif
+
+    // not one of ours, there is nothing to forward to
+    VkLayerDispatchTable *dispatch = device_dispatch.erase(GetKey(device));
+    if (dispatch == NULL)
+        return;
+    PFN_vkDestroyDevice destroy = dispatch->DestroyDevice;
+    device_procs.erase(GetKey(device));
+
+    // our query pools go before the device
+    if (Arena *arena = device_arenas.erase(GetKey(device))) {
+        LayerAllocator allocator = arena->allocator();
+        allocator.destroy(arena);
+    }
+
+    destroy(device, pAllocator);
+    alloc_log((uint64_t) (uintptr_t) device);
+}
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+///////////////////////////////////////////////////////////////////////////////////////////
+// Command buffer lifetime, keeps the stats records in step with the pools
+
+static void release_gpu_slot(DeviceState *state, CommandBufferRecord *r)
+{
+    if (r->gpu_slot != GpuTimestamps::NO_SLOT)
+        state->gpu_timestamps->release(r->gpu_slot);
+    r->gpu_slot = GpuTimestamps::NO_SLOT;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_CreateCommandPool(VkDevice device,
+                                       const VkCommandPoolCreateInfo *pCreateInfo,
+                                       const VkAllocationCallbacks *pAllocator,
+                                       VkCommandPool *pCommandPool)
+{
+    TraceScope trace(TRACE_CreateCommandPool,
+                     trace_handle(device),
+                     pCreateInfo->queueFamilyIndex);
+    VkResult ret = device_dispatch.get(GetKey(device))
+                       ->CreateCommandPool(device, pCreateInfo, pAllocator, pCommandPool);
+    if (ret != VK_SUCCESS)
+        return ret;
+    trace.args[1] = trace_handle(*pCommandPool);
+
+    // the pool's command buffers only get GPU timestamps if its queue family can write them
+    DeviceState *state = device_states.get(GetKey(device));
+    uint32_t family = pCreateInfo->queueFamilyIndex;
+    bool timestamps = state->gpu_timestamps != NULL && family < 32
+                      && (state->gpu_timestamp_families & (1u << family));
+    scoped_lock l(state->command_pools_lock);
+    arena_grow([&] {
+        state->command_pools.try_emplace(*pCommandPool, state->arena).first->second.gpu_timestamps
+            = timestamps;
+    });
+
+    return ret;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_AllocateCommandBuffers(VkDevice device,
+                                            const VkCommandBufferAllocateInfo *pAllocateInfo,
+                                            VkCommandBuffer *pCommandBuffers)
+{
+    TraceScope trace(TRACE_AllocateCommandBuffers,
+                     trace_handle(device),
+                     trace_handle(pAllocateInfo->commandPool),
+                     pAllocateInfo->commandBufferCount);
+    VkResult ret = device_dispatch.get(GetKey(device))
+                       ->AllocateCommandBuffers(device, pAllocateInfo, pCommandBuffers);
+    if (ret != VK_SUCCESS)
+        return ret;
+
+    DeviceState *state = device_states.get(GetKey(device));
+    scoped_lock l(state->command_pools_lock);
+    // out of memory the command buffers go without stats, every intercept passes them through
+    CommandPoolRecords *pool = NULL;
+    if (!arena_grow([&] {
+            pool = &state->command_pools.try_emplace(pAllocateInfo->commandPool, state->arena)
+                        .first->second;
+        }))
+        return ret;
+    for (uint32_t i = 0; i < pAllocateInfo->commandBufferCount; i++) {
+        CommandBufferRecord *r = pool->acquire(pCommandBuffers[i]);
+        if (r == NULL)
+            break;
+        r->primary = pAllocateInfo->level == VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandbuffer_records.insert(pCommandBuffers[i], r);
+    }
+
+    return ret;
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_FreeCommandBuffers(
+    VkDevice device,
+    VkCommandPool commandPool,
+    uint32_t commandBufferCount,
+    const VkCommandBuffer *pCommandBuffers)
+{
+    TraceScope trace(TRACE_FreeCommandBuffers,
+                     trace_handle(device),
+                     trace_handle(commandPool),
+                     commandBufferCount);
+    {
+        DeviceState *state = device_states.get(GetKey(device));
+        scoped_lock l(state->command_pools_lock);
+        auto it = state->command_pools.find(commandPool);
+        for (uint32_t i = 0; i < commandBufferCount; i++) {
+            if (pCommandBuffers[i] == VK_NULL_HANDLE)
+                continue;
+            CommandBufferRecord *r = commandbuffer_records.erase(pCommandBuffers[i]);
+            if (r != nullptr && it != state->command_pools.end()) {
+                release_gpu_slot(state, r);
+                it->second.release(r);
+            }
+        }
+    }
+
+    device_dispatch.get(GetKey(device))
+        ->FreeCommandBuffers(device, commandPool, commandBufferCount, pCommandBuffers);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_ResetCommandPool(
+    VkDevice device, VkCommandPool commandPool, VkCommandPoolResetFlags flags)
+{
+    TraceScope trace(TRACE_ResetCommandPool, trace_handle(device), trace_handle(commandPool));
+    {
+        DeviceState *state = device_states.get(GetKey(device));
+        scoped_lock l(state->command_pools_lock);
+        auto it = state->command_pools.find(commandPool);
+        if (it != state->command_pools.end())
+            it->second.forEachLive([](CommandBufferRecord *r) { r->stats = CommandStats(); });
+    }
+
+    return device_dispatch.get(GetKey(device))->ResetCommandPool(device, commandPool, flags);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_DestroyCommandPool(
+    VkDevice device, VkCommandPool commandPool, const VkAllocationCallbacks *pAllocator)
+{
+    TraceScope trace(TRACE_DestroyCommandPool, trace_handle(device), trace_handle(commandPool));
+    {
+        DeviceState *state = device_states.get(GetKey(device));
+        scoped_lock l(state->command_pools_lock);
+        auto it = state->command_pools.find(commandPool);
+        if (it != state->command_pools.end()) {
+            it->second.forEachLive([state](CommandBufferRecord *r) {
+                commandbuffer_records.erase(r->commandBuffer);
+                release_gpu_slot(state, r);
+            });
+            state->command_pools.erase(it);
+        }
+    }
+
+    device_dispatch.get(GetKey(device))->DestroyCommandPool(device, commandPool, pAllocator);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -172,9 +1077,26 @@ vkdisplayhacksteamvr_DestroyDevice(VkDevice device, const VkAllocationCallbacks
 VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_BeginCommandBuffer(
     VkCommandBuffer commandBuffer, const VkCommandBufferBeginInfo *pBeginInfo)
 {
-    scoped_lock l(global_lock);
-    commandbuffer_stats[commandBuffer] = CommandStats();
-    return device_dispatch[GetKey(commandBuffer)].BeginCommandBuffer(commandBuffer, pBeginInfo);
+    TraceScope trace(TRACE_BeginCommandBuffer, trace_handle(commandBuffer), pBeginInfo->flags);
+    // command buffers are externally synchronized, so the record needs no lock while recording
+    CommandBufferRecord *r = commandbuffer_records.get(commandBuffer);
+    if (r != NULL)
+        r->stats = CommandStats();
+
+    VkResult ret = device_dispatch.get(GetKey(commandBuffer))
+                       ->BeginCommandBuffer(commandBuffer, pBeginInfo);
+
+    // secondaries may continue a render pass, where the query reset isn't allowed
+    if (ret == VK_SUCCESS && r != NULL && r->primary && r->gpu_timestamps) {
+        if (GpuTimestamps *t = device_states.get(GetKey(commandBuffer))->gpu_timestamps) {
+            if (r->gpu_slot == GpuTimestamps::NO_SLOT)
+                r->gpu_slot = t->acquire();
+            if (r->gpu_slot != GpuTimestamps::NO_SLOT)
+                t->begin(commandBuffer, r->gpu_slot);
+        }
+    }
+
+    return ret;
 }
 
 VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDraw(VkCommandBuffer commandBuffer,
@@ -183,17 +1105,18 @@ VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDraw(VkCommandBuffer com
                                                              uint32_t firstVertex,
                                                              uint32_t firstInstance)
 {
-    scoped_lock l(global_lock);
-
-    commandbuffer_stats[commandBuffer].drawCount++;
-    commandbuffer_stats[commandBuffer].instanceCount += instanceCount;
-    commandbuffer_stats[commandBuffer].vertCount += instanceCount * vertexCount;
+    TraceScope trace(TRACE_CmdDraw, trace_handle(commandBuffer), vertexCount, instanceCount);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) {
+        r->stats.drawCount++;
+        r->stats.instanceCount += instanceCount;
+        r->stats.vertCount += instanceCount * vertexCount;
+    }
 
-    device_dispatch[GetKey(commandBuffer)].CmdDraw(commandBuffer,
-                                                   vertexCount,
-                                                   instanceCount,
-                                                   firstVertex,
-                                                   firstInstance);
+    device_dispatch.get(GetKey(commandBuffer))->CmdDraw(commandBuffer,
+                                                        vertexCount,
+                                                        instanceCount,
+                                                        firstVertex,
+                                                        firstInstance);
 }
 
 VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDrawIndexed(VkCommandBuffer commandBuffer,
@@ -203,33 +1126,1030 @@ VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDrawIndexed(VkCommandBuf
                                                                     int32_t vertexOffset,
                                                                     uint32_t firstInstance)
 {
-    scoped_lock l(global_lock);
+    TraceScope trace(TRACE_CmdDrawIndexed, trace_handle(commandBuffer), indexCount, instanceCount);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) {
+        r->stats.drawCount++;
+        r->stats.instanceCount += instanceCount;
+        r->stats.vertCount += instanceCount * indexCount;
+    }
+
+    device_dispatch.get(GetKey(commandBuffer))->CmdDrawIndexed(commandBuffer,
+                                                               indexCount,
+                                                               instanceCount,
+                                                               firstIndex,
+                                                               vertexOffset,
+                                                               firstInstance);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDrawIndirect(VkCommandBuffer commandBuffer,
+                                                                     VkBuffer buffer,
+                                                                     VkDeviceSize offset,
+                                                                     uint32_t drawCount,
+                                                                     uint32_t stride)
+{
+    TraceScope trace(TRACE_CmdDrawIndirect, trace_handle(commandBuffer), drawCount);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.indirectDraws += drawCount;
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdDrawIndirect(commandBuffer, buffer, offset, drawCount, stride);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL
+vkdisplayhacksteamvr_CmdDrawIndexedIndirect(VkCommandBuffer commandBuffer,
+                                            VkBuffer buffer,
+                                            VkDeviceSize offset,
+                                            uint32_t drawCount,
+                                            uint32_t stride)
+{
+    TraceScope trace(TRACE_CmdDrawIndexedIndirect, trace_handle(commandBuffer), drawCount);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.indirectDraws += drawCount;
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdDrawIndexedIndirect(commandBuffer, buffer, offset, drawCount, stride);
+}
+
+// the core and the extension names of the *Count draws and render pass begins are separate
+// entries in the next layer's table, either may be missing
+#define CMD_DRAW_INDIRECT_COUNT(func) \
+    VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_##func(VkCommandBuffer commandBuffer, \
+                                                                VkBuffer buffer, \
+                                                                VkDeviceSize offset, \
+                                                                VkBuffer countBuffer, \
+                                                                VkDeviceSize countBufferOffset, \
+                                                                uint32_t maxDrawCount, \
+                                                                uint32_t stride) \
+    { \
+        TraceScope trace(TRACE_##func, trace_handle(commandBuffer), maxDrawCount); \
+        if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) \
+            r->stats.indirectDraws += maxDrawCount; \
+\
+        device_dispatch.get(GetKey(commandBuffer)) \
+            ->func(commandBuffer, \
+                   buffer, \
+                   offset, \
+                   countBuffer, \
+                   countBufferOffset, \
+                   maxDrawCount, \
+                   stride); \
+    }
+
+CMD_DRAW_INDIRECT_COUNT(CmdDrawIndirectCount)
+CMD_DRAW_INDIRECT_COUNT(CmdDrawIndirectCountKHR)
+CMD_DRAW_INDIRECT_COUNT(CmdDrawIndexedIndirectCount)
+CMD_DRAW_INDIRECT_COUNT(CmdDrawIndexedIndirectCountKHR)
+
+#undef CMD_DRAW_INDIRECT_COUNT
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDispatch(VkCommandBuffer commandBuffer,
+                                                                 uint32_t groupCountX,
+                                                                 uint32_t groupCountY,
+                                                                 uint32_t groupCountZ)
+{
+    TraceScope trace(TRACE_CmdDispatch, trace_handle(commandBuffer), groupCountX, groupCountY);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.dispatches++;
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdDispatch(commandBuffer, groupCountX, groupCountY, groupCountZ);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_CmdDispatchIndirect(
+    VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset)
+{
+    TraceScope trace(TRACE_CmdDispatchIndirect, trace_handle(commandBuffer));
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.dispatches++;
+
+    device_dispatch.get(GetKey(commandBuffer))->CmdDispatchIndirect(commandBuffer, buffer, offset);
+}
 
-    commandbuffer_stats[commandBuffer].drawCount++;
-    commandbuffer_stats[commandBuffer].instanceCount += instanceCount;
-    commandbuffer_stats[commandBuffer].vertCount += instanceCount * indexCount;
+VK_LAYER_EXPORT void VKAPI_CALL
+vkdisplayhacksteamvr_CmdBindPipeline(VkCommandBuffer commandBuffer,
+                                     VkPipelineBindPoint pipelineBindPoint,
+                                     VkPipeline pipeline)
+{
+    TraceScope trace(TRACE_CmdBindPipeline,
+                     trace_handle(commandBuffer),
+                     pipelineBindPoint,
+                     trace_handle(pipeline));
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.pipelineBinds++;
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdBindPipeline(commandBuffer, pipelineBindPoint, pipeline);
+}
 
-    device_dispatch[GetKey(commandBuffer)].CmdDrawIndexed(commandBuffer,
-                                                          indexCount,
-                                                          instanceCount,
-                                                          firstIndex,
-                                                          vertexOffset,
-                                                          firstInstance);
+VK_LAYER_EXPORT void VKAPI_CALL
+vkdisplayhacksteamvr_CmdBindDescriptorSets(VkCommandBuffer commandBuffer,
+                                           VkPipelineBindPoint pipelineBindPoint,
+                                           VkPipelineLayout layout,
+                                           uint32_t firstSet,
+                                           uint32_t descriptorSetCount,
+                                           const VkDescriptorSet *pDescriptorSets,
+                                           uint32_t dynamicOffsetCount,
+                                           const uint32_t *pDynamicOffsets)
+{
+    TraceScope trace(TRACE_CmdBindDescriptorSets,
+                     trace_handle(commandBuffer),
+                     pipelineBindPoint,
+                     descriptorSetCount);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.descriptorSetBinds += descriptorSetCount;
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdBindDescriptorSets(commandBuffer,
+                                pipelineBindPoint,
+                                layout,
+                                firstSet,
+                                descriptorSetCount,
+                                pDescriptorSets,
+                                dynamicOffsetCount,
+                                pDynamicOffsets);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL
+vkdisplayhacksteamvr_CmdBeginRenderPass(VkCommandBuffer commandBuffer,
+                                        const VkRenderPassBeginInfo *pRenderPassBegin,
+                                        VkSubpassContents contents)
+{
+    TraceScope trace(TRACE_CmdBeginRenderPass,
+                     trace_handle(commandBuffer),
+                     trace_handle(pRenderPassBegin->renderPass));
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        r->stats.renderPasses++;
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdBeginRenderPass(commandBuffer, pRenderPassBegin, contents);
+}
+
+#define CMD_BEGIN_RENDER_PASS_2(func) \
+    VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_##func( \
+        VkCommandBuffer commandBuffer, \
+        const VkRenderPassBeginInfo *pRenderPassBegin, \
+        const VkSubpassBeginInfo *pSubpassBeginInfo) \
+    { \
+        TraceScope trace(TRACE_##func, \
+                         trace_handle(commandBuffer), \
+                         trace_handle(pRenderPassBegin->renderPass)); \
+        if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) \
+            r->stats.renderPasses++; \
+\
+        device_dispatch.get(GetKey(commandBuffer)) \
+            ->func(commandBuffer, pRenderPassBegin, pSubpassBeginInfo); \
+    }
+
+CMD_BEGIN_RENDER_PASS_2(CmdBeginRenderPass2)
+CMD_BEGIN_RENDER_PASS_2(CmdBeginRenderPass2KHR)
+
+#undef CMD_BEGIN_RENDER_PASS_2
+
+// dynamic rendering counts as a render pass too
+#define CMD_BEGIN_RENDERING(func) \
+    VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_##func( \
+        VkCommandBuffer commandBuffer, const VkRenderingInfo *pRenderingInfo) \
+    { \
+        TraceScope trace(TRACE_##func, \
+                         trace_handle(commandBuffer), \
+                         pRenderingInfo->colorAttachmentCount); \
+        if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) \
+            r->stats.renderPasses++; \
+\
+        device_dispatch.get(GetKey(commandBuffer))->func(commandBuffer, pRenderingInfo); \
+    }
+
+CMD_BEGIN_RENDERING(CmdBeginRendering)
+CMD_BEGIN_RENDERING(CmdBeginRenderingKHR)
+
+#undef CMD_BEGIN_RENDERING
+
+// secondaries have finished recording by now, their stats are final until they are re-recorded
+VK_LAYER_EXPORT void VKAPI_CALL
+vkdisplayhacksteamvr_CmdExecuteCommands(VkCommandBuffer commandBuffer,
+                                        uint32_t commandBufferCount,
+                                        const VkCommandBuffer *pCommandBuffers)
+{
+    TraceScope trace(TRACE_CmdExecuteCommands, trace_handle(commandBuffer), commandBufferCount);
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer))
+        for (uint32_t i = 0; i < commandBufferCount; i++)
+            if (CommandBufferRecord *secondary = commandbuffer_records.get(pCommandBuffers[i]))
+                r->stats.add(secondary->stats);
+
+    device_dispatch.get(GetKey(commandBuffer))
+        ->CmdExecuteCommands(commandBuffer, commandBufferCount, pCommandBuffers);
 }
 
 VK_LAYER_EXPORT VkResult VKAPI_CALL
 vkdisplayhacksteamvr_EndCommandBuffer(VkCommandBuffer commandBuffer)
 {
-    scoped_lock l(global_lock);
+    TraceScope trace(TRACE_EndCommandBuffer, trace_handle(commandBuffer));
+    // handed to the background writer, no stdio on the recording thread
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) {
+        uint64_t start = log_now_ns();
+        CommandStats &s = r->stats;
+        trace.args[0] = s.drawCount;
+        log_push(LogRecordType::CommandBuffer,
+                 (uint64_t) (uintptr_t) commandBuffer,
+                 s.drawCount,
+                 s.instanceCount,
+                 s.vertCount,
+                 !r->primary);
+
+        DeviceState *state = device_states.get(GetKey(commandBuffer));
+        if (r->gpu_slot != GpuTimestamps::NO_SLOT)
+            state->gpu_timestamps->end(commandBuffer, r->gpu_slot, s.drawCount, s.vertCount);
+        // secondaries are counted in the primaries that execute them
+        if (state->telemetry != NULL && r->primary)
+            telemetry_command_buffer(state->telemetry,
+                                     s.drawCount,
+                                     s.instanceCount,
+                                     s.vertCount,
+                                     start);
+    }
+
+    return device_dispatch.get(GetKey(commandBuffer))->EndCommandBuffer(commandBuffer);
+}
+
+#endif // VKDISPLAYHACKSTEAMVR_STATS
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Display mode override, puts the preferred mode of the overridden display first
+
+// VK_DISPLAY_HACK_STEAMVR_MODE=<width>x<height>@<Hz> or max-refresh
+struct ModePreference
+{
+    enum Kind
+    {
+        Driver, // keep the driver's order
+        MaxRefresh,
+        Exact,
+    } kind = Driver;
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t refresh_mhz = 0;
+};
+
+static ModePreference mode_preference_parse()
+{
+    ModePreference p;
+    const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_MODE");
+    if (env == NULL || *env == '\0')
+        return p;
+
+    if (strcmp(env, "max-refresh") == 0) {
+        p.kind = ModePreference::MaxRefresh;
+        return p;
+    }
+
+    double hz = 0;
+    char trailing;
+    if (sscanf(env, "%ux%u@%lf%c", &p.width, &p.height, &hz, &trailing) == 3 && hz > 0) {
+        p.kind = ModePreference::Exact;
+        p.refresh_mhz = (uint32_t) (hz * 1000 + 0.5);
+        return p;
+    }
+
+    printf("vkdisplayhacksteamvr: ignoring VK_DISPLAY_HACK_STEAMVR_MODE=%s, expected WxH@Hz or "
+           "max-refresh\n",
+           env);
+    return ModePreference();
+}
+
+static const ModePreference &mode_preference()
+{
+    static const ModePreference p = mode_preference_parse();
+    return p;
+}
+
+// drivers report e.g. 89998 mHz for a 90 Hz mode
+constexpr uint32_t MODE_REFRESH_TOLERANCE_MHZ = 500;
+
+static bool extent_equal(VkExtent2D a, VkExtent2D b)
+{
+    return a.width == b.width && a.height == b.height;
+}
+
+// index of the preferred mode, modes.size() if none qualifies. native is the display's
+// physicalResolution, {0, 0} if the driver didn't report one.
+static size_t mode_preferred(const ArenaVector<VkDisplayModePropertiesKHR> &modes,
+                             const ModePreference &p,
+                             VkExtent2D native)
+{
+    size_t best = modes.size();
+    if (modes.empty())
+        return best;
+
+    if (p.kind == ModePreference::MaxRefresh) {
+        // only at the panel's native resolution, a faster mode at a lower resolution isn't what a
+        // headset wants. Without a mode at it, the largest one stands in for it.
+        if (std::none_of(modes.begin(), modes.end(), [&](const VkDisplayModePropertiesKHR &m) {
+                return extent_equal(m.parameters.visibleRegion, native);
+            })) {
+            native = modes[0].parameters.visibleRegion;
+            for (const VkDisplayModePropertiesKHR &m : modes) {
+                VkExtent2D e = m.parameters.visibleRegion;
+                if ((uint64_t) e.width * e.height > (uint64_t) native.width * native.height)
+                    native = e;
+            }
+        }
+
+        for (size_t i = 0; i < modes.size(); i++) {
+            const VkDisplayModeParametersKHR &m = modes[i].parameters;
+            if (extent_equal(m.visibleRegion, native)
+                && (best == modes.size()
+                    || m.refreshRate > modes[best].parameters.refreshRate))
+                best = i;
+        }
+        return best;
+    }
+
+    uint32_t best_diff = MODE_REFRESH_TOLERANCE_MHZ + 1;
+    for (size_t i = 0; i < modes.size(); i++) {
+        const VkDisplayModeParametersKHR &m = modes[i].parameters;
+        uint32_t diff = m.refreshRate > p.refresh_mhz ? m.refreshRate - p.refresh_mhz
+                                                      : p.refresh_mhz - m.refreshRate;
+        if (m.visibleRegion.width == p.width && m.visibleRegion.height == p.height
+            && diff < best_diff) {
+            best = i;
+            best_diff = diff;
+        }
+    }
+    return best;
+}
+
+// the whole list of a two call enumeration, retried while it grows between the calls
+template<typename Vector, typename Enumerate>
+static VkResult enumerate_all(Vector *out, Enumerate enumerate)
+{
+    typedef typename Vector::value_type Properties;
+    uint32_t count = 0;
+    VkResult ret;
+    do {
+        ret = enumerate(&count, (Properties *) NULL);
+        if (ret != VK_SUCCESS)
+            return ret;
+        out->resize(count);
+        ret = enumerate(&count, out->data());
+    } while (ret == VK_INCOMPLETE);
+    out->resize(count);
+    return ret;
+}
+
+// the display's physicalResolution from its snapshot, or from the driver when there is none yet,
+// {0, 0} if the driver doesn't list the display. Throws std::bad_alloc when the arena is out of
+// memory.
+static VkExtent2D display_physical_resolution(InstanceContext *ctx,
+                                              VkPhysicalDevice physicalDevice,
+                                              VkDisplayKHR display)
+{
+    DisplayCache *cache = &ctx->display;
+    auto it = cache->display_snapshots.find(physicalDevice);
+    if (it != cache->display_snapshots.end())
+        for (const VkDisplayPropertiesKHR &p : it->second.displays)
+            if (p.display == display)
+                return p.physicalResolution;
+
+    VkLayerInstanceDispatchTable *dispatch = &ctx->dispatch;
+    ArenaVector<VkDisplayPropertiesKHR> displays(ArenaAllocator<int>(cache->arena));
+    if (enumerate_all(&displays,
+                      [&](uint32_t *pCount, VkDisplayPropertiesKHR *pDisplays) {
+                          return dispatch->GetPhysicalDeviceDisplayPropertiesKHR(physicalDevice,
+                                                                                 pCount,
+                                                                                 pDisplays);
+                      })
+        == VK_SUCCESS)
+        for (const VkDisplayPropertiesKHR &p : displays)
+            if (p.display == display)
+                return p.physicalResolution;
+    return VkExtent2D{0, 0};
+}
+
+// queries and orders the modes of an overridden display for display_modes_get, throws
+// std::bad_alloc when the arena is out of memory
+static const ArenaVector<VkDisplayModePropertiesKHR> *
+display_modes_query(InstanceContext *ctx, VkPhysicalDevice physicalDevice, VkDisplayKHR display)
+{
+    DisplayCache *cache = &ctx->display;
+    VkLayerInstanceDispatchTable *dispatch = &ctx->dispatch;
+    ArenaVector<VkDisplayModePropertiesKHR> modes(ArenaAllocator<int>(cache->arena));
+    if (enumerate_all(&modes,
+                      [&](uint32_t *pCount, VkDisplayModePropertiesKHR *pModes) {
+                          return dispatch->GetDisplayModePropertiesKHR(physicalDevice,
+                                                                       display,
+                                                                       pCount,
+                                                                       pModes);
+                      })
+        != VK_SUCCESS)
+        return NULL;
+
+    const ModePreference &p = mode_preference();
+    if (p.kind != ModePreference::Driver) {
+        VkExtent2D native = {0, 0};
+        if (p.kind == ModePreference::MaxRefresh)
+            native = display_physical_resolution(ctx, physicalDevice, display);
+        size_t best = mode_preferred(modes, p, native);
+
+        // not advertised, the display may still take it as a custom mode
+        if (best == modes.size() && p.kind == ModePreference::Exact) {
+            VkDisplayModeCreateInfoKHR info = {};
+            info.sType = VK_STRUCTURE_TYPE_DISPLAY_MODE_CREATE_INFO_KHR;
+            info.parameters.visibleRegion.width = p.width;
+            info.parameters.visibleRegion.height = p.height;
+            info.parameters.refreshRate = p.refresh_mhz;
+
+            VkDisplayModePropertiesKHR created = {};
+            created.parameters = info.parameters;
+            if (dispatch->CreateDisplayModeKHR(physicalDevice,
+                                               display,
+                                               &info,
+                                               NULL,
+                                               &created.displayMode)
+                == VK_SUCCESS) {
+                modes.push_back(created);
+                best = modes.size() - 1;
+            }
+        }
+
+        if (best < modes.size()) {
+            const VkDisplayModeParametersKHR &m = modes[best].parameters;
+            printf("vkdisplayhacksteamvr: preferring mode %ux%u@%.3f Hz\n",
+                   m.visibleRegion.width,
+                   m.visibleRegion.height,
+                   m.refreshRate / 1000.);
+            std::rotate(modes.begin(), modes.begin() + best, modes.begin() + best + 1);
+        } else {
+            printf("vkdisplayhacksteamvr: no mode matches VK_DISPLAY_HACK_STEAMVR_MODE, keeping "
+                   "the driver's order\n");
+        }
+    }
+
+    // refresh rates for frame pacing
+    for (const VkDisplayModePropertiesKHR &m : modes)
+        cache->overridden_modes[m.displayMode] = m.parameters.refreshRate;
+
+    return &cache->display_modes.emplace(display, std::move(modes)).first->second;
+}
+
+// The overridden display's modes with the preferred one first, queried from the driver once per
+// display. NULL for any other display, or out of memory. Called with the context's display_lock
+// held.
+static const ArenaVector<VkDisplayModePropertiesKHR> *
+display_modes_get(InstanceContext *ctx, VkPhysicalDevice physicalDevice, VkDisplayKHR display)
+{
+    DisplayCache *cache = &ctx->display;
+    if (cache->overridden_displays.count(display) == 0)
+        return NULL;
+
+    auto it = cache->display_modes.find(display);
+    if (it != cache->display_modes.end())
+        return &it->second;
+
+    const ArenaVector<VkDisplayModePropertiesKHR> *cached = NULL;
+    arena_grow([&] { cached = display_modes_query(ctx, physicalDevice, display); });
+    return cached;
+}
+
+static void properties_assign(VkDisplayModePropertiesKHR *dst,
+                              const VkDisplayModePropertiesKHR &src)
+{
+    *dst = src;
+}
+
+static void properties_assign(VkDisplayModeProperties2KHR *dst,
+                              const VkDisplayModePropertiesKHR &src)
+{
+    dst->displayModeProperties = src;
+}
+
+static void properties_assign(VkDisplayPropertiesKHR *dst, const VkDisplayPropertiesKHR &src)
+{
+    *dst = src;
+}
+
+static void properties_assign(VkDisplayProperties2KHR *dst, const VkDisplayPropertiesKHR &src)
+{
+    dst->displayProperties = src;
+}
+
+// the application's side of a two call enumeration, served from a cached list
+template<typename Cached, typename Properties>
+static VkResult properties_copy(const Cached &cached,
+                                uint32_t *pPropertyCount,
+                                Properties *pProperties)
+{
+    if (pProperties == NULL) {
+        *pPropertyCount = (uint32_t) cached.size();
+        return VK_SUCCESS;
+    }
+
+    uint32_t count = std::min(*pPropertyCount, (uint32_t) cached.size());
+    for (uint32_t i = 0; i < count; i++)
+        properties_assign(&pProperties[i], cached[i]);
+    *pPropertyCount = count;
+    return count < cached.size() ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+// extension structs chained to the application's output can only be filled by the driver
+template<typename Properties>
+static bool properties_chained(uint32_t *pPropertyCount, const Properties *pProperties)
+{
+    for (uint32_t i = 0; pProperties != NULL && i < *pPropertyCount; i++)
+        if (pProperties[i].pNext != NULL)
+            return true;
+    return false;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_GetDisplayModePropertiesKHR(VkPhysicalDevice physicalDevice,
+                                                 VkDisplayKHR display,
+                                                 uint32_t *pPropertyCount,
+                                                 VkDisplayModePropertiesKHR *pProperties)
+{
+    TraceScope trace(TRACE_GetDisplayModePropertiesKHR,
+                     trace_handle(physicalDevice),
+                     trace_handle(display),
+                     *pPropertyCount);
+    InstanceContext *ctx = instance_context(physicalDevice);
+    {
+        scoped_lock l(ctx->display_lock);
+        if (auto *modes = display_modes_get(ctx, physicalDevice, display))
+            return properties_copy(*modes, pPropertyCount, pProperties);
+    }
 
-    CommandStats &s = commandbuffer_stats[commandBuffer];
-    printf("Command buffer %p ended with %u draws, %u instances and %u vertices",
-           commandBuffer,
-           s.drawCount,
-           s.instanceCount,
-           s.vertCount);
+    return ctx->dispatch.GetDisplayModePropertiesKHR(physicalDevice,
+                                                     display,
+                                                     pPropertyCount,
+                                                     pProperties);
+}
 
-    return device_dispatch[GetKey(commandBuffer)].EndCommandBuffer(commandBuffer);
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_GetDisplayModeProperties2KHR(VkPhysicalDevice physicalDevice,
+                                                  VkDisplayKHR display,
+                                                  uint32_t *pPropertyCount,
+                                                  VkDisplayModeProperties2KHR *pProperties)
+{
+    TraceScope trace(TRACE_GetDisplayModeProperties2KHR,
+                     trace_handle(physicalDevice),
+                     trace_handle(display),
+                     *pPropertyCount);
+    InstanceContext *ctx = instance_context(physicalDevice);
+    {
+        scoped_lock l(ctx->display_lock);
+        auto *modes = display_modes_get(ctx, physicalDevice, display);
+        if (modes != NULL && !properties_chained(pPropertyCount, pProperties))
+            return properties_copy(*modes, pPropertyCount, pProperties);
+    }
+
+    return ctx->dispatch.GetDisplayModeProperties2KHR(physicalDevice,
+                                                      display,
+                                                      pPropertyCount,
+                                                      pProperties);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_CreateDisplayModeKHR(VkPhysicalDevice physicalDevice,
+                                          VkDisplayKHR display,
+                                          const VkDisplayModeCreateInfoKHR *pCreateInfo,
+                                          const VkAllocationCallbacks *pAllocator,
+                                          VkDisplayModeKHR *pMode)
+{
+    TraceScope trace(TRACE_CreateDisplayModeKHR,
+                     trace_handle(physicalDevice),
+                     trace_handle(display),
+                     pCreateInfo->parameters.refreshRate);
+    InstanceContext *ctx = instance_context(physicalDevice);
+    VkResult ret = ctx->dispatch.CreateDisplayModeKHR(physicalDevice,
+                                                      display,
+                                                      pCreateInfo,
+                                                      pAllocator,
+                                                      pMode);
+    if (ret != VK_SUCCESS)
+        return ret;
+
+    scoped_lock l(ctx->display_lock);
+    DisplayCache *cache = &ctx->display;
+    if (cache->overridden_displays.count(display) > 0)
+        arena_grow([&] { cache->overridden_modes[*pMode] = pCreateInfo->parameters.refreshRate; });
+    return ret;
+}
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+///////////////////////////////////////////////////////////////////////////////////////////
+// Frame pacing of the swapchains on the overridden display, and per frame workload
+
+// Paces a new swapchain on the overridden display, refresh_mhz is the rate of its mode
+static void frame_pacing_start(DeviceState *state,
+                               VkLayerDispatchTable *dispatch,
+                               VkSwapchainKHR swapchain,
+                               uint32_t refresh_mhz)
+{
+    // the driver knows the refresh period better than the nominal rate of the mode
+    uint64_t refresh_ns = refresh_mhz > 0 ? 1000000000000ull / refresh_mhz : 0;
+    VkRefreshCycleDurationGOOGLE refresh_cycle;
+    if (state->display_timing
+        && dispatch->GetRefreshCycleDurationGOOGLE(state->device, swapchain, &refresh_cycle)
+               == VK_SUCCESS)
+        refresh_ns = refresh_cycle.refreshDuration;
+
+    // out of memory the swapchain goes without pacing stats
+    FramePacing *p = state->pacing_records.create(refresh_ns, state->display_timing);
+    if (p == NULL)
+        return;
+    if (FramePacing *replaced = swapchain_pacing.insert(SwapchainKey(swapchain), p))
+        state->pacing_records.destroy(replaced);
+    state->paced_swapchains.fetch_add(1, std::memory_order_relaxed);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_DestroySwapchainKHR(
+    VkDevice device, VkSwapchainKHR swapchain, const VkAllocationCallbacks *pAllocator)
+{
+    TraceScope trace(TRACE_DestroySwapchainKHR, trace_handle(device), trace_handle(swapchain));
+    if (swapchain != VK_NULL_HANDLE) {
+        if (FramePacing *p = swapchain_pacing.erase(SwapchainKey(swapchain))) {
+            DeviceState *state = device_states.get(GetKey(device));
+            state->pacing_records.destroy(p);
+            state->paced_swapchains.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    device_dispatch.get(GetKey(device))->DestroySwapchainKHR(device, swapchain, pAllocator);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_AcquireNextImageKHR(VkDevice device,
+                                                                             VkSwapchainKHR swapchain,
+                                                                             uint64_t timeout,
+                                                                             VkSemaphore semaphore,
+                                                                             VkFence fence,
+                                                                             uint32_t *pImageIndex)
+{
+    TraceScope trace(TRACE_AcquireNextImageKHR, trace_handle(device), trace_handle(swapchain));
+    FramePacing *p = swapchain_pacing.get(SwapchainKey(swapchain));
+    uint64_t start = p != NULL ? log_now_ns() : 0;
+
+    VkResult ret = device_dispatch.get(GetKey(device))
+                       ->AcquireNextImageKHR(device, swapchain, timeout, semaphore, fence, pImageIndex);
+    if (ret == VK_SUCCESS || ret == VK_SUBOPTIMAL_KHR)
+        trace.args[1] = *pImageIndex;
+
+    if (p != NULL) {
+        bool acquired = ret == VK_SUCCESS || ret == VK_SUBOPTIMAL_KHR;
+        p->acquired(acquired ? *pImageIndex : FramePacing::NO_IMAGE, start, log_now_ns());
+    }
+    return ret;
+}
+
+// Adds one submit call's command buffers to the device's frame workload. Pending command buffers
+// can't be re-recorded, so their stats are stable while the submit reads them. The GPU timestamps
+// of a submitted command buffer may be read from now on.
+static void frame_workload_add(DeviceState *state, CommandStats *sum, VkCommandBuffer commandBuffer)
+{
+    if (CommandBufferRecord *r = commandbuffer_records.get(commandBuffer)) {
+        sum->add(r->stats);
+        if (r->gpu_slot != GpuTimestamps::NO_SLOT && state != NULL)
+            state->gpu_timestamps->submitted(r->gpu_slot);
+    }
+}
+
+static void frame_workload_submitted(DeviceState *state,
+                                     uint32_t submitCount,
+                                     uint32_t commandBuffers,
+                                     const CommandStats &sum)
+{
+    if (state->paced_swapchains.load(std::memory_order_relaxed) > 0)
+        state->last_submit_ns.store(log_now_ns(), std::memory_order_relaxed);
+
+    // one atomic add per counter and submit call, not per command buffer
+    DeviceState::FrameWorkload &f = state->frame;
+    f.submits.fetch_add(submitCount, std::memory_order_relaxed);
+    f.command_buffers.fetch_add(commandBuffers, std::memory_order_relaxed);
+    f.draws.fetch_add(sum.drawCount, std::memory_order_relaxed);
+    f.indirect_draws.fetch_add(sum.indirectDraws, std::memory_order_relaxed);
+    f.vertices.fetch_add(sum.vertCount, std::memory_order_relaxed);
+    f.dispatches.fetch_add(sum.dispatches, std::memory_order_relaxed);
+    f.pipeline_binds.fetch_add(sum.pipelineBinds, std::memory_order_relaxed);
+    f.descriptor_set_binds.fetch_add(sum.descriptorSetBinds, std::memory_order_relaxed);
+    f.render_passes.fetch_add(sum.renderPasses, std::memory_order_relaxed);
+}
+
+// one frame's workload profile, everything submitted on the device since the previous present
+static void frame_workload_presented(DeviceState *state)
+{
+    DeviceState::FrameWorkload &f = state->frame;
+    uint64_t submits = f.submits.exchange(0, std::memory_order_relaxed);
+    if (submits == 0)
+        return;
+
+    uint64_t handle = (uint64_t) (uintptr_t) state->device;
+    log_push(LogRecordType::FrameDraws,
+             handle,
+             f.command_buffers.exchange(0, std::memory_order_relaxed),
+             f.draws.exchange(0, std::memory_order_relaxed),
+             f.indirect_draws.exchange(0, std::memory_order_relaxed),
+             f.vertices.exchange(0, std::memory_order_relaxed));
+    log_push(LogRecordType::FrameWork,
+             handle,
+             f.dispatches.exchange(0, std::memory_order_relaxed),
+             f.pipeline_binds.exchange(0, std::memory_order_relaxed),
+             f.descriptor_set_binds.exchange(0, std::memory_order_relaxed),
+             f.render_passes.exchange(0, std::memory_order_relaxed));
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_QueueSubmit(VkQueue queue,
+                                                                     uint32_t submitCount,
+                                                                     const VkSubmitInfo *pSubmits,
+                                                                     VkFence fence)
+{
+    TraceScope trace(TRACE_QueueSubmit, trace_handle(queue), submitCount, trace_handle(fence));
+    // a queue of a device the layer has no state for only passes through
+    DeviceState *state = device_states.get(GetKey(queue));
+    CommandStats sum;
+    uint32_t commandBuffers = 0;
+    for (uint32_t i = 0; i < submitCount; i++) {
+        for (uint32_t j = 0; j < pSubmits[i].commandBufferCount; j++)
+            frame_workload_add(state, &sum, pSubmits[i].pCommandBuffers[j]);
+        commandBuffers += pSubmits[i].commandBufferCount;
+    }
+    if (state != NULL)
+        frame_workload_submitted(state, submitCount, commandBuffers, sum);
+
+    return device_dispatch.get(GetKey(queue))->QueueSubmit(queue, submitCount, pSubmits, fence);
+}
+
+#define QUEUE_SUBMIT_2(func) \
+    VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_##func(VkQueue queue, \
+                                                                    uint32_t submitCount, \
+                                                                    const VkSubmitInfo2 *pSubmits, \
+                                                                    VkFence fence) \
+    { \
+        TraceScope trace(TRACE_##func, trace_handle(queue), submitCount, trace_handle(fence)); \
+        DeviceState *state = device_states.get(GetKey(queue)); \
+        CommandStats sum; \
+        uint32_t commandBuffers = 0; \
+        for (uint32_t i = 0; i < submitCount; i++) { \
+            for (uint32_t j = 0; j < pSubmits[i].commandBufferInfoCount; j++) \
+                frame_workload_add(state, &sum, pSubmits[i].pCommandBufferInfos[j].commandBuffer); \
+            commandBuffers += pSubmits[i].commandBufferInfoCount; \
+        } \
+        if (state != NULL) \
+            frame_workload_submitted(state, submitCount, commandBuffers, sum); \
+\
+        return device_dispatch.get(GetKey(queue))->func(queue, submitCount, pSubmits, fence); \
+    }
+
+QUEUE_SUBMIT_2(QueueSubmit2)
+QUEUE_SUBMIT_2(QueueSubmit2KHR)
+
+#undef QUEUE_SUBMIT_2
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+{
+    TraceScope trace(TRACE_QueuePresentKHR, trace_handle(queue));
+    if (pPresentInfo->swapchainCount > 0) {
+        trace.args[0] = trace_handle(pPresentInfo->pSwapchains[0]);
+        trace.args[1] = pPresentInfo->pImageIndices[0];
+    }
+    uint64_t start = log_now_ns();
+    VkLayerDispatchTable *dispatch = device_dispatch.get(GetKey(queue));
+    DeviceState *state = device_states.get(GetKey(queue));
+    if (state == NULL)
+        return dispatch->QueuePresentKHR(queue, pPresentInfo);
+    frame_workload_presented(state);
+    if (state->telemetry != NULL)
+        telemetry_frame(state->telemetry, start);
+    if (state->paced_swapchains.load(std::memory_order_relaxed) == 0)
+        return dispatch->QueuePresentKHR(queue, pPresentInfo);
+
+    uint64_t now = log_now_ns();
+    VkResult ret = dispatch->QueuePresentKHR(queue, pPresentInfo);
+
+    uint64_t last_submit = state->last_submit_ns.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
+        VkSwapchainKHR swapchain = pPresentInfo->pSwapchains[i];
+        FramePacing *p = swapchain_pacing.get(SwapchainKey(swapchain));
+        if (p == NULL)
+            continue;
+
+        p->presented(pPresentInfo->pImageIndices[i], now, last_submit);
+
+        // whatever the driver has by now, the rest is picked up after the next present
+        if (p->display_timing) {
+            VkPastPresentationTimingGOOGLE timings[8];
+            uint32_t count = 8;
+            VkResult res = dispatch->GetPastPresentationTimingGOOGLE(state->device,
+                                                                     swapchain,
+                                                                     &count,
+                                                                     timings);
+            if (res == VK_SUCCESS || res == VK_INCOMPLETE)
+                p->pastTimings(timings, count);
+        }
+
+        p->report((uint64_t) (uintptr_t) swapchain, now);
+    }
+
+    return ret;
+}
+#endif // VKDISPLAYHACKSTEAMVR_STATS
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Present control, swapchains on the overridden display
+
+// VK_DISPLAY_HACK_STEAMVR_PRESENT_MODE=<mode>[,<mode>...], the first one the display supports wins,
+// and VK_DISPLAY_HACK_STEAMVR_MIN_IMAGES=<count>, clamped to what it supports
+struct PresentOverride
+{
+    std::vector<VkPresentModeKHR> present_modes;
+    uint32_t min_images = 0; // 0 keeps the application's
+};
+
+static const struct
+{
+    const char *name;
+    VkPresentModeKHR mode;
+} present_mode_names[] = {
+    {"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+    {"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+    {"fifo", VK_PRESENT_MODE_FIFO_KHR},
+    {"fifo_relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR},
+};
+
+static PresentOverride present_override_parse()
+{
+    PresentOverride o;
+
+    if (const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_PRESENT_MODE")) {
+        std::string list(env);
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = std::min(list.find(',', start), list.size());
+            std::string name = list.substr(start, end - start);
+            auto it = std::find_if(std::begin(present_mode_names),
+                                   std::end(present_mode_names),
+                                   [&](const auto &m) { return name == m.name; });
+            if (it == std::end(present_mode_names)) {
+                printf("vkdisplayhacksteamvr: ignoring VK_DISPLAY_HACK_STEAMVR_PRESENT_MODE=%s, "
+                       "expected immediate, mailbox, fifo or fifo_relaxed\n",
+                       env);
+                o.present_modes.clear();
+                break;
+            }
+            o.present_modes.push_back(it->mode);
+            start = end + 1;
+        }
+    }
+
+    if (const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_MIN_IMAGES")) {
+        char *end;
+        unsigned long count = strtoul(env, &end, 10);
+        if (*end == '\0' && count > 0 && count <= 16)
+            o.min_images = (uint32_t) count;
+        else
+            printf("vkdisplayhacksteamvr: ignoring VK_DISPLAY_HACK_STEAMVR_MIN_IMAGES=%s\n", env);
+    }
+
+    return o;
+}
+
+static const PresentOverride &present_override()
+{
+    static const PresentOverride o = present_override_parse();
+    return o;
+}
+
+static bool present_override_active()
+{
+    const PresentOverride &o = present_override();
+    return !o.present_modes.empty() || o.min_images > 0;
+}
+
+// applies the overrides to a swapchain on the overridden display, whatever the surface doesn't
+// support stays as the application asked
+static void present_override_apply(DeviceState *state, VkSwapchainCreateInfoKHR *info)
+{
+    const PresentOverride &o = present_override();
+    VkLayerInstanceDispatchTable *instance = &state->instance->dispatch;
+
+    if (!o.present_modes.empty()) {
+        std::vector<VkPresentModeKHR> supported;
+        enumerate_all(&supported, [&](uint32_t *pCount, VkPresentModeKHR *pModes) {
+            return instance->GetPhysicalDeviceSurfacePresentModesKHR(state->physical_device,
+                                                                     info->surface,
+                                                                     pCount,
+                                                                     pModes);
+        });
+
+        auto it = std::find_first_of(o.present_modes.begin(),
+                                     o.present_modes.end(),
+                                     supported.begin(),
+                                     supported.end());
+        if (it != o.present_modes.end())
+            info->presentMode = *it;
+        else
+            printf("vkdisplayhacksteamvr: the overridden display supports none of "
+                   "VK_DISPLAY_HACK_STEAMVR_PRESENT_MODE\n");
+    }
+
+    VkSurfaceCapabilitiesKHR caps;
+    if (o.min_images > 0
+        && instance->GetPhysicalDeviceSurfaceCapabilitiesKHR(state->physical_device,
+                                                             info->surface,
+                                                             &caps)
+               == VK_SUCCESS) {
+        uint32_t count = std::max(o.min_images, caps.minImageCount);
+        if (caps.maxImageCount > 0)
+            count = std::min(count, caps.maxImageCount);
+        info->minImageCount = count;
+    }
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_CreateDisplayPlaneSurfaceKHR(VkInstance instance,
+                                                  const VkDisplaySurfaceCreateInfoKHR *pCreateInfo,
+                                                  const VkAllocationCallbacks *pAllocator,
+                                                  VkSurfaceKHR *pSurface)
+{
+    TraceScope trace(TRACE_CreateDisplayPlaneSurfaceKHR,
+                     trace_handle(instance),
+                     trace_handle(pCreateInfo->displayMode));
+    InstanceContext *ctx = instance_context(instance);
+    VkResult ret = ctx->dispatch.CreateDisplayPlaneSurfaceKHR(instance,
+                                                              pCreateInfo,
+                                                              pAllocator,
+                                                              pSurface);
+    if (ret != VK_SUCCESS)
+        return ret;
+    trace.args[1] = trace_handle(*pSurface);
+
+    scoped_lock l(ctx->display_lock);
+    DisplayCache *cache = &ctx->display;
+    auto it = cache->overridden_modes.find(pCreateInfo->displayMode);
+    if (it != cache->overridden_modes.end())
+        arena_grow([&] { cache->overridden_surfaces[*pSurface] = it->second; });
+    return ret;
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL vkdisplayhacksteamvr_DestroySurfaceKHR(
+    VkInstance instance, VkSurfaceKHR surface, const VkAllocationCallbacks *pAllocator)
+{
+    TraceScope trace(TRACE_DestroySurfaceKHR, trace_handle(instance), trace_handle(surface));
+    InstanceContext *ctx = instance_context(instance);
+    {
+        scoped_lock l(ctx->display_lock);
+        ctx->display.overridden_surfaces.erase(surface);
+    }
+
+    ctx->dispatch.DestroySurfaceKHR(instance, surface, pAllocator);
+}
+
+// logs the present configuration of every swapchain on the overridden display, overridden or not,
+// so runs with and without the override can be compared
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_CreateSwapchainKHR(VkDevice device,
+                                        const VkSwapchainCreateInfoKHR *pCreateInfo,
+                                        const VkAllocationCallbacks *pAllocator,
+                                        VkSwapchainKHR *pSwapchain)
+{
+    TraceScope trace(TRACE_CreateSwapchainKHR,
+                     trace_handle(device),
+                     trace_handle(pCreateInfo->surface),
+                     pCreateInfo->presentMode);
+    VkLayerDispatchTable *dispatch = device_dispatch.get(GetKey(device));
+    DeviceState *state = device_states.get(GetKey(device));
+    bool overridden = false;
+    uint32_t refresh_mhz = 0;
+    if (InstanceContext *ctx = state->instance) {
+        scoped_lock l(ctx->display_lock);
+        auto it = ctx->display.overridden_surfaces.find(pCreateInfo->surface);
+        if (it != ctx->display.overridden_surfaces.end()) {
+            overridden = true;
+            refresh_mhz = it->second;
+        }
+    }
+    if (!overridden)
+        return dispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+
+    VkSwapchainCreateInfoKHR info = *pCreateInfo;
+    present_override_apply(state, &info);
+    VkResult ret = dispatch->CreateSwapchainKHR(device, &info, pAllocator, pSwapchain);
+    if (ret != VK_SUCCESS)
+        return ret;
+
+    log_push(LogRecordType::SwapchainPresent,
+             (uint64_t) (uintptr_t) *pSwapchain,
+             info.presentMode,
+             pCreateInfo->presentMode,
+             info.minImageCount,
+             pCreateInfo->minImageCount);
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+    if (state->intercept & InterceptFrames)
+        frame_pacing_start(state, dispatch, *pSwapchain, refresh_mhz);
+#else
+    (void) refresh_mhz;
+#endif
+    return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -281,12 +2201,11 @@ vkdisplayhacksteamvr_EnumerateDeviceExtensionProperties(VkPhysicalDevice physica
         if (physicalDevice == VK_NULL_HANDLE)
             return VK_SUCCESS;
 
-        scoped_lock l(global_lock);
-        return instance_dispatch[GetKey(physicalDevice)]
-            .EnumerateDeviceExtensionProperties(physicalDevice,
-                                                pLayerName,
-                                                pPropertyCount,
-                                                pProperties);
+        return instance_context(physicalDevice)
+            ->dispatch.EnumerateDeviceExtensionProperties(physicalDevice,
+                                                          pLayerName,
+                                                          pPropertyCount,
+                                                          pProperties);
     }
 
     // don't expose any extensions
@@ -298,93 +2217,521 @@ vkdisplayhacksteamvr_EnumerateDeviceExtensionProperties(VkPhysicalDevice physica
 ///////////////////////////////////////////////////////////////////////////////////////////
 // GetProcAddr functions, entry points of the layer
 
+// The intercepted functions are listed once here and turned into a switch on the name hash. Two
+// names hashing to the same value would be a duplicate case label, so the compiler proves the
+// hash is perfect for this set and a lookup costs one hash and one strcmp.
 #define GETPROCADDR(func) \
-    if (!strcmp(pName, "vk" #func)) \
-        return (PFN_vkVoidFunction) &vkdisplayhacksteamvr_##func;
+    case HashName("vk" #func): \
+        if (!strcmp(pName, "vk" #func)) \
+            return (PFN_vkVoidFunction) &vkdisplayhacksteamvr_##func; \
+        break;
+
+// A function of an intercept group the device doesn't intercept leaves the switch, the lookup
+// below then hands out the next layer's function.
+#define GETPROCADDR_IF_INTERCEPTED(group, func) \
+    case HashName("vk" #func): \
+        if (!strcmp(pName, "vk" #func) && (intercept & (group))) \
+            return (PFN_vkVoidFunction) &vkdisplayhacksteamvr_##func; \
+        break;
+
+#define GETPROCADDR_IF_SUPPORTED(group, func) \
+    case HashName("vk" #func): \
+        if (!strcmp(pName, "vk" #func) && (intercept & (group))) \
+            return dispatch != NULL && dispatch->func != NULL \
+                       ? (PFN_vkVoidFunction) &vkdisplayhacksteamvr_##func \
+                       : NULL; \
+        break;
+
+// device chain functions we always intercept
+#define DEVICE_FUNCTIONS(X) \
+    X(GetDeviceProcAddr) \
+    X(EnumerateDeviceLayerProperties) \
+    X(EnumerateDeviceExtensionProperties) \
+    X(CreateDevice) \
+    X(DestroyDevice)
+
+// device chain functions we intercept for one of the groups
+#define DEVICE_GROUP_FUNCTIONS(X) \
+    X(InterceptFrames | InterceptPresent, CreateSwapchainKHR) \
+    DEVICE_STATS_FUNCTIONS(X)
+
+#if VKDISPLAYHACKSTEAMVR_STATS
+#define DEVICE_STATS_FUNCTIONS(X) \
+    X(InterceptCommands, CreateCommandPool) \
+    X(InterceptCommands, AllocateCommandBuffers) \
+    X(InterceptCommands, FreeCommandBuffers) \
+    X(InterceptCommands, ResetCommandPool) \
+    X(InterceptCommands, DestroyCommandPool) \
+    X(InterceptCommands, BeginCommandBuffer) \
+    X(InterceptCommands, CmdDraw) \
+    X(InterceptCommands, CmdDrawIndexed) \
+    X(InterceptCommands, CmdDrawIndirect) \
+    X(InterceptCommands, CmdDrawIndexedIndirect) \
+    X(InterceptCommands, CmdDispatch) \
+    X(InterceptCommands, CmdDispatchIndirect) \
+    X(InterceptCommands, CmdBindPipeline) \
+    X(InterceptCommands, CmdBindDescriptorSets) \
+    X(InterceptCommands, CmdBeginRenderPass) \
+    X(InterceptCommands, CmdExecuteCommands) \
+    X(InterceptCommands, EndCommandBuffer) \
+    X(InterceptFrames, DestroySwapchainKHR) \
+    X(InterceptFrames, AcquireNextImageKHR) \
+    X(InterceptFrames, QueueSubmit) \
+    X(InterceptFrames, QueuePresentKHR)
+
+// device functions from later core versions and extensions, only handed out when the next layer
+// has them, so applications probing for them still get NULL where they aren't supported
+#define DEVICE_OPTIONAL_FUNCTIONS(X) \
+    X(InterceptCommands, CmdDrawIndirectCount) \
+    X(InterceptCommands, CmdDrawIndirectCountKHR) \
+    X(InterceptCommands, CmdDrawIndexedIndirectCount) \
+    X(InterceptCommands, CmdDrawIndexedIndirectCountKHR) \
+    X(InterceptCommands, CmdBeginRenderPass2) \
+    X(InterceptCommands, CmdBeginRenderPass2KHR) \
+    X(InterceptCommands, CmdBeginRendering) \
+    X(InterceptCommands, CmdBeginRenderingKHR) \
+    X(InterceptFrames, QueueSubmit2) \
+    X(InterceptFrames, QueueSubmit2KHR)
+#else
+#define DEVICE_STATS_FUNCTIONS(X)
+#define DEVICE_OPTIONAL_FUNCTIONS(X)
+#endif
+
+// instance chain functions we intercept. The loader creates devices through the instance chain,
+// so vkCreateDevice and the functions it looks up for the device chain are here too.
+#define INSTANCE_FUNCTIONS(X) \
+    X(GetRandROutputDisplayEXT) \
+    X(CreateInstance) \
+    X(DestroyInstance) \
+    X(CreateDevice) \
+    X(GetDeviceProcAddr) \
+    X(EnumerateDeviceExtensionProperties) \
+    X(GetPhysicalDeviceDisplayPropertiesKHR) \
+    X(GetPhysicalDeviceDisplayProperties2KHR) \
+    X(GetDisplayModePropertiesKHR) \
+    X(GetDisplayModeProperties2KHR) \
+    X(CreateDisplayModeKHR) \
+    X(CreateDisplayPlaneSurfaceKHR) \
+    X(DestroySurfaceKHR)
 
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
 vkdisplayhacksteamvr_GetDeviceProcAddr(VkDevice device, const char *pName)
 {
-    // device chain functions we intercept
-    GETPROCADDR(GetDeviceProcAddr);
-    GETPROCADDR(EnumerateDeviceLayerProperties);
-    GETPROCADDR(EnumerateDeviceExtensionProperties);
-    GETPROCADDR(CreateDevice);
-    GETPROCADDR(DestroyDevice);
-    GETPROCADDR(BeginCommandBuffer);
-    GETPROCADDR(CmdDraw);
-    GETPROCADDR(CmdDrawIndexed);
-    GETPROCADDR(EndCommandBuffer);
+    TraceScope trace(TRACE_GetDeviceProcAddr, trace_handle(device));
+    // the loader resolves the device's functions after vkCreateDevice has set up its state
+    DeviceState *state = device_states.get(GetKey(device));
+    [[maybe_unused]] uint32_t intercept = state != NULL ? state->intercept : INTERCEPT_BUILT;
+    VkLayerDispatchTable *dispatch = device_dispatch.get(GetKey(device));
+
+    uint32_t hash = HashName(pName);
+    switch (hash) {
+        DEVICE_FUNCTIONS(GETPROCADDR)
+        DEVICE_GROUP_FUNCTIONS(GETPROCADDR_IF_INTERCEPTED)
+        DEVICE_OPTIONAL_FUNCTIONS(GETPROCADDR_IF_SUPPORTED)
+    default:
+        break;
+    }
 
-    {
-        scoped_lock l(global_lock);
-        return device_dispatch[GetKey(device)].GetDeviceProcAddr(device, pName);
+    // not a device the layer created, there is no chain to forward to
+    if (dispatch == NULL)
+        return NULL;
+
+    // without a cache the lookup goes down the chain every time
+    ProcAddrCache *procs = device_procs.get(GetKey(device));
+    if (procs == NULL)
+        return dispatch->GetDeviceProcAddr(device, pName);
+    return procs->get(pName, hash, [&] { return dispatch->GetDeviceProcAddr(device, pName); });
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Display override
+
+static bool display_cache_connect(DisplayCache *cache)
+{
+    cache->dpy = XOpenDisplay(NULL);
+    if (cache->dpy == NULL)
+        return false;
+
+    // the connection is private to the layer, read its events through xcb
+    XSetEventQueueOwner(cache->dpy, XCBOwnsEventQueue);
+    xcb_connection_t *connection = XGetXCBConnection(cache->dpy);
+
+    const xcb_query_extension_reply_t *randr = xcb_get_extension_data(connection, &xcb_randr_id);
+    if (randr == NULL || !randr->present) {
+        printf("vkdisplayhacksteamvr: RandR missing, display cache won't be invalidated\n");
+        return true;
     }
+    cache->randr_event_base = randr->first_event;
+
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(connection));
+    for (; iter.rem > 0; xcb_screen_next(&iter))
+        xcb_randr_select_input(connection,
+                               iter.data->root,
+                               XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE
+                                   | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+    xcb_flush(connection);
+
+    return true;
 }
 
-#include <stdlib.h>
+// drains pending RandR notifications, drops the cached resolutions if any output changed
+static void display_cache_poll(DisplayCache *cache)
+{
+    if (cache->randr_event_base == 0)
+        return;
+
+    xcb_connection_t *connection = XGetXCBConnection(cache->dpy);
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(connection)) != NULL) {
+        uint8_t type = (event->response_type & 0x7f) - cache->randr_event_base;
+        if (type == XCB_RANDR_SCREEN_CHANGE_NOTIFY
+            || (type == XCB_RANDR_NOTIFY
+                && ((xcb_randr_notify_event_t *) event)->subCode
+                       == XCB_RANDR_NOTIFY_OUTPUT_CHANGE)) {
+            cache->invalidate();
+        }
+        free(event);
+    }
+}
 
-#include <X11/Xlib-xcb.h>
-#include <X11/extensions/Xrandr.h>
-#include <vulkan/vulkan_xlib_xrandr.h>
-extern "C" {
-VkDisplayKHR get_display(VkInstance instance,
-                         PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
-                         char *override);
+static randr_display_inventory *display_cache_get(DisplayCache *cache,
+                                                  VkPhysicalDevice physicalDevice)
+{
+    display_prewarm_settle(cache);
+    if (cache->dpy == NULL && !display_cache_connect(cache)) {
+        printf("vkdisplayhacksteamvr: Could not open X display.\n");
+        return NULL;
+    }
+
+    display_cache_poll(cache);
+    auto it = cache->inventories.find(physicalDevice);
+    if (it != cache->inventories.end())
+        return &it->second;
+
+    // only the RandR walk, outputs are resolved on the driver when a call asks for them
+    randr_display_inventory inventory = {};
+    if (randr_inventory_walk(&inventory, cache->dpy) != 0) {
+        randr_inventory_destroy(&inventory);
+        return NULL;
+    }
+
+    randr_display_inventory *cached = NULL;
+    if (!arena_grow([&] { cached = &(cache->inventories[physicalDevice] = inventory); }))
+        randr_inventory_destroy(&inventory);
+    return cached;
 }
 
-VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_GetRandROutputDisplayEXT(
-    VkPhysicalDevice physicalDevice, Display *dpy, RROutput rrOutput, VkDisplayKHR *pDisplay)
+// The VK_DISPLAY_HACK_STEAMVR output on physicalDevice. Matched on the RandR data, so the
+// driver's vkGetRandROutputDisplayEXT only runs for that output, once. NULL if it has no
+// VkDisplayKHR.
+static comp_window_direct_randr_display *display_cache_resolve(DisplayCache *cache,
+                                                               VkPhysicalDevice physicalDevice,
+                                                               const char *env_p)
 {
-    scoped_lock l(global_lock);
+    randr_display_inventory *inventory = display_cache_get(cache, physicalDevice);
+    if (inventory == NULL)
+        return NULL;
+
+    comp_window_direct_randr_display *d = randr_inventory_select(inventory, env_p);
+    if (d == NULL
+        || randr_inventory_resolve(d,
+                                   physicalDevice,
+                                   cache->next_GetRandROutputDisplayEXT,
+                                   cache->dpy)
+               == VK_NULL_HANDLE)
+        return NULL;
+    return d;
+}
 
-    //    PFN_vkGetInstanceProcAddr gipa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
-    //    PFN_vkGetDeviceProcAddr gdpa = layerCreateInfo->u.pLayerInfo->pfnNextGetDeviceProcAddr;
-    //    // move chain on for next layer
-    //    layerCreateInfo->u.pLayerInfo = layerCreateInfo->u.pLayerInfo->pNext;
+// Runs on the pre-warm worker: opens the X connection and resolves the outputs of every physical
+// device on a private cache, so the application's first display call finds them ready. Never
+// takes the context's display_lock, the instance's cache may be waiting for it with the lock held.
+static DisplayPrewarm display_prewarm_run(VkInstance instance,
+                                          PFN_vkEnumeratePhysicalDevices enumerate,
+                                          PFN_vkGetRandROutputDisplayEXT next_GetRandROutput,
+                                          const std::atomic<bool> *cancel)
+{
+    // the application's allocation callbacks are only called from its own calls
+    Arena arena(LayerAllocator(NULL, VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE));
+    DisplayCache warm(&arena);
+    warm.next_GetRandROutputDisplayEXT = next_GetRandROutput;
+
+    DisplayPrewarm result;
+    result.instance = instance;
+    std::vector<VkPhysicalDevice> physicalDevices;
+    if (enumerate_all(&physicalDevices,
+                      [&](uint32_t *pCount, VkPhysicalDevice *pPhysicalDevices) {
+                          return enumerate(instance, pCount, pPhysicalDevices);
+                      })
+        == VK_SUCCESS) {
+        const char *env_p = getenv("VK_DISPLAY_HACK_STEAMVR");
+
+        // DestroyInstance waits for at most one physical device's enumeration
+        for (VkPhysicalDevice physicalDevice : physicalDevices) {
+            if (cancel->load())
+                break;
+
+            bool found = display_cache_resolve(&warm, physicalDevice, env_p) != NULL;
+            if (warm.dpy == NULL)
+                break;
+            result.found = result.found || found;
+            result.physical_devices++;
+        }
+    }
 
-    //    PFN_vkCreateDevice createFunc = (PFN_vkCreateDevice) gipa(VK_NULL_HANDLE, "vkCreateDevice");
+    // handed over, warm's destructor must not close or free them
+    result.dpy = warm.dpy;
+    result.randr_event_base = warm.randr_event_base;
+    result.inventories.insert(warm.inventories.begin(), warm.inventories.end());
+    warm.inventories.clear();
+    warm.dpy = NULL;
 
-    //    VkResult ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
+    result.ready_ns = log_now_ns();
+    return result;
+}
 
-    char *env_p = getenv("VK_DISPLAY_HACK_STEAMVR");
+// Only with an override to resolve, VK_DISPLAY_HACK_STEAMVR_PREWARM=0 keeps it on the
+// application's first display call.
+static void display_prewarm_start(InstanceContext *ctx)
+{
+    const char *env_p = getenv("VK_DISPLAY_HACK_STEAMVR");
+    const char *prewarm = getenv("VK_DISPLAY_HACK_STEAMVR_PREWARM");
+    if (env_p == NULL || (prewarm != NULL && strcmp(prewarm, "0") == 0))
+        return;
+
+    DisplayCache *cache = &ctx->display;
+    PFN_vkEnumeratePhysicalDevices enumerate = (PFN_vkEnumeratePhysicalDevices)
+        ctx->next_GetInstanceProcAddr(ctx->instance, "vkEnumeratePhysicalDevices");
+    if (enumerate == NULL || cache->next_GetRandROutputDisplayEXT == NULL)
+        return;
+
+    cache->created_ns = log_now_ns();
+    cache->prewarm = std::async(std::launch::async,
+                                display_prewarm_run,
+                                ctx->instance,
+                                enumerate,
+                                cache->next_GetRandROutputDisplayEXT,
+                                &cache->prewarm_cancel);
+}
+
+// Takes over what the worker prepared, first waiting for it if it isn't done yet, and logs how
+// long after vkCreateInstance it was ready. Called with the context's display_lock held.
+static void display_prewarm_settle(DisplayCache *cache)
+{
+    if (!cache->prewarm.valid())
+        return;
+
+    // out of memory on the worker, the first call that needs the cache starts over
+    uint64_t wait_start = log_now_ns();
+    DisplayPrewarm warm;
+    if (!arena_grow([&] { warm = cache->prewarm.get(); }))
+        return;
+    uint64_t waited = log_now_ns() - wait_start;
+
+    // nothing touched the X connection or the inventories before the first settle
+    cache->dpy = warm.dpy;
+    cache->randr_event_base = warm.randr_event_base;
+    for (auto &it : warm.inventories)
+        if (!arena_grow([&] { cache->inventories.insert(it); }))
+            randr_inventory_destroy(&it.second);
+
+    log_push(LogRecordType::DisplayReady,
+             (uint64_t) (uintptr_t) warm.instance,
+             warm.ready_ns - cache->created_ns,
+             waited,
+             warm.physical_devices,
+             warm.found);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL vkdisplayhacksteamvr_GetRandROutputDisplayEXT(
+    VkPhysicalDevice physicalDevice, Display *dpy, RROutput rrOutput, VkDisplayKHR *pDisplay)
+{
+    TraceScope trace(TRACE_GetRandROutputDisplayEXT, trace_handle(physicalDevice), rrOutput);
+    // the instance the physical device was enumerated from, not the one created last
+    InstanceContext *ctx = instance_context(physicalDevice);
+    DisplayCache *cache = &ctx->display;
+
+    // without an override the caller's output on the caller's X connection, untouched
+    const char *env_p = getenv("VK_DISPLAY_HACK_STEAMVR");
+    if (env_p == NULL) {
+        VkResult ret = cache->next_GetRandROutputDisplayEXT(physicalDevice,
+                                                            dpy,
+                                                            rrOutput,
+                                                            pDisplay);
+        if (ret == VK_SUCCESS)
+            trace.args[1] = trace_handle(*pDisplay);
+        return ret;
+    }
 
     printf("vkdisplayhacksteamvr_GetRandROutputDisplayEXT: Override with %s\n", env_p);
-    // probably the right instance
-    PFN_vkGetRandROutputDisplayEXT f = (PFN_vkGetRandROutputDisplayEXT)
-        g_pfnNextGetInstanceProcAddr(g_lastCreatedInstance, "vkGetRandROutputDisplayEXT");
-    VkDisplayKHR d = get_display(g_lastCreatedInstance, f, env_p);
-    *pDisplay = d;
+    scoped_lock l(ctx->display_lock);
+
+    // resolved on the caller's GPU
+    if (comp_window_direct_randr_display *d
+        = display_cache_resolve(cache, physicalDevice, env_p)) {
+        printf("override found: returning VkDisplayKHR for %s\n", d->name);
+        // out of memory its modes and swapchains just aren't overridden
+        arena_grow([&] { cache->overridden_displays.insert(d->display); });
+        *pDisplay = d->display;
+        trace.args[1] = trace_handle(d->display);
+        return VK_SUCCESS;
+    }
+
+    *pDisplay = VK_NULL_HANDLE;
     return VK_SUCCESS;
 }
 
+// RandR notifications are read at most this often while serving display properties, which
+// compositors query over and over
+constexpr uint64_t DISPLAY_SNAPSHOT_POLL_NS = 100 * 1000 * 1000;
+
+// rebuilds the snapshot for display_snapshot_get, throws std::bad_alloc when the arena is out of
+// memory and leaves it stale to be rebuilt by the next call
+static const ArenaVector<VkDisplayPropertiesKHR> *
+display_snapshot_build(InstanceContext *ctx,
+                       VkPhysicalDevice physicalDevice,
+                       VkDisplayKHR overridden)
+{
+    DisplayCache *cache = &ctx->display;
+    auto it = cache->display_snapshots.find(physicalDevice);
+    if (it == cache->display_snapshots.end())
+        it = cache->display_snapshots
+                 .emplace(physicalDevice, DisplayCache::DisplaySnapshot(cache->arena))
+                 .first;
+    DisplayCache::DisplaySnapshot &snapshot = it->second;
+
+    VkLayerInstanceDispatchTable *dispatch = &ctx->dispatch;
+    if (enumerate_all(&snapshot.displays,
+                      [&](uint32_t *pCount, VkDisplayPropertiesKHR *pDisplays) {
+                          return dispatch->GetPhysicalDeviceDisplayPropertiesKHR(physicalDevice,
+                                                                                 pCount,
+                                                                                 pDisplays);
+                      })
+        != VK_SUCCESS) {
+        cache->display_snapshots.erase(it);
+        return NULL;
+    }
+
+    if (overridden != VK_NULL_HANDLE) {
+        ArenaVector<VkDisplayPropertiesKHR> &displays = snapshot.displays;
+        auto rest = std::stable_partition(displays.begin(),
+                                          displays.end(),
+                                          [&](const VkDisplayPropertiesKHR &p) {
+                                              return p.display == overridden;
+                                          });
+        if (rest != displays.begin()) {
+            const char *filter = getenv("VK_DISPLAY_HACK_STEAMVR_DISPLAYS");
+            if (filter != NULL && strcmp(filter, "only") == 0)
+                displays.erase(rest, displays.end());
+            cache->overridden_displays.insert(overridden);
+        }
+    }
+
+    snapshot.generation = cache->generation;
+    return &snapshot.displays;
+}
+
+// The driver's displays of a physical device, the VK_DISPLAY_HACK_STEAMVR output first, or alone
+// with VK_DISPLAY_HACK_STEAMVR_DISPLAYS=only. Rebuilt when RandR bumped the cache's generation.
+// NULL if the driver fails, out of memory, or without RandR notifications to invalidate it, the
+// caller then asks the driver. Called with the context's display_lock held.
+static const ArenaVector<VkDisplayPropertiesKHR> *
+display_snapshot_get(InstanceContext *ctx, VkPhysicalDevice physicalDevice)
+{
+    DisplayCache *cache = &ctx->display;
+    display_prewarm_settle(cache);
+    uint64_t now = log_now_ns();
+    if (cache->dpy != NULL && now - cache->last_poll_ns >= DISPLAY_SNAPSHOT_POLL_NS) {
+        cache->last_poll_ns = now;
+        display_cache_poll(cache);
+    }
+
+    auto it = cache->display_snapshots.find(physicalDevice);
+    if (it != cache->display_snapshots.end() && it->second.generation == cache->generation)
+        return &it->second.displays;
+
+    // resolve the override first, connecting may itself report a change and bump the generation
+    const char *env_p = getenv("VK_DISPLAY_HACK_STEAMVR");
+    VkDisplayKHR overridden = VK_NULL_HANDLE;
+    if (env_p != NULL) {
+        if (comp_window_direct_randr_display *d
+            = display_cache_resolve(cache, physicalDevice, env_p))
+            overridden = d->display;
+    } else if (cache->dpy == NULL && !cache->connect_failed) {
+        // only to hear about changes
+        cache->connect_failed = !display_cache_connect(cache);
+    }
+    cache->last_poll_ns = now;
+
+    // nothing would ever tell the snapshot that the displays changed
+    if (cache->dpy == NULL || cache->randr_event_base == 0)
+        return NULL;
+
+    const ArenaVector<VkDisplayPropertiesKHR> *displays = NULL;
+    arena_grow([&] { displays = display_snapshot_build(ctx, physicalDevice, overridden); });
+    return displays;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_GetPhysicalDeviceDisplayPropertiesKHR(VkPhysicalDevice physicalDevice,
+                                                           uint32_t *pPropertyCount,
+                                                           VkDisplayPropertiesKHR *pProperties)
+{
+    TraceScope trace(TRACE_GetPhysicalDeviceDisplayPropertiesKHR,
+                     trace_handle(physicalDevice),
+                     *pPropertyCount);
+    InstanceContext *ctx = instance_context(physicalDevice);
+    {
+        scoped_lock l(ctx->display_lock);
+        if (auto *displays = display_snapshot_get(ctx, physicalDevice))
+            return properties_copy(*displays, pPropertyCount, pProperties);
+    }
+
+    return ctx->dispatch.GetPhysicalDeviceDisplayPropertiesKHR(physicalDevice,
+                                                               pPropertyCount,
+                                                               pProperties);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL
+vkdisplayhacksteamvr_GetPhysicalDeviceDisplayProperties2KHR(VkPhysicalDevice physicalDevice,
+                                                            uint32_t *pPropertyCount,
+                                                            VkDisplayProperties2KHR *pProperties)
+{
+    TraceScope trace(TRACE_GetPhysicalDeviceDisplayProperties2KHR,
+                     trace_handle(physicalDevice),
+                     *pPropertyCount);
+    InstanceContext *ctx = instance_context(physicalDevice);
+    {
+        scoped_lock l(ctx->display_lock);
+        auto *displays = display_snapshot_get(ctx, physicalDevice);
+        if (displays != NULL && !properties_chained(pPropertyCount, pProperties))
+            return properties_copy(*displays, pPropertyCount, pProperties);
+    }
+
+    return ctx->dispatch.GetPhysicalDeviceDisplayProperties2KHR(physicalDevice,
+                                                                pPropertyCount,
+                                                                pProperties);
+}
+
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
 vkdisplayhacksteamvr_GetInstanceProcAddr(VkInstance instance, const char *pName)
 {
+    TraceScope trace(TRACE_GetInstanceProcAddr, trace_handle(instance));
     // printf("vkdisplayhacksteamvr_GetInstanceProcAddr %s\n", pName);
 
-    GETPROCADDR(GetRandROutputDisplayEXT);
-
-    // instance chain functions we intercept
-    //    GETPROCADDR(GetInstanceProcAddr);
-    //    GETPROCADDR(EnumerateInstanceLayerProperties);
-    //    GETPROCADDR(EnumerateInstanceExtensionProperties);
-    GETPROCADDR(CreateInstance);
-    GETPROCADDR(DestroyInstance);
-
-    // device chain functions we intercept
-    //    GETPROCADDR(GetDeviceProcAddr);
-    //    GETPROCADDR(EnumerateDeviceLayerProperties);
-    //    GETPROCADDR(EnumerateDeviceExtensionProperties);
-    //    GETPROCADDR(CreateDevice);
-    //    GETPROCADDR(DestroyDevice);
-    //    GETPROCADDR(BeginCommandBuffer);
-    //    GETPROCADDR(CmdDraw);
-    //    GETPROCADDR(CmdDrawIndexed);
-    //    GETPROCADDR(EndCommandBuffer);
-
-    {
-        scoped_lock l(global_lock);
-        return instance_dispatch[GetKey(instance)].GetInstanceProcAddr(instance, pName);
+    uint32_t hash = HashName(pName);
+    switch (hash) {
+        INSTANCE_FUNCTIONS(GETPROCADDR)
+    default:
+        break;
     }
+
+    // global functions we don't intercept, there is no chain to forward to yet
+    if (instance == VK_NULL_HANDLE)
+        return NULL;
+
+    InstanceContext *ctx = instance_context(instance);
+    return ctx->procs.get(pName, hash, [&] {
+        return ctx->next_GetInstanceProcAddr(instance, pName);
+    });
 }
@@ -0,0 +1,191 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Opt-in GPU time per command buffer from injected timestamps
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#include "vkdisplayhacksteamvr_gputime.hpp"
+#include "vkdisplayhacksteamvr_log.hpp"
+
+#include <stdio.h>
+
+#include <chrono>
+
+namespace {
+
+constexpr auto POLL_INTERVAL = std::chrono::milliseconds(5);
+
+} // namespace
+
+GpuTimestamps::GpuTimestamps(Arena *arena,
+                             VkDevice device,
+                             const VkLayerDispatchTable *dispatch,
+                             float timestamp_period,
+                             uint32_t timestamp_valid_bits)
+    : arena(arena), device(device), dispatch(dispatch), period_ns(timestamp_period),
+      valid_mask(timestamp_valid_bits >= 64 ? UINT64_MAX : (1ull << timestamp_valid_bits) - 1),
+      free_slots(ArenaAllocator<uint32_t>(arena))
+{
+    reader = std::thread(&GpuTimestamps::run, this);
+}
+
+GpuTimestamps::~GpuTimestamps()
+{
+    stop.store(true);
+    reader.join();
+
+    for (uint32_t i = 0; i < num_pools.load(); i++) {
+        dispatch->DestroyQueryPool(device, pools[i]->pool, arena->allocator().callbacks());
+        pools[i]->~Pool();
+        arena->free(pools[i], sizeof(Pool), alignof(Pool));
+    }
+}
+
+// called with free_lock held
+bool GpuTimestamps::addPool()
+{
+    uint32_t index = num_pools.load(std::memory_order_relaxed);
+    if (index == MAX_POOLS)
+        return false;
+
+    VkQueryPoolCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    info.queryCount = SLOTS_PER_POOL * 2;
+
+    // out of memory the command buffers recorded from now on go without GPU time
+    void *p = arena->allocate(sizeof(Pool), alignof(Pool));
+    if (p == nullptr)
+        return false;
+    Pool *pool = new (p) Pool;
+    bool reserved = false;
+    try {
+        free_slots.reserve((index + 1) * SLOTS_PER_POOL);
+        reserved = true;
+    } catch (const std::bad_alloc &) {
+    }
+    if (!reserved
+        || dispatch->CreateQueryPool(device, &info, arena->allocator().callbacks(), &pool->pool)
+               != VK_SUCCESS) {
+        printf("vkdisplayhacksteamvr: could not create a timestamp query pool\n");
+        pool->~Pool();
+        arena->free(pool, sizeof(Pool), alignof(Pool));
+        return false;
+    }
+
+    pools[index] = pool;
+    for (uint32_t i = SLOTS_PER_POOL; i > 0; i--)
+        free_slots.push_back(index * SLOTS_PER_POOL + i - 1);
+    num_pools.store(index + 1, std::memory_order_release);
+    return true;
+}
+
+uint32_t GpuTimestamps::acquire()
+{
+    std::lock_guard<std::mutex> l(free_lock);
+    if (free_slots.empty() && !addPool())
+        return NO_SLOT;
+
+    uint32_t index = free_slots.back();
+    free_slots.pop_back();
+    return index;
+}
+
+void GpuTimestamps::release(uint32_t index)
+{
+    Slot &s = slot(index);
+    s.state.store(nextState(s.state.load(std::memory_order_relaxed), Free), std::memory_order_release);
+
+    std::lock_guard<std::mutex> l(free_lock);
+    free_slots.push_back(index);
+}
+
+void GpuTimestamps::begin(VkCommandBuffer commandBuffer, uint32_t index)
+{
+    // the new generation makes the reader drop whatever it is doing with the previous recording
+    Slot &s = slot(index);
+    s.state.store(nextState(s.state.load(std::memory_order_relaxed), Recording),
+                  std::memory_order_release);
+
+    VkQueryPool pool = queryPool(index);
+    uint32_t query = (index % SLOTS_PER_POOL) * 2;
+    dispatch->CmdResetQueryPool(commandBuffer, pool, query, 2);
+    dispatch->CmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, query);
+}
+
+void GpuTimestamps::end(VkCommandBuffer commandBuffer,
+                        uint32_t index,
+                        uint32_t draws,
+                        uint32_t vertices)
+{
+    VkQueryPool pool = queryPool(index);
+    uint32_t query = (index % SLOTS_PER_POOL) * 2;
+    dispatch->CmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, query + 1);
+
+    Slot &s = slot(index);
+    s.commandBuffer.store((uint64_t) (uintptr_t) commandBuffer, std::memory_order_relaxed);
+    s.draws.store(draws, std::memory_order_relaxed);
+    s.vertices.store(vertices, std::memory_order_relaxed);
+    uint64_t state = s.state.load(std::memory_order_relaxed);
+    s.state.store((state & ~KIND_MASK) | Ended, std::memory_order_release);
+}
+
+void GpuTimestamps::submitted(uint32_t index)
+{
+    // submitting a reported recording again gets it read and reported again
+    Slot &s = slot(index);
+    uint64_t state = s.state.load(std::memory_order_acquire);
+    if ((state & KIND_MASK) == Ended || (state & KIND_MASK) == Reported)
+        s.state.compare_exchange_strong(state, (state & ~KIND_MASK) | Submitted);
+}
+
+void GpuTimestamps::poll()
+{
+    uint32_t count = num_pools.load(std::memory_order_acquire);
+    for (uint32_t index = 0; index < count * SLOTS_PER_POOL; index++) {
+        Slot &s = slot(index);
+        uint64_t state = s.state.load(std::memory_order_acquire);
+        if ((state & KIND_MASK) != Submitted)
+            continue;
+
+        uint64_t commandBuffer = s.commandBuffer.load(std::memory_order_relaxed);
+        uint32_t draws = s.draws.load(std::memory_order_relaxed);
+        uint32_t vertices = s.vertices.load(std::memory_order_relaxed);
+
+        // top value, top availability, bottom value, bottom availability
+        uint64_t results[4] = {};
+        VkResult res = dispatch->GetQueryPoolResults(device,
+                                                     queryPool(index),
+                                                     (index % SLOTS_PER_POOL) * 2,
+                                                     2,
+                                                     sizeof(results),
+                                                     results,
+                                                     2 * sizeof(uint64_t),
+                                                     VK_QUERY_RESULT_64_BIT
+                                                         | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if ((res != VK_SUCCESS && res != VK_NOT_READY) || results[1] == 0 || results[3] == 0)
+            continue;
+
+        uint64_t top = results[0] & valid_mask;
+        uint64_t bottom = results[2] & valid_mask;
+        if (top == s.last_top)
+            continue; // the previous use, the reset hasn't executed yet
+
+        // a recording that started meanwhile owns the slot now, its results are for the next poll
+        if (!s.state.compare_exchange_strong(state, (state & ~KIND_MASK) | Reported))
+            continue;
+        s.last_top = top;
+
+        uint64_t gpu_ns = (uint64_t) ((double) ((bottom - top) & valid_mask) * period_ns);
+        log_push(LogRecordType::GpuCommandBuffer, commandBuffer, gpu_ns, draws, vertices);
+    }
+}
+
+void GpuTimestamps::run()
+{
+    while (!stop.load()) {
+        std::this_thread::sleep_for(POLL_INTERVAL);
+        poll();
+    }
+}
@@ -0,0 +1,129 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Opt-in GPU time per command buffer from injected timestamps
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Every primary command buffer gets a pair of timestamp queries from a per-device ring of query
+ * pools, written at the top of the recording and at its end. A command buffer keeps its pair
+ * while it is re-recorded, the pair only goes back to the ring when the command buffer is freed.
+ *
+ * Results are polled from a background thread without VK_QUERY_RESULT_WAIT_BIT, so neither the
+ * recording nor the submitting threads ever wait on the GPU. Only pairs whose command buffer was
+ * submitted are polled, a new pool's queries are uninitialized until the reset recorded in front of
+ * them is submitted and must not be read before. Until the GPU executes the reset
+ * recorded in front of a reused pair, its queries still show the results of the previous use,
+ * those are told apart by their top timestamp, which only ever grows.
+ *
+ * Enabled with VK_DISPLAY_HACK_STEAMVR_GPU_TIMESTAMPS=1, results go to the stats log.
+ */
+#pragma once
+
+#include <vulkan/vk_layer.h>
+
+#include <vulkan/generated/vk_layer_dispatch_table.h>
+
+#include "vkdisplayhacksteamvr_alloc.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+class GpuTimestamps
+{
+public:
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    // pools and bookkeeping come from the device's arena
+    GpuTimestamps(Arena *arena,
+                  VkDevice device,
+                  const VkLayerDispatchTable *dispatch,
+                  float timestamp_period,
+                  uint32_t timestamp_valid_bits);
+
+    // stops the reader thread and destroys the query pools, before the device goes away
+    ~GpuTimestamps();
+
+    GpuTimestamps(const GpuTimestamps &) = delete;
+    GpuTimestamps &operator=(const GpuTimestamps &) = delete;
+
+    // a free query pair, NO_SLOT if the ring is exhausted
+    uint32_t acquire();
+    void release(uint32_t slot);
+
+    // right after vkBeginCommandBuffer and right before vkEndCommandBuffer
+    void begin(VkCommandBuffer commandBuffer, uint32_t slot);
+    void end(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t draws, uint32_t vertices);
+
+    // from vkQueueSubmit, the reader may read the pair from now on
+    void submitted(uint32_t slot);
+
+private:
+    static constexpr uint32_t SLOTS_PER_POOL = 128;
+    static constexpr uint32_t MAX_POOLS = 64;
+
+    // kind in the low bits, a generation above them that changes whenever the slot is reused
+    static constexpr uint64_t KIND_BITS = 3;
+    static constexpr uint64_t KIND_MASK = (1ull << KIND_BITS) - 1;
+
+    enum SlotKind : uint64_t
+    {
+        Free = 0,
+        Recording = 1,
+        Ended = 2,
+        Submitted = 3,
+        Reported = 4,
+    };
+
+    struct Slot
+    {
+        std::atomic<uint64_t> state{Free};
+        std::atomic<uint64_t> commandBuffer{0};
+        std::atomic<uint32_t> draws{0};
+        std::atomic<uint32_t> vertices{0};
+        uint64_t last_top = 0; // reader thread only
+    };
+
+    struct Pool
+    {
+        VkQueryPool pool = VK_NULL_HANDLE;
+        Slot slots[SLOTS_PER_POOL];
+    };
+
+    Slot &slot(uint32_t index)
+    {
+        return pools[index / SLOTS_PER_POOL]->slots[index % SLOTS_PER_POOL];
+    }
+
+    VkQueryPool queryPool(uint32_t index)
+    {
+        return pools[index / SLOTS_PER_POOL]->pool;
+    }
+
+    static uint64_t nextState(uint64_t state, SlotKind kind)
+    {
+        return ((state >> KIND_BITS) + 1) << KIND_BITS | kind;
+    }
+
+    bool addPool();
+    void poll();
+    void run();
+
+    Arena *arena;
+    VkDevice device;
+    const VkLayerDispatchTable *dispatch;
+    double period_ns;
+    uint64_t valid_mask;
+
+    // pools only ever get appended, the reader walks the first num_pools without a lock
+    Pool *pools[MAX_POOLS] = {};
+    std::atomic<uint32_t> num_pools{0};
+
+    std::mutex free_lock;
+    ArenaVector<uint32_t> free_slots; // room for every slot of the pools, release never grows it
+
+    std::atomic<bool> stop{false};
+    std::thread reader;
+};
@@ -0,0 +1,227 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Read-mostly handle map used on the layer's hot path
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Open-addressed table mapping pointer-sized handles to caller-owned values. Lookups take no lock
+ * and do no atomic read-modify-write, writes are serialized by a writer mutex. Tombstones are
+ * swept out in place, readers that overlapped a sweep notice the changed sweep counter and look
+ * again, so handle churn allocates nothing. Only doubling publishes a new table, the ones it
+ * replaced are kept until the map is destroyed because a reader may still be probing them. Each
+ * is at most half the size of the next, so together they never take more than the current table.
+ *
+ * The caller may free a value as soon as erase() returned it, which is fine for Vulkan handles: the
+ * spec requires that a handle is not used concurrently with the call that destroys it.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+template<typename Value>
+class HandleMap
+{
+public:
+    HandleMap()
+    {
+        table.store(new Table(16), std::memory_order_relaxed);
+    }
+
+    ~HandleMap()
+    {
+        Table *t = table.load(std::memory_order_relaxed);
+        while (t != nullptr) {
+            Table *prev = t->prev;
+            delete t;
+            t = prev;
+        }
+    }
+
+    HandleMap(const HandleMap &) = delete;
+    HandleMap &operator=(const HandleMap &) = delete;
+
+    // lock-free, returns NULL if the key is not in the map
+    Value *get(const void *handle) const
+    {
+        const uintptr_t key = (uintptr_t) handle;
+
+        for (;;) {
+            // odd while a sweep moves keys around, see sweep()
+            const uint32_t seq = sweeps.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            const Table *t = table.load(std::memory_order_acquire);
+            Value *v = nullptr;
+            for (uint32_t i = hash(key) & t->mask;; i = (i + 1) & t->mask) {
+                uintptr_t k = t->slots[i].key.load(std::memory_order_acquire);
+                if (k == key) {
+                    v = t->slots[i].value.load(std::memory_order_acquire);
+                    break;
+                }
+                if (k == EMPTY)
+                    break;
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sweeps.load(std::memory_order_relaxed) == seq)
+                return v;
+        }
+    }
+
+    // inserts or replaces the value for handle, returns the replaced value or NULL
+    Value *insert(const void *handle, Value *value)
+    {
+        const uintptr_t key = (uintptr_t) handle;
+        std::lock_guard<std::mutex> l(writer_lock);
+
+        Table *t = table.load(std::memory_order_relaxed);
+        if (Slot *s = find(t, key))
+            return s->value.exchange(value, std::memory_order_acq_rel);
+
+        // keep at least half the slots empty so probe chains stay short and always terminate. Only
+        // double when live entries need it, otherwise just sweep out the tombstones
+        if ((used + 1) * 2 > t->mask + 1) {
+            if ((live + 1) * 4 > t->mask + 1)
+                t = grow(t);
+            else
+                sweep(t);
+        }
+
+        place(t, key, value);
+        live++;
+        return nullptr;
+    }
+
+    // removes handle from the map, returns its value or NULL
+    Value *erase(const void *handle)
+    {
+        const uintptr_t key = (uintptr_t) handle;
+        std::lock_guard<std::mutex> l(writer_lock);
+
+        Slot *s = find(table.load(std::memory_order_relaxed), key);
+        if (s == nullptr)
+            return nullptr;
+
+        Value *v = s->value.load(std::memory_order_relaxed);
+        s->key.store(TOMBSTONE, std::memory_order_release);
+        live--;
+        return v;
+    }
+
+private:
+    static constexpr uintptr_t EMPTY = 0;
+    static constexpr uintptr_t TOMBSTONE = UINTPTR_MAX;
+
+    struct Slot
+    {
+        std::atomic<uintptr_t> key{EMPTY};
+        std::atomic<Value *> value{nullptr};
+    };
+
+    struct Table
+    {
+        explicit Table(uint32_t size) : mask(size - 1), slots(new Slot[size]) {}
+        uint32_t mask;
+        std::unique_ptr<Slot[]> slots;
+        Table *prev = nullptr; // the table this one replaced
+    };
+
+    static bool isLive(uintptr_t key)
+    {
+        return key != EMPTY && key != TOMBSTONE;
+    }
+
+    static uint32_t hash(uintptr_t key)
+    {
+        // handles are pointers, fibonacci hashing spreads their aligned low bits
+        return (uint32_t) (((uint64_t) key * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    static Slot *find(Table *t, uintptr_t key)
+    {
+        for (uint32_t i = hash(key) & t->mask;; i = (i + 1) & t->mask) {
+            uintptr_t k = t->slots[i].key.load(std::memory_order_relaxed);
+            if (k == key)
+                return &t->slots[i];
+            if (k == EMPTY)
+                return nullptr;
+        }
+    }
+
+    void place(Table *t, uintptr_t key, Value *v)
+    {
+        for (uint32_t i = hash(key) & t->mask;; i = (i + 1) & t->mask) {
+            uintptr_t k = t->slots[i].key.load(std::memory_order_relaxed);
+            if (k == EMPTY || k == TOMBSTONE) {
+                if (k == EMPTY)
+                    used++;
+                // value first, readers only look at it once they see the key
+                t->slots[i].value.store(v, std::memory_order_relaxed);
+                t->slots[i].key.store(key, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    Table *grow(Table *old)
+    {
+        Table *t = new Table((old->mask + 1) * 2);
+        used = 0;
+        for (uint32_t i = 0; i <= old->mask; i++) {
+            uintptr_t k = old->slots[i].key.load(std::memory_order_relaxed);
+            if (isLive(k))
+                place(t, k, old->slots[i].value.load(std::memory_order_relaxed));
+        }
+
+        // readers may still be probing the old table, it is freed with the map
+        t->prev = old;
+        table.store(t, std::memory_order_release);
+        return t;
+    }
+
+    // rehashes t in place without its tombstones. Readers can miss a key that is being moved, so
+    // the sweep counter is odd for the duration and they retry once it changed
+    void sweep(Table *t)
+    {
+        sweeps.store(sweeps.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint32_t start = 0;
+        for (uint32_t i = 0; i <= t->mask; i++) {
+            uintptr_t k = t->slots[i].key.load(std::memory_order_relaxed);
+            if (k == TOMBSTONE)
+                t->slots[i].key.store(EMPTY, std::memory_order_relaxed);
+            else if (k == EMPTY)
+                start = i;
+        }
+
+        // reinsert every key, going round from a slot that was empty before so every probe chain
+        // is walked from its start
+        used = 0;
+        for (uint32_t n = 1; n <= t->mask + 1; n++) {
+            uint32_t i = (start + n) & t->mask;
+            uintptr_t k = t->slots[i].key.load(std::memory_order_relaxed);
+            if (k == EMPTY)
+                continue;
+            t->slots[i].key.store(EMPTY, std::memory_order_relaxed);
+            place(t, k, t->slots[i].value.load(std::memory_order_relaxed));
+        }
+
+        sweeps.store(sweeps.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    std::atomic<Table *> table;
+    std::atomic<uint32_t> sweeps{0}; // odd while a sweep is running
+
+    std::mutex writer_lock;
+    uint32_t live = 0; // keys currently in the map
+    uint32_t used = 0; // live keys plus tombstones in the current table
+};
@@ -0,0 +1,274 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Asynchronous structured log for the layer's stats
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#include "vkdisplayhacksteamvr_log.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t RING_SIZE = 1024; // power of two
+constexpr auto DRAIN_INTERVAL = std::chrono::milliseconds(50);
+
+struct RecordInfo
+{
+    const char *name;
+    const char *fields[4];
+};
+
+const RecordInfo record_info[] = {
+    {"commandbuffer", {"draws", "instances", "vertices", "secondary"}},
+    {"present_interval", {"count", "p50_ns", "p99_ns", "p999_ns"}},
+    {"acquire_block", {"count", "p50_ns", "p99_ns", "p999_ns"}},
+    {"submit_to_present", {"count", "p50_ns", "p99_ns", "p999_ns"}},
+    {"frames", {"frames", "missed_vblanks", "refresh_ns", "timed_frames"}},
+    {"gpu_commandbuffer", {"gpu_ns", "draws", "vertices", NULL}},
+    {"display_ready", {"ready_ns", "waited_ns", "physical_devices", "found"}},
+    {"frame_draws", {"command_buffers", "draws", "indirect_draws", "vertices"}},
+    {"frame_work", {"dispatches", "pipeline_binds", "descriptor_set_binds", "render_passes"}},
+    {"acquire_to_present", {"count", "p50_ns", "p99_ns", "p999_ns"}},
+    {"swapchain_present", {"present_mode", "app_present_mode", "min_images", "app_min_images"}},
+    {"allocations", {"allocations", "frees", "live_bytes", "callback_allocations"}},
+};
+
+// single producer (the owning thread), single consumer (the writer thread)
+struct LogRing
+{
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<bool> abandoned{false};
+    uint32_t id = 0;
+    LogRecord records[RING_SIZE];
+};
+
+class LogWriter
+{
+public:
+    LogWriter()
+    {
+        const char *path = getenv("VK_DISPLAY_HACK_STEAMVR_LOG");
+        if (path != NULL && strcmp(path, "-") != 0) {
+            sink = fopen(path, "a");
+            if (sink == NULL)
+                printf("vkdisplayhacksteamvr: could not open log %s, using stdout\n", path);
+        }
+        if (sink == NULL)
+            sink = stdout;
+
+        const char *format = getenv("VK_DISPLAY_HACK_STEAMVR_LOG_FORMAT");
+        json = format != NULL && strcmp(format, "json") == 0;
+
+        thread = std::thread(&LogWriter::run, this);
+    }
+
+    ~LogWriter()
+    {
+        stop.store(true);
+        thread.join();
+        if (sink != stdout)
+            fclose(sink);
+        // rings are left alone, threads that outlive us may still hold on to theirs
+    }
+
+    LogRing *acquireRing()
+    {
+        std::lock_guard<std::mutex> l(rings_lock);
+
+        // hand out the ring of an exited thread once the writer has emptied it
+        for (LogRing *r : rings) {
+            if (r->abandoned.load(std::memory_order_acquire)
+                && r->head.load(std::memory_order_relaxed)
+                       == r->tail.load(std::memory_order_acquire)) {
+                r->abandoned.store(false, std::memory_order_relaxed);
+                return r;
+            }
+        }
+
+        LogRing *r = new LogRing;
+        r->id = (uint32_t) rings.size();
+        rings.push_back(r);
+        return r;
+    }
+
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    void run()
+    {
+        while (!stop.load()) {
+            std::this_thread::sleep_for(DRAIN_INTERVAL);
+            drain();
+        }
+        drain();
+    }
+
+    void drain()
+    {
+        buffer.clear();
+
+        // formatted outside the lock so new threads don't wait for it, rings are never freed and
+        // only this thread moves their tails
+        {
+            std::lock_guard<std::mutex> l(rings_lock);
+            draining.assign(rings.begin(), rings.end());
+        }
+        for (LogRing *r : draining) {
+            uint32_t tail = r->tail.load(std::memory_order_relaxed);
+            uint32_t head = r->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++)
+                format(r->records[tail & (RING_SIZE - 1)]);
+            r->tail.store(tail, std::memory_order_release);
+        }
+
+        uint64_t d = dropped.load(std::memory_order_relaxed);
+        if (d != reported_dropped) {
+            char line[128];
+            snprintf(line,
+                     sizeof(line),
+                     json ? "{\"dropped\":%llu}\n" : "# dropped %llu records\n",
+                     (unsigned long long) d);
+            buffer += line;
+            reported_dropped = d;
+        }
+
+        if (buffer.empty())
+            return;
+
+        fwrite(buffer.data(), 1, buffer.size(), sink);
+        fflush(sink);
+    }
+
+    void format(const LogRecord &rec)
+    {
+        const RecordInfo &info = record_info[(uint32_t) rec.type];
+        char line[512];
+        int len = 0;
+
+        if (!json && !(header_written & (1u << (uint32_t) rec.type))) {
+            len += snprintf(line + len,
+                            sizeof(line) - len,
+                            "# %s: record,time_ns,thread,handle",
+                            info.name);
+            for (int i = 0; i < 4 && info.fields[i] != NULL; i++)
+                len += snprintf(line + len, sizeof(line) - len, ",%s", info.fields[i]);
+            len += snprintf(line + len, sizeof(line) - len, "\n");
+            header_written |= 1u << (uint32_t) rec.type;
+        }
+
+        if (json) {
+            len += snprintf(line + len,
+                            sizeof(line) - len,
+                            "{\"record\":\"%s\",\"time_ns\":%llu,\"thread\":%u,\"handle\":\"0x%llx\"",
+                            info.name,
+                            (unsigned long long) rec.time_ns,
+                            rec.thread,
+                            (unsigned long long) rec.handle);
+            for (int i = 0; i < 4 && info.fields[i] != NULL; i++)
+                len += snprintf(line + len,
+                                sizeof(line) - len,
+                                ",\"%s\":%llu",
+                                info.fields[i],
+                                (unsigned long long) rec.values[i]);
+            len += snprintf(line + len, sizeof(line) - len, "}\n");
+        } else {
+            len += snprintf(line + len,
+                            sizeof(line) - len,
+                            "%s,%llu,%u,0x%llx",
+                            info.name,
+                            (unsigned long long) rec.time_ns,
+                            rec.thread,
+                            (unsigned long long) rec.handle);
+            for (int i = 0; i < 4 && info.fields[i] != NULL; i++)
+                len += snprintf(line + len,
+                                sizeof(line) - len,
+                                ",%llu",
+                                (unsigned long long) rec.values[i]);
+            len += snprintf(line + len, sizeof(line) - len, "\n");
+        }
+
+        buffer.append(line, len);
+    }
+
+    FILE *sink = NULL;
+    bool json = false;
+    uint32_t header_written = 0;
+    uint64_t reported_dropped = 0;
+    std::string buffer;
+
+    std::mutex rings_lock;
+    std::vector<LogRing *> rings;
+    std::vector<LogRing *> draining; // copy of rings, the writer thread's own
+
+    std::atomic<bool> stop{false};
+    std::thread thread;
+};
+
+LogWriter &writer()
+{
+    static LogWriter w;
+    return w;
+}
+
+// gives the ring back to the writer when its thread exits
+struct ThreadRing
+{
+    LogRing *ring = NULL;
+    ~ThreadRing()
+    {
+        if (ring != NULL)
+            ring->abandoned.store(true, std::memory_order_release);
+    }
+};
+
+thread_local ThreadRing thread_ring;
+
+} // namespace
+
+uint64_t log_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void log_push(LogRecordType type, uint64_t handle, uint64_t v0, uint64_t v1, uint64_t v2, uint64_t v3)
+{
+    LogRing *r = thread_ring.ring;
+    if (r == NULL)
+        r = thread_ring.ring = writer().acquireRing();
+
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) == RING_SIZE) {
+        writer().dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord &rec = r->records[head & (RING_SIZE - 1)];
+    rec.type = type;
+    rec.thread = r->id;
+    rec.time_ns = log_now_ns();
+    rec.handle = handle;
+    rec.values[0] = v0;
+    rec.values[1] = v1;
+    rec.values[2] = v2;
+    rec.values[3] = v3;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t log_dropped()
+{
+    return writer().dropped.load(std::memory_order_relaxed);
+}
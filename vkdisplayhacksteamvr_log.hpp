@@ -0,0 +1,55 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Asynchronous structured log for the layer's stats
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Recording threads push fixed-size records into their own ring buffer, a background thread
+ * drains all rings and writes them out in batches. Pushing never blocks and never does I/O, a
+ * record is dropped and counted when the calling thread's ring is full.
+ *
+ * VK_DISPLAY_HACK_STEAMVR_LOG selects the sink file (stdout if unset or "-"),
+ * VK_DISPLAY_HACK_STEAMVR_LOG_FORMAT selects "csv" (default) or "json" lines.
+ */
+#pragma once
+
+#include <cstdint>
+
+enum class LogRecordType : uint32_t
+{
+    CommandBuffer,    // values: draws, instances, vertices, secondary
+    PresentInterval,  // values: count, p50_ns, p99_ns, p999_ns
+    AcquireBlock,     // values: count, p50_ns, p99_ns, p999_ns
+    SubmitToPresent,  // values: count, p50_ns, p99_ns, p999_ns
+    Frames,           // values: frames, missed_vblanks, refresh_ns, timed_frames
+    GpuCommandBuffer, // values: gpu_ns, draws, vertices
+    DisplayReady,     // values: ready_ns, waited_ns, physical_devices, found
+    FrameDraws,       // values: command_buffers, draws, indirect_draws, vertices
+    FrameWork,        // values: dispatches, pipeline_binds, descriptor_set_binds, render_passes
+    AcquireToPresent, // values: count, p50_ns, p99_ns, p999_ns
+    SwapchainPresent, // values: present_mode, app_present_mode, min_images, app_min_images
+    Allocations,      // values: allocations, frees, live_bytes, callback_allocations
+};
+
+struct LogRecord
+{
+    LogRecordType type;
+    uint32_t thread;
+    uint64_t time_ns;
+    uint64_t handle;
+    uint64_t values[4];
+};
+
+// monotonic clock used for all record timestamps
+uint64_t log_now_ns();
+
+void log_push(LogRecordType type,
+              uint64_t handle,
+              uint64_t v0 = 0,
+              uint64_t v1 = 0,
+              uint64_t v2 = 0,
+              uint64_t v3 = 0);
+
+// records dropped so far because a ring was full
+uint64_t log_dropped();
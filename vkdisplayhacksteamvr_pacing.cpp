@@ -0,0 +1,161 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Frame pacing of swapchains on the overridden display
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#include "vkdisplayhacksteamvr_pacing.hpp"
+#include "vkdisplayhacksteamvr_log.hpp"
+
+#include <stdlib.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+
+uint32_t LatencyHistogram::bucket(uint64_t ns)
+{
+    if (ns >= (1ull << MAX_BITS))
+        ns = (1ull << MAX_BITS) - 1;
+    if (ns < SUB_BUCKETS)
+        return (uint32_t) ns;
+
+    // the top SUB_BITS bits of the value pick the sub-bucket within its power of two
+    uint32_t shift = (63 - __builtin_clzll(ns)) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (uint32_t) ((ns >> shift) - SUB_BUCKETS);
+}
+
+uint64_t LatencyHistogram::bucketValue(uint32_t index)
+{
+    if (index < SUB_BUCKETS)
+        return index;
+
+    // midpoint of the bucket
+    uint32_t shift = index / SUB_BUCKETS - 1;
+    uint64_t mantissa = SUB_BUCKETS + index % SUB_BUCKETS;
+    return (mantissa << shift) + ((1ull << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Summary LatencyHistogram::drain()
+{
+    uint64_t counts[NUM_BUCKETS];
+    Summary s = {};
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++) {
+        counts[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+        s.count += counts[i];
+    }
+    if (s.count == 0)
+        return s;
+
+    // smallest value with at least the given share of samples at or below it
+    const uint64_t p50 = (s.count * 500 + 999) / 1000;
+    const uint64_t p99 = (s.count * 990 + 999) / 1000;
+    const uint64_t p999 = (s.count * 999 + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++) {
+        if (counts[i] == 0)
+            continue;
+        uint64_t before = seen;
+        seen += counts[i];
+        if (before < p50 && seen >= p50)
+            s.p50 = bucketValue(i);
+        if (before < p99 && seen >= p99)
+            s.p99 = bucketValue(i);
+        if (before < p999 && seen >= p999)
+            s.p999 = bucketValue(i);
+    }
+    return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// FramePacing
+
+FramePacing::FramePacing(uint64_t refresh_ns, bool display_timing)
+    : display_timing(display_timing), refresh_ns(refresh_ns)
+{
+    const char *interval = getenv("VK_DISPLAY_HACK_STEAMVR_PACING_INTERVAL");
+    double seconds = interval != NULL ? atof(interval) : 0.0;
+    if (seconds <= 0.0)
+        seconds = 5.0;
+    report_interval_ns = (uint64_t) (seconds * 1e9);
+}
+
+void FramePacing::acquired(uint32_t image, uint64_t start_ns, uint64_t end_ns)
+{
+    acquire_block.record(end_ns - start_ns);
+    if (image < MAX_IMAGES)
+        acquire_start_ns[image].store(start_ns, std::memory_order_relaxed);
+}
+
+// an interval of n refresh periods means n - 1 vblanks went by without a new frame
+void FramePacing::countMissed(uint64_t interval_ns)
+{
+    if (refresh_ns == 0)
+        return;
+    uint64_t periods = (interval_ns + refresh_ns / 2) / refresh_ns;
+    if (periods > 1)
+        missed_vblanks += periods - 1;
+}
+
+void FramePacing::presented(uint32_t image, uint64_t now_ns, uint64_t last_submit_ns)
+{
+    frames++;
+
+    if (last_submit_ns != 0 && last_submit_ns <= now_ns)
+        submit_to_present.record(now_ns - last_submit_ns);
+
+    // from the start of the acquire, so time spent waiting for a free image counts too
+    if (image < MAX_IMAGES) {
+        uint64_t acquire_ns = acquire_start_ns[image].exchange(0, std::memory_order_relaxed);
+        if (acquire_ns != 0 && acquire_ns <= now_ns)
+            acquire_to_present.record(now_ns - acquire_ns);
+    }
+
+    // with display timing the intervals come from the actual scanout times instead
+    if (!display_timing && last_present_ns != 0) {
+        present_interval.record(now_ns - last_present_ns);
+        countMissed(now_ns - last_present_ns);
+    }
+    last_present_ns = now_ns;
+}
+
+void FramePacing::pastTimings(const VkPastPresentationTimingGOOGLE *timings, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t actual = timings[i].actualPresentTime;
+        if (last_actual_present_ns != 0 && actual > last_actual_present_ns) {
+            present_interval.record(actual - last_actual_present_ns);
+            countMissed(actual - last_actual_present_ns);
+        }
+        last_actual_present_ns = actual;
+        timed_frames++;
+    }
+}
+
+void FramePacing::report(uint64_t handle, uint64_t now_ns)
+{
+    if (last_report_ns == 0)
+        last_report_ns = now_ns;
+    if (now_ns - last_report_ns < report_interval_ns)
+        return;
+    last_report_ns = now_ns;
+
+    LatencyHistogram::Summary s = present_interval.drain();
+    log_push(LogRecordType::PresentInterval, handle, s.count, s.p50, s.p99, s.p999);
+    s = acquire_block.drain();
+    log_push(LogRecordType::AcquireBlock, handle, s.count, s.p50, s.p99, s.p999);
+    s = submit_to_present.drain();
+    log_push(LogRecordType::SubmitToPresent, handle, s.count, s.p50, s.p99, s.p999);
+    s = acquire_to_present.drain();
+    log_push(LogRecordType::AcquireToPresent, handle, s.count, s.p50, s.p99, s.p999);
+    log_push(LogRecordType::Frames, handle, frames, missed_vblanks, refresh_ns, timed_frames);
+
+    frames = 0;
+    missed_vblanks = 0;
+    timed_frames = 0;
+}
@@ -0,0 +1,93 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Frame pacing of swapchains on the overridden display
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Durations go into log-linear histograms, 32 linear sub-buckets per power of two nanoseconds, so
+ * recording is a few shifts and one relaxed atomic add and percentiles are accurate to about 3%.
+ * The percentiles and the missed vblank count are pushed to the stats log once per report interval
+ * (VK_DISPLAY_HACK_STEAMVR_PACING_INTERVAL seconds, default 5) and the histograms start over.
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <atomic>
+#include <cstdint>
+
+class LatencyHistogram
+{
+public:
+    struct Summary
+    {
+        uint64_t count, p50, p99, p999;
+    };
+
+    // lock-free, may be called from any thread
+    void record(uint64_t ns);
+
+    // percentiles of everything recorded since the last drain, resets the histogram
+    Summary drain();
+
+private:
+    static constexpr uint32_t SUB_BITS = 5;
+    static constexpr uint32_t SUB_BUCKETS = 1u << SUB_BITS;
+    static constexpr uint32_t MAX_BITS = 40; // ~18 minutes, longer durations are clamped
+    static constexpr uint32_t NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static uint32_t bucket(uint64_t ns);
+    static uint64_t bucketValue(uint32_t index);
+
+    std::atomic<uint64_t> buckets[NUM_BUCKETS] = {};
+};
+
+// pacing state of one swapchain
+class FramePacing
+{
+public:
+    static constexpr uint32_t NO_IMAGE = UINT32_MAX;
+
+    FramePacing(uint64_t refresh_ns, bool display_timing);
+
+    // vkAcquireNextImageKHR was called at start_ns and returned image at end_ns, NO_IMAGE if it
+    // didn't return one
+    void acquired(uint32_t image, uint64_t start_ns, uint64_t end_ns);
+
+    // image was presented at now_ns, last_submit_ns is the device's latest vkQueueSubmit
+    void presented(uint32_t image, uint64_t now_ns, uint64_t last_submit_ns);
+
+    // actual present times read back through VK_GOOGLE_display_timing, oldest first
+    void pastTimings(const VkPastPresentationTimingGOOGLE *timings, uint32_t count);
+
+    // pushes the stats of the current interval to the log once it is over, present thread only
+    void report(uint64_t handle, uint64_t now_ns);
+
+    const bool display_timing;
+    uint64_t refresh_ns;
+
+private:
+    // images past this aren't timed from acquire to present
+    static constexpr uint32_t MAX_IMAGES = 16;
+
+    void countMissed(uint64_t interval_ns);
+
+    LatencyHistogram present_interval;
+    LatencyHistogram acquire_block;
+    LatencyHistogram submit_to_present;
+    LatencyHistogram acquire_to_present;
+
+    // when the acquire that returned each image started, images may be acquired and presented
+    // from different threads
+    std::atomic<uint64_t> acquire_start_ns[MAX_IMAGES] = {};
+
+    // only touched from the presenting thread
+    uint64_t last_present_ns = 0;
+    uint64_t last_actual_present_ns = 0;
+    uint64_t frames = 0;
+    uint64_t missed_vblanks = 0;
+    uint64_t timed_frames = 0;
+    uint64_t report_interval_ns;
+    uint64_t last_report_ns = 0;
+};
@@ -0,0 +1,577 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  RandR display inventory shared by the CLI and the layer
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * xcb/randr code taken from monado
+ */
+
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vulkan/vulkan.h>
+
+#include <X11/Xlib-xcb.h>
+#include <X11/Xlib.h>
+#include <xcb/randr.h>
+#include <xcb/xcb.h>
+
+#include <X11/extensions/Xrandr.h>
+#include <vulkan/vulkan_xlib_xrandr.h>
+
+#include "vkdisplayhacksteamvr.h"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int mode_id_cmp(const void *a, const void *b)
+{
+  uint32_t x = ((const xcb_randr_mode_info_t *) a)->id;
+  uint32_t y = ((const xcb_randr_mode_info_t *) b)->id;
+  return x < y ? -1 : x > y;
+}
+
+// returns a zeroed slot at the end of the list, committed by bumping num_displays
+static struct comp_window_direct_randr_display *
+inventory_append(struct randr_display_inventory *inv)
+{
+  if (inv->num_displays == inv->capacity) {
+    uint32_t capacity = inv->capacity > 0 ? inv->capacity * 2 : 8;
+    struct comp_window_direct_randr_display *displays
+        = realloc(inv->displays, sizeof(*displays) * capacity);
+    if (displays == NULL)
+      return NULL;
+    inv->displays = displays;
+    inv->capacity = capacity;
+  }
+
+  struct comp_window_direct_randr_display *d = &inv->displays[inv->num_displays];
+  memset(d, 0, sizeof(*d));
+  return d;
+}
+
+static void display_free(struct comp_window_direct_randr_display *d)
+{
+  free(d->name);
+  free(d->modes);
+  d->name = NULL;
+  d->modes = NULL;
+}
+
+// resolves every candidate output on one physical device
+struct resolve_job
+{
+  PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT;
+  Display *dpy;
+  VkPhysicalDevice physical_device;
+  const struct comp_window_direct_randr_display *candidates;
+  uint32_t num_candidates;
+  VkDisplayKHR *results;
+};
+
+static void *resolve_outputs(void *data)
+{
+  struct resolve_job *job = data;
+  for (uint32_t i = 0; i < job->num_candidates; i++) {
+    VkResult res = job->_vkGetRandROutputDisplayEXT(job->physical_device,
+                                                    job->dpy,
+                                                    job->candidates[i].output,
+                                                    &job->results[i]);
+    if (res != VK_SUCCESS) {
+      printf("vkGetRandROutputDisplayEXT failed for %s: %d\n", job->candidates[i].name, res);
+      job->results[i] = VK_NULL_HANDLE;
+    }
+  }
+  return NULL;
+}
+
+// turns the candidate outputs of the RandR walk into one display per output and physical device
+static int resolve_displays(struct randr_display_inventory *inv,
+                            const VkPhysicalDevice *physical_devices,
+                            uint32_t num_physical_devices,
+                            PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
+                            Display *dpy,
+                            bool parallel)
+{
+  uint32_t num_candidates = inv->num_displays;
+  struct resolve_job *jobs = calloc(num_physical_devices + 1, sizeof(struct resolve_job));
+  VkDisplayKHR *results = calloc((size_t) num_physical_devices * num_candidates + 1,
+                                 sizeof(VkDisplayKHR));
+  pthread_t *threads = calloc(num_physical_devices + 1, sizeof(pthread_t));
+  bool *started = calloc(num_physical_devices + 1, sizeof(bool));
+
+  struct randr_display_inventory resolved = {0};
+  int ret = jobs == NULL || results == NULL || threads == NULL || started == NULL ? -1 : 0;
+
+  for (uint32_t p = 0; p < num_physical_devices && ret == 0; p++) {
+    jobs[p] = (struct resolve_job){
+        ._vkGetRandROutputDisplayEXT = _vkGetRandROutputDisplayEXT,
+        .dpy = dpy,
+        .physical_device = physical_devices[p],
+        .candidates = inv->displays,
+        .num_candidates = num_candidates,
+        .results = &results[(size_t) p * num_candidates],
+    };
+  }
+
+  // calls on different physical devices need no external synchronization, but drivers talk to
+  // the X server through dpy, so this is only safe when Xlib was initialized for threads
+  for (uint32_t p = 0; p < num_physical_devices && ret == 0; p++) {
+    if (parallel && num_physical_devices > 1)
+      started[p] = pthread_create(&threads[p], NULL, resolve_outputs, &jobs[p]) == 0;
+    if (!started[p])
+      resolve_outputs(&jobs[p]);
+  }
+  for (uint32_t p = 0; p < num_physical_devices && ret == 0; p++)
+    if (started[p])
+      pthread_join(threads[p], NULL);
+
+  for (uint32_t p = 0; p < num_physical_devices && ret == 0; p++) {
+    for (uint32_t i = 0; i < num_candidates; i++) {
+      const struct comp_window_direct_randr_display *c = &inv->displays[i];
+      if (jobs[p].results[i] == VK_NULL_HANDLE)
+        continue;
+
+      struct comp_window_direct_randr_display *d = inventory_append(&resolved);
+      if (d == NULL) {
+        ret = -1;
+        break;
+      }
+
+      *d = *c;
+      d->name = malloc(strlen(c->name) + 1);
+      d->modes = malloc(sizeof(xcb_randr_mode_info_t) * (c->num_modes > 0 ? c->num_modes : 1));
+      if (d->name == NULL || d->modes == NULL) {
+        display_free(d);
+        ret = -1;
+        break;
+      }
+      strcpy(d->name, c->name);
+      memcpy(d->modes, c->modes, sizeof(xcb_randr_mode_info_t) * c->num_modes);
+      d->physical_device = physical_devices[p];
+      d->display = jobs[p].results[i];
+      resolved.num_displays += 1;
+
+      printf("randr display #%d: GPU %u %s with primary mode %dx%d, %u modes\n",
+             resolved.num_displays - 1,
+             p,
+             d->name,
+             d->primary_mode.width,
+             d->primary_mode.height,
+             d->num_modes);
+    }
+  }
+
+  for (uint32_t i = 0; i < num_candidates && ret == 0; i++) {
+    bool found = false;
+    for (uint32_t p = 0; p < num_physical_devices; p++)
+      found = found || jobs[p].results[i] != VK_NULL_HANDLE;
+    if (!found)
+      printf("vkGetRandROutputDisplayEXT returned a null display for %s, ignoring...\n",
+             inv->displays[i].name);
+  }
+
+  free(threads);
+  free(started);
+  free(results);
+  free(jobs);
+
+  // swap the resolved displays in, keeping the stats of the walk
+  randr_inventory_clear(inv);
+  free(inv->displays);
+  inv->displays = resolved.displays;
+  inv->num_displays = resolved.num_displays;
+  inv->capacity = resolved.capacity;
+
+  if (ret != 0)
+    randr_inventory_clear(inv);
+  return ret;
+}
+
+int randr_inventory_walk(struct randr_display_inventory *inv, Display *dpy)
+{
+  randr_inventory_clear(inv);
+
+  xcb_connection_t *connection = XGetXCBConnection(dpy);
+
+  int ret = 0;
+
+  // Every request below is sent before its reply is waited on, so each block of replies costs one
+  // round trip to the X server instead of one per request.
+  uint32_t round_trips = 0;
+  uint64_t start_ns = now_ns();
+  inv->version_major = 0;
+  inv->version_minor = 0;
+  inv->version_ns = 0;
+  inv->resources_ns = 0;
+  inv->outputs_ns = 0;
+  inv->resolve_ns = 0;
+
+  // comp_window_direct_randr_init
+  {
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(connection));
+
+    xcb_screen_t *screen = NULL;
+    while (iter.rem > 0 && inv->num_displays == 0 && ret == 0) {
+      screen = iter.data;
+
+      // comp_window_direct_randr_get_outputs
+      {
+        uint64_t phase_ns = now_ns();
+        xcb_generic_error_t *error = NULL;
+        xcb_randr_query_version_cookie_t version_cookie
+            = xcb_randr_query_version(connection, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+        xcb_intern_atom_cookie_t non_desktop_cookie = xcb_intern_atom(connection,
+                                                                      1,
+                                                                      strlen("non-desktop"),
+                                                                      "non-desktop\n");
+
+        xcb_randr_query_version_reply_t *version_reply
+            = xcb_randr_query_version_reply(connection, version_cookie, NULL);
+        xcb_intern_atom_reply_t *non_desktop_reply = xcb_intern_atom_reply(connection,
+                                                                           non_desktop_cookie,
+                                                                           &error);
+        round_trips++;
+        inv->version_ns += now_ns() - phase_ns;
+
+        if (version_reply == NULL) {
+            printf("Could not get RandR version.\n");
+            free(non_desktop_reply);
+            free(error);
+            ret = -1;
+            break;
+        }
+
+        inv->version_major = version_reply->major_version;
+        inv->version_minor = version_reply->minor_version;
+
+        // GetScreenResourcesCurrent (1.3) doesn't make the server re-probe the connectors
+        bool resources_current = version_reply->major_version > 1
+                                 || version_reply->minor_version >= 3;
+
+        free(version_reply);
+
+        if (error != NULL) {
+            free(non_desktop_reply);
+            printf("xcb_intern_atom_reply returned error %d\n", error->error_code);
+            free(error);
+            ret = -1;
+            break;
+        }
+
+        if (non_desktop_reply == NULL) {
+            printf("non-desktop reply NULL\n");
+            ret = -1;
+            break;
+        }
+
+        if (non_desktop_reply->atom == XCB_NONE) {
+            free(non_desktop_reply);
+            printf("No output has non-desktop property\n");
+            ret = -1;
+            break;
+        }
+
+        phase_ns = now_ns();
+        void *resources_reply = NULL;
+        xcb_randr_output_t *xcb_outputs = NULL;
+        int count = 0;
+        xcb_randr_mode_info_t *mode_infos = NULL;
+        int n = 0;
+
+        if (resources_current) {
+            xcb_randr_get_screen_resources_current_reply_t *reply
+                = xcb_randr_get_screen_resources_current_reply(
+                    connection,
+                    xcb_randr_get_screen_resources_current(connection, screen->root),
+                    NULL);
+            if (reply != NULL) {
+                xcb_outputs = xcb_randr_get_screen_resources_current_outputs(reply);
+                count = xcb_randr_get_screen_resources_current_outputs_length(reply);
+                mode_infos = xcb_randr_get_screen_resources_current_modes(reply);
+                n = xcb_randr_get_screen_resources_current_modes_length(reply);
+            }
+            resources_reply = reply;
+        } else {
+            xcb_randr_get_screen_resources_reply_t *reply
+                = xcb_randr_get_screen_resources_reply(
+                    connection, xcb_randr_get_screen_resources(connection, screen->root), NULL);
+            if (reply != NULL) {
+                xcb_outputs = xcb_randr_get_screen_resources_outputs(reply);
+                count = xcb_randr_get_screen_resources_outputs_length(reply);
+                mode_infos = xcb_randr_get_screen_resources_modes(reply);
+                n = xcb_randr_get_screen_resources_modes_length(reply);
+            }
+            resources_reply = reply;
+        }
+        round_trips++;
+        inv->resources_ns += now_ns() - phase_ns;
+
+        if (resources_reply == NULL) {
+            printf("failed to retrieve randr screen resources\n");
+            free(non_desktop_reply);
+            ret = -1;
+            break;
+        }
+
+        if (count < 1) {
+            printf("failed to retrieve randr outputs\n");
+        }
+
+        phase_ns = now_ns();
+        xcb_randr_mode_info_t *modes_by_id = malloc(sizeof(xcb_randr_mode_info_t) * (n > 0 ? n : 1));
+        xcb_randr_get_output_info_cookie_t *output_cookies
+            = malloc(sizeof(xcb_randr_get_output_info_cookie_t) * (count > 0 ? count : 1));
+        xcb_randr_get_output_property_cookie_t *prop_cookies
+            = malloc(sizeof(xcb_randr_get_output_property_cookie_t) * (count > 0 ? count : 1));
+        if (modes_by_id == NULL || output_cookies == NULL || prop_cookies == NULL) {
+            // no request sent yet, so there are no replies to collect
+            ret = -1;
+            count = 0;
+        } else {
+            // index the modes by id once, outputs look them up by bsearch
+            memcpy(modes_by_id, mode_infos, sizeof(xcb_randr_mode_info_t) * n);
+            qsort(modes_by_id, n, sizeof(xcb_randr_mode_info_t), mode_id_cmp);
+        }
+
+        // phase 1: fire the output info and non-desktop property requests of all outputs
+        for (int i = 0; i < count; i++) {
+            output_cookies[i] = xcb_randr_get_output_info(connection,
+                                                          xcb_outputs[i],
+                                                          XCB_CURRENT_TIME);
+            prop_cookies[i] = xcb_randr_get_output_property(connection,
+                                                            xcb_outputs[i],
+                                                            non_desktop_reply->atom,
+                                                            XCB_ATOM_NONE,
+                                                            0,
+                                                            4,
+                                                            0,
+                                                            0);
+        }
+        if (count > 0)
+            round_trips++;
+
+        // phase 2: collect the replies, every cookie has to be consumed even after an error
+        for (int i = 0; i < count; i++) {
+            xcb_randr_get_output_info_reply_t *output_reply
+                = xcb_randr_get_output_info_reply(connection, output_cookies[i], NULL);
+            xcb_randr_get_output_property_reply_t *prop_reply
+                = xcb_randr_get_output_property_reply(connection, prop_cookies[i], &error);
+
+            // Only outputs with an available mode should be used
+            // (it is possible to see 'ghost' outputs with non-desktop=1).
+            if (ret != 0 || output_reply == NULL || output_reply->num_modes == 0) {
+                free(error);
+                error = NULL;
+                free(prop_reply);
+                free(output_reply);
+                continue;
+            }
+
+            // Find the first output that has the non-desktop property set.
+            if (error != NULL) {
+                printf("xcb_randr_get_output_property_reply "
+                       "returned error %d\n",
+                       error->error_code);
+                free(error);
+                error = NULL;
+                free(prop_reply);
+                free(output_reply);
+                continue;
+            }
+
+            if (prop_reply == NULL) {
+                printf("property reply == NULL\n");
+                free(output_reply);
+                continue;
+            }
+
+            if (prop_reply->type != XCB_ATOM_INTEGER || prop_reply->num_items != 1
+                || prop_reply->format != 32) {
+                printf("Invalid non-desktop reply\n");
+                free(prop_reply);
+                free(output_reply);
+                continue;
+            }
+
+            // every output with modes is a candidate, only the ones asked for get resolved
+            uint8_t non_desktop = *xcb_randr_get_output_property_data(prop_reply);
+            struct comp_window_direct_randr_display *d = inventory_append(inv);
+            if (d == NULL) {
+                // the rest of the replies still have to be consumed
+                ret = -1;
+            } else {
+                // append_randr_display
+                {
+                    xcb_randr_mode_t *output_modes = xcb_randr_get_output_info_modes(output_reply);
+                    int mode_count = xcb_randr_get_output_info_modes_length(output_reply);
+
+                    uint8_t *name = xcb_randr_get_output_info_name(output_reply);
+                    int name_len = xcb_randr_get_output_info_name_length(output_reply);
+
+                    d->name = malloc(sizeof(char) * (name_len + 1));
+                    d->modes = malloc(sizeof(xcb_randr_mode_info_t) * mode_count);
+                    if (d->name == NULL || d->modes == NULL) {
+                        display_free(d);
+                        ret = -1;
+                        free(prop_reply);
+                        free(output_reply);
+                        continue;
+                    }
+                    memcpy(d->name, name, name_len);
+                    d->name[name_len] = '\0';
+                    d->output = xcb_outputs[i];
+                    d->non_desktop = non_desktop == 1;
+                    d->display = VK_NULL_HANDLE;
+
+                    // all modes of the output in RandR order, preferred ones come first
+                    for (int j = 0; j < mode_count; j++) {
+                        xcb_randr_mode_info_t key = {.id = output_modes[j]};
+                        xcb_randr_mode_info_t *mode_info = bsearch(&key,
+                                                                   modes_by_id,
+                                                                   n,
+                                                                   sizeof(xcb_randr_mode_info_t),
+                                                                   mode_id_cmp);
+                        if (mode_info != NULL)
+                            d->modes[d->num_modes++] = *mode_info;
+                        else
+                            printf("No mode with id %d found??\n", output_modes[j]);
+                    }
+
+                    if (d->num_modes > 0)
+                        d->primary_mode = d->modes[0];
+
+                    // resolved on a physical device once asked for
+                    inv->num_displays += 1;
+                }
+            }
+
+            free(prop_reply);
+            free(output_reply);
+        }
+
+        inv->outputs_ns += now_ns() - phase_ns;
+
+        free(output_cookies);
+        free(prop_cookies);
+        free(modes_by_id);
+        free(non_desktop_reply);
+        free(resources_reply);
+      }
+      xcb_screen_next(&iter);
+    }
+  }
+
+  inv->round_trips = round_trips;
+  inv->enumeration_ns = now_ns() - start_ns;
+
+  if (ret != 0) {
+    randr_inventory_clear(inv);
+    return ret;
+  }
+
+  return 0;
+}
+
+int randr_inventory_enumerate(struct randr_display_inventory *inv,
+                              const VkPhysicalDevice *physical_devices,
+                              uint32_t num_physical_devices,
+                              PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
+                              Display *dpy,
+                              bool parallel)
+{
+  int ret = randr_inventory_walk(inv, dpy);
+  if (ret != 0)
+    return ret;
+
+  uint64_t start_ns = now_ns();
+  ret = resolve_displays(inv,
+                         physical_devices,
+                         num_physical_devices,
+                         _vkGetRandROutputDisplayEXT,
+                         dpy,
+                         parallel);
+  inv->resolve_ns = now_ns() - start_ns;
+  inv->enumeration_ns += inv->resolve_ns;
+  return ret;
+}
+
+struct comp_window_direct_randr_display *
+randr_inventory_select(const struct randr_display_inventory *inv, const char *selector)
+{
+  if (strcmp(selector, "non-desktop") != 0)
+    return randr_inventory_find_name(inv, VK_NULL_HANDLE, selector);
+
+  for (uint32_t i = 0; i < inv->num_displays; i++)
+    if (inv->displays[i].non_desktop)
+      return &inv->displays[i];
+  return NULL;
+}
+
+VkDisplayKHR randr_inventory_resolve(struct comp_window_direct_randr_display *d,
+                                     VkPhysicalDevice physical_device,
+                                     PFN_vkGetRandROutputDisplayEXT _vkGetRandROutputDisplayEXT,
+                                     Display *dpy)
+{
+  if (d->physical_device == physical_device)
+    return d->display;
+
+  VkResult res = _vkGetRandROutputDisplayEXT(physical_device, dpy, d->output, &d->display);
+  if (res != VK_SUCCESS) {
+    printf("vkGetRandROutputDisplayEXT failed for %s: %d\n", d->name, res);
+    d->display = VK_NULL_HANDLE;
+  }
+  d->physical_device = physical_device;
+  return d->display;
+}
+
+void randr_inventory_clear(struct randr_display_inventory *inv)
+{
+  for (uint32_t i = 0; i < inv->num_displays; i++)
+    display_free(&inv->displays[i]);
+  inv->num_displays = 0;
+}
+
+void randr_inventory_destroy(struct randr_display_inventory *inv)
+{
+  randr_inventory_clear(inv);
+  free(inv->displays);
+  inv->displays = NULL;
+  inv->capacity = 0;
+}
+
+struct comp_window_direct_randr_display *
+randr_inventory_find_name(const struct randr_display_inventory *inv,
+                          VkPhysicalDevice physical_device,
+                          const char *name)
+{
+  for (uint32_t i = 0; i < inv->num_displays; i++)
+    if ((physical_device == VK_NULL_HANDLE || inv->displays[i].physical_device == physical_device)
+        && strcmp(inv->displays[i].name, name) == 0)
+      return &inv->displays[i];
+  return NULL;
+}
+
+struct comp_window_direct_randr_display *
+randr_inventory_find_output(const struct randr_display_inventory *inv,
+                            VkPhysicalDevice physical_device,
+                            xcb_randr_output_t output)
+{
+  for (uint32_t i = 0; i < inv->num_displays; i++)
+    if ((physical_device == VK_NULL_HANDLE || inv->displays[i].physical_device == physical_device)
+        && inv->displays[i].output == output)
+      return &inv->displays[i];
+  return NULL;
+}
@@ -0,0 +1,235 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Writer side of the live telemetry segment
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#include "vkdisplayhacksteamvr_telemetry.hpp"
+#include "vkdisplayhacksteamvr_alloc.hpp"
+#include "vkdisplayhacksteamvr_log.hpp"
+
+#include <atomic>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+// running totals of a slot's device, added to with relaxed atomics by any recording thread and
+// copied into the slot at every present, so only presents take the seqlock
+struct alignas(64) DeviceCounters
+{
+    std::atomic<uint64_t> command_buffers{0};
+    std::atomic<uint64_t> draws{0};
+    std::atomic<uint64_t> instances{0};
+    std::atomic<uint64_t> vertices{0};
+    std::atomic<uint64_t> overhead_ns{0};
+    std::atomic<uint64_t> overhead_calls{0};
+
+    // totals at the previous present, only touched under the slot's seqlock
+    uint64_t prev_draws = 0;
+    uint64_t prev_vertices = 0;
+};
+
+class TelemetrySegment
+{
+public:
+    TelemetrySegment()
+    {
+        const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_TELEMETRY");
+        if (env != NULL && strcmp(env, "0") == 0)
+            return;
+
+        snprintf(name, sizeof(name), TELEMETRY_NAME_FORMAT, (int) getpid());
+        int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (fd < 0) {
+            printf("vkdisplayhacksteamvr: could not create telemetry segment %s\n", name);
+            return;
+        }
+
+        if (ftruncate(fd, sizeof(telemetry_segment)) == 0) {
+            void *map = mmap(NULL, sizeof(telemetry_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+                segment = (telemetry_segment *) map;
+        }
+        close(fd);
+
+        if (segment == NULL) {
+            printf("vkdisplayhacksteamvr: could not map telemetry segment %s\n", name);
+            shm_unlink(name);
+            return;
+        }
+
+        // the new object is zero filled, the magic goes in last so readers never see a partial header
+        segment->version = TELEMETRY_VERSION;
+        segment->pid = (int32_t) getpid();
+        segment->max_devices = TELEMETRY_MAX_DEVICES;
+        segment->start_ns = log_now_ns();
+        __atomic_store_n(&segment->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    ~TelemetrySegment()
+    {
+        // the mapping stays, devices may outlive static destruction
+        if (segment != NULL)
+            shm_unlink(name);
+    }
+
+    telemetry_segment *segment = NULL;
+    DeviceCounters counters[TELEMETRY_MAX_DEVICES];
+
+private:
+    char name[64] = {};
+};
+
+TelemetrySegment &instance()
+{
+    static TelemetrySegment s;
+    return s;
+}
+
+telemetry_segment *segment()
+{
+    return instance().segment;
+}
+
+DeviceCounters &counters(telemetry_device *d)
+{
+    TelemetrySegment &s = instance();
+    return s.counters[d - s.segment->devices];
+}
+
+// seqlock writer side, concurrent writers of one slot spin on the odd sequence, only claims,
+// releases and presents write it
+void write_begin(telemetry_device *d)
+{
+    uint32_t seq = __atomic_load_n(&d->seq, __ATOMIC_RELAXED);
+    for (;;) {
+        if (!(seq & 1)
+            && __atomic_compare_exchange_n(&d->seq,
+                                           &seq,
+                                           seq + 1,
+                                           true,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
+            break;
+        seq = __atomic_load_n(&d->seq, __ATOMIC_RELAXED);
+    }
+    // keeps the field stores below from becoming visible before the odd sequence
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_end(telemetry_device *d)
+{
+    __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELEASE);
+}
+
+// fields are stored atomically so the readers' racing copies are well defined
+void set(uint64_t *field, uint64_t value)
+{
+    __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+} // namespace
+
+telemetry_device *telemetry_claim(uint64_t device)
+{
+    telemetry_segment *s = segment();
+    if (s == NULL)
+        return NULL;
+
+    for (uint32_t i = 0; i < TELEMETRY_MAX_DEVICES; i++) {
+        telemetry_device *d = &s->devices[i];
+        write_begin(d);
+        if (d->in_use) {
+            write_end(d);
+            continue;
+        }
+
+        __atomic_store_n(&d->in_use, 1, __ATOMIC_RELAXED);
+        set(&d->device, device);
+        set(&d->command_buffers, 0);
+        set(&d->draws, 0);
+        set(&d->instances, 0);
+        set(&d->vertices, 0);
+        set(&d->frames, 0);
+        set(&d->frame_draws, 0);
+        set(&d->frame_vertices, 0);
+        set(&d->last_present_ns, 0);
+        set(&d->overhead_ns, 0);
+        set(&d->overhead_calls, 0);
+        set(&d->layer_allocations, 0);
+        set(&d->layer_frees, 0);
+        set(&d->layer_live_bytes, 0);
+        write_end(d);
+
+        // the slot was free, nothing adds to its counters yet
+        DeviceCounters &c = counters(d);
+        c.command_buffers.store(0, std::memory_order_relaxed);
+        c.draws.store(0, std::memory_order_relaxed);
+        c.instances.store(0, std::memory_order_relaxed);
+        c.vertices.store(0, std::memory_order_relaxed);
+        c.overhead_ns.store(0, std::memory_order_relaxed);
+        c.overhead_calls.store(0, std::memory_order_relaxed);
+        c.prev_draws = 0;
+        c.prev_vertices = 0;
+        return d;
+    }
+
+    return NULL;
+}
+
+void telemetry_release(telemetry_device *d)
+{
+    write_begin(d);
+    __atomic_store_n(&d->in_use, 0, __ATOMIC_RELAXED);
+    write_end(d);
+}
+
+void telemetry_command_buffer(telemetry_device *d,
+                              uint32_t draws,
+                              uint32_t instances,
+                              uint32_t vertices,
+                              uint64_t start_ns)
+{
+    DeviceCounters &c = counters(d);
+    c.command_buffers.fetch_add(1, std::memory_order_relaxed);
+    c.draws.fetch_add(draws, std::memory_order_relaxed);
+    c.instances.fetch_add(instances, std::memory_order_relaxed);
+    c.vertices.fetch_add(vertices, std::memory_order_relaxed);
+    c.overhead_ns.fetch_add(log_now_ns() - start_ns, std::memory_order_relaxed);
+    c.overhead_calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+void telemetry_frame(telemetry_device *d, uint64_t start_ns)
+{
+    AllocStats alloc = alloc_stats();
+    DeviceCounters &c = counters(d);
+    write_begin(d);
+    uint64_t draws = c.draws.load(std::memory_order_relaxed);
+    uint64_t vertices = c.vertices.load(std::memory_order_relaxed);
+    set(&d->command_buffers, c.command_buffers.load(std::memory_order_relaxed));
+    set(&d->draws, draws);
+    set(&d->instances, c.instances.load(std::memory_order_relaxed));
+    set(&d->vertices, vertices);
+    set(&d->frames, d->frames + 1);
+    set(&d->frame_draws, draws - c.prev_draws);
+    set(&d->frame_vertices, vertices - c.prev_vertices);
+    c.prev_draws = draws;
+    c.prev_vertices = vertices;
+    uint64_t now = log_now_ns();
+    set(&d->last_present_ns, now);
+    c.overhead_ns.fetch_add(now - start_ns, std::memory_order_relaxed);
+    c.overhead_calls.fetch_add(1, std::memory_order_relaxed);
+    set(&d->overhead_ns, c.overhead_ns.load(std::memory_order_relaxed));
+    set(&d->overhead_calls, c.overhead_calls.load(std::memory_order_relaxed));
+    set(&d->layer_allocations, alloc.allocations);
+    set(&d->layer_frees, alloc.frees);
+    set(&d->layer_live_bytes, alloc.live_bytes);
+    write_end(d);
+}
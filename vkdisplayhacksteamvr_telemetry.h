@@ -0,0 +1,100 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Layout of the live telemetry segment the layer publishes, shared with the CLI
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * The layer creates the POSIX shared memory object "/vkdisplayhacksteamvr-<pid>" and keeps its
+ * counters in it with plain stores, readers map it read-only. Every device slot is guarded by its
+ * own seqlock: writers make the sequence odd, update the fields and make it even again, readers
+ * copy the slot and retry if the sequence was odd or changed meanwhile. The layer publishes a slot
+ * once per present, a reader that still finds it busy after a few retries tries again later.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TELEMETRY_NAME_FORMAT "/vkdisplayhacksteamvr-%d"
+#define TELEMETRY_MAGIC 0x54485644u // "VDHT"
+#define TELEMETRY_VERSION 3
+#define TELEMETRY_MAX_DEVICES 8
+#define TELEMETRY_READ_RETRIES 64
+
+struct telemetry_device
+{
+  uint32_t seq;    // seqlock, odd while a writer is updating the slot
+  uint32_t in_use; // claimed by a live VkDevice
+
+  uint64_t device; // VkDevice handle, to tell slots apart
+
+  // totals since the device was created, counted at vkEndCommandBuffer and published at the
+  // last vkQueuePresentKHR
+  uint64_t command_buffers;
+  uint64_t draws;
+  uint64_t instances;
+  uint64_t vertices;
+
+  // counted at vkQueuePresentKHR, the frame_* fields hold the work of the last presented frame
+  uint64_t frames;
+  uint64_t frame_draws;
+  uint64_t frame_vertices;
+  uint64_t last_present_ns;
+
+  // time spent in the layer's own bookkeeping at vkEndCommandBuffer and vkQueuePresentKHR
+  uint64_t overhead_ns;
+  uint64_t overhead_calls;
+
+  // the layer's own allocations in the whole process, as of the last present
+  uint64_t layer_allocations;
+  uint64_t layer_frees;
+  uint64_t layer_live_bytes;
+};
+
+struct telemetry_segment
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;
+  uint32_t max_devices;
+  uint64_t start_ns; // CLOCK_MONOTONIC, like every other timestamp in the segment
+  struct telemetry_device devices[TELEMETRY_MAX_DEVICES];
+};
+
+enum telemetry_read_result
+{
+  TELEMETRY_READ_UNUSED, // no device in the slot
+  TELEMETRY_READ_OK,
+  TELEMETRY_READ_BUSY, // a writer held the slot for every retry, *out is stale
+};
+
+// reader side of the seqlock: a consistent copy of the slot, never waits on a writer for long, the
+// writing process may have died halfway through an update
+static inline enum telemetry_read_result telemetry_read_device(const struct telemetry_device *d,
+                                                               struct telemetry_device *out)
+{
+  for (uint32_t retry = 0; retry < TELEMETRY_READ_RETRIES; retry++) {
+    uint32_t seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    const uint64_t *src = (const uint64_t *) d;
+    uint64_t *dst = (uint64_t *) out;
+    for (uint32_t i = 0; i < sizeof(*d) / sizeof(uint64_t); i++)
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&d->seq, __ATOMIC_RELAXED) == seq)
+      return out->in_use != 0 ? TELEMETRY_READ_OK : TELEMETRY_READ_UNUSED;
+  }
+  return TELEMETRY_READ_BUSY;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,35 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Writer side of the live telemetry segment
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * The segment is created with the first device and removed at exit. Recording threads add to
+ * per-device counters with relaxed atomics, each present copies them into the slot under its
+ * seqlock. Presents of the same slot spin on the sequence instead of taking a lock, so neither side
+ * ever makes a syscall for it.
+ *
+ * VK_DISPLAY_HACK_STEAMVR_TELEMETRY=0 turns the segment off.
+ */
+#pragma once
+
+#include "vkdisplayhacksteamvr_telemetry.h"
+
+#include <cstdint>
+
+// claims a slot for a new device, NULL when telemetry is off or every slot is taken
+telemetry_device *telemetry_claim(uint64_t device);
+
+void telemetry_release(telemetry_device *d);
+
+// one command buffer finished recording, start_ns is when the layer's bookkeeping for it began,
+// shows up in the segment with the next frame
+void telemetry_command_buffer(telemetry_device *d,
+                              uint32_t draws,
+                              uint32_t instances,
+                              uint32_t vertices,
+                              uint64_t start_ns);
+
+// a frame was presented, publishes the totals, start_ns is when the layer's bookkeeping began
+void telemetry_frame(telemetry_device *d, uint64_t start_ns);
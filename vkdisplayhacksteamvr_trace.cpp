@@ -0,0 +1,136 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Writer side of the binary call trace
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ */
+#include "vkdisplayhacksteamvr_trace.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+
+std::atomic<bool> trace_enabled{false};
+
+namespace {
+
+constexpr uint32_t DEFAULT_RECORDS = 1u << 18; // 16 MiB
+constexpr uint32_t MAX_RECORDS = 1u << 26;
+
+static_assert(sizeof(trace_header) <= TRACE_HEADER_SIZE, "trace header doesn't fit its page");
+static_assert(sizeof(trace_record) == 64, "trace records are one cache line");
+
+// set once before trace_enabled, read only after seeing it
+trace_header *header = NULL;
+trace_record *records = NULL;
+uint64_t mask = 0;
+
+uint32_t thread_id()
+{
+    static thread_local uint32_t tid = (uint32_t) syscall(SYS_gettid);
+    return tid;
+}
+
+std::string trace_path(const char *pattern)
+{
+    std::string path;
+    for (const char *c = pattern; *c != '\0'; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            path += std::to_string(getpid());
+            c++;
+        } else {
+            path += *c;
+        }
+    }
+    return path;
+}
+
+uint32_t trace_capacity()
+{
+    const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_TRACE_RECORDS");
+    unsigned long requested = env != NULL ? strtoul(env, NULL, 10) : DEFAULT_RECORDS;
+    uint32_t capacity = 1;
+    while (capacity < requested && capacity < MAX_RECORDS)
+        capacity *= 2;
+    return capacity;
+}
+
+void trace_map()
+{
+    const char *env = getenv("VK_DISPLAY_HACK_STEAMVR_TRACE");
+    if (env == NULL || env[0] == '\0')
+        return;
+
+    std::string path = trace_path(env);
+    uint32_t capacity = trace_capacity();
+    size_t size = TRACE_HEADER_SIZE + (size_t) capacity * sizeof(trace_record);
+
+    int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("vkdisplayhacksteamvr: could not create trace %s\n", path.c_str());
+        return;
+    }
+
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        printf("vkdisplayhacksteamvr: could not map trace %s\n", path.c_str());
+        return;
+    }
+
+    // the file is zero filled, the magic goes in last so a reader never sees a partial header.
+    // The mapping stays for the life of the process, hooks may still run during static destruction.
+    header = (trace_header *) map;
+    records = (trace_record *) ((char *) map + TRACE_HEADER_SIZE);
+    mask = capacity - 1;
+
+    header->version = TRACE_VERSION;
+    header->pid = (int32_t) getpid();
+    header->capacity = capacity;
+    header->record_size = sizeof(trace_record);
+    header->entry_points = TRACE_ENTRY_POINT_COUNT;
+    header->start_ns = log_now_ns();
+    __atomic_store_n(&header->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    printf("vkdisplayhacksteamvr: tracing %u calls to %s\n", capacity, path.c_str());
+    trace_enabled.store(true, std::memory_order_release);
+}
+
+} // namespace
+
+void trace_open()
+{
+    static std::once_flag once;
+    std::call_once(once, trace_map);
+}
+
+void trace_write(trace_entry_point entry_point,
+                 uint64_t start_ns,
+                 uint64_t handle,
+                 uint64_t arg0,
+                 uint64_t arg1)
+{
+    uint64_t end_ns = log_now_ns();
+    uint64_t index = __atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED);
+
+    trace_record *r = &records[index & mask];
+    r->start_ns = start_ns;
+    r->duration_ns = end_ns - start_ns;
+    r->handle = handle;
+    r->args[0] = arg0;
+    r->args[1] = arg1;
+    r->entry_point = entry_point;
+    r->thread = thread_id();
+    __atomic_store_n(&r->seq, index + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,110 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Layout of the binary call trace the layer records, shared with the analyzer
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * The trace file is a header page followed by a ring of fixed-size records, one per intercepted
+ * call, written when the call returns. A writer takes the next index with an atomic add, fills
+ * the record in its slot and stores its sequence last. Once the ring wraps, the oldest records are
+ * overwritten, so the file always holds the most recent calls. It is a plain mapped file, so it
+ * survives a crash of the traced process.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC 0x54525644u // "VDRT"
+#define TRACE_VERSION 2
+#define TRACE_HEADER_SIZE 4096
+
+// every entry point the layer traces, with the names of the two arguments it records
+#define TRACE_ENTRY_POINTS(X) \
+  X(CreateInstance, NULL, NULL) \
+  X(DestroyInstance, NULL, NULL) \
+  X(GetInstanceProcAddr, NULL, NULL) \
+  X(GetDeviceProcAddr, NULL, NULL) \
+  X(CreateDevice, "physicalDevice", NULL) \
+  X(DestroyDevice, NULL, NULL) \
+  X(GetRandROutputDisplayEXT, "rrOutput", "display") \
+  X(GetPhysicalDeviceDisplayPropertiesKHR, "requested", NULL) \
+  X(GetPhysicalDeviceDisplayProperties2KHR, "requested", NULL) \
+  X(GetDisplayModePropertiesKHR, "display", "requested") \
+  X(GetDisplayModeProperties2KHR, "display", "requested") \
+  X(CreateDisplayModeKHR, "display", "refreshRate") \
+  X(CreateDisplayPlaneSurfaceKHR, "displayMode", "surface") \
+  X(DestroySurfaceKHR, "surface", NULL) \
+  X(CreateCommandPool, "queueFamilyIndex", "commandPool") \
+  X(AllocateCommandBuffers, "commandPool", "commandBufferCount") \
+  X(FreeCommandBuffers, "commandPool", "commandBufferCount") \
+  X(ResetCommandPool, "commandPool", NULL) \
+  X(DestroyCommandPool, "commandPool", NULL) \
+  X(BeginCommandBuffer, "flags", NULL) \
+  X(EndCommandBuffer, "draws", NULL) \
+  X(CmdDraw, "vertexCount", "instanceCount") \
+  X(CmdDrawIndexed, "indexCount", "instanceCount") \
+  X(CmdDrawIndirect, "drawCount", NULL) \
+  X(CmdDrawIndexedIndirect, "drawCount", NULL) \
+  X(CmdDrawIndirectCount, "maxDrawCount", NULL) \
+  X(CmdDrawIndirectCountKHR, "maxDrawCount", NULL) \
+  X(CmdDrawIndexedIndirectCount, "maxDrawCount", NULL) \
+  X(CmdDrawIndexedIndirectCountKHR, "maxDrawCount", NULL) \
+  X(CmdDispatch, "groupCountX", "groupCountY") \
+  X(CmdDispatchIndirect, NULL, NULL) \
+  X(CmdBindPipeline, "pipelineBindPoint", "pipeline") \
+  X(CmdBindDescriptorSets, "pipelineBindPoint", "descriptorSetCount") \
+  X(CmdBeginRenderPass, "renderPass", NULL) \
+  X(CmdBeginRenderPass2, "renderPass", NULL) \
+  X(CmdBeginRenderPass2KHR, "renderPass", NULL) \
+  X(CmdBeginRendering, "colorAttachmentCount", NULL) \
+  X(CmdBeginRenderingKHR, "colorAttachmentCount", NULL) \
+  X(CmdExecuteCommands, "commandBufferCount", NULL) \
+  X(CreateSwapchainKHR, "surface", "presentMode") \
+  X(DestroySwapchainKHR, "swapchain", NULL) \
+  X(AcquireNextImageKHR, "swapchain", "imageIndex") \
+  X(QueueSubmit, "submitCount", "fence") \
+  X(QueueSubmit2, "submitCount", "fence") \
+  X(QueueSubmit2KHR, "submitCount", "fence") \
+  X(QueuePresentKHR, "swapchain", "imageIndex")
+
+enum trace_entry_point
+{
+#define TRACE_ENUM(name, arg0, arg1) TRACE_##name,
+  TRACE_ENTRY_POINTS(TRACE_ENUM)
+#undef TRACE_ENUM
+  TRACE_ENTRY_POINT_COUNT
+};
+
+struct trace_header
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;
+  uint32_t capacity;    // records in the ring, a power of two
+  uint32_t record_size; // sizeof(struct trace_record)
+  uint32_t entry_points;
+  uint64_t start_ns; // CLOCK_MONOTONIC, like every other timestamp in the file
+  uint64_t next;     // records written so far, the ring holds the last capacity of them
+};
+
+// one cache line, so concurrent writers don't share one
+struct trace_record
+{
+  uint64_t seq; // index + 1, stored last: a slot whose seq doesn't match is torn or overwritten
+  uint64_t start_ns;
+  uint64_t duration_ns; // from entering the layer until it returned
+  uint64_t handle;      // the dispatchable handle the call was made on
+  uint64_t args[2];     // see TRACE_ENTRY_POINTS
+  uint32_t entry_point;
+  uint32_t thread; // kernel thread id
+  uint64_t reserved;
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,70 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Writer side of the binary call trace
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * With VK_DISPLAY_HACK_STEAMVR_TRACE=<file> the first vkCreateInstance maps the file, a %p in
+ * the name is replaced by the pid. VK_DISPLAY_HACK_STEAMVR_TRACE_RECORDS sets the ring's size,
+ * rounded up to a power of two. Without it every hook only checks one flag.
+ */
+#pragma once
+
+#include "vkdisplayhacksteamvr_log.hpp"
+#include "vkdisplayhacksteamvr_trace.h"
+
+#include <atomic>
+#include <cstdint>
+
+// maps the trace file if one is configured, only the first call does anything
+void trace_open();
+
+extern std::atomic<bool> trace_enabled;
+
+void trace_write(trace_entry_point entry_point,
+                 uint64_t start_ns,
+                 uint64_t handle,
+                 uint64_t arg0,
+                 uint64_t arg1);
+
+template<typename T>
+uint64_t trace_handle(T *handle)
+{
+    return (uint64_t) (uintptr_t) handle;
+}
+
+// non-dispatchable handles on 32-bit platforms
+inline uint64_t trace_handle(uint64_t handle)
+{
+    return handle;
+}
+
+// one record for the hook it lives in, written when the hook returns. Arguments only known after
+// the call, like an acquired image, can be set on it before.
+class TraceScope
+{
+public:
+    TraceScope(trace_entry_point entry_point, uint64_t handle, uint64_t arg0 = 0, uint64_t arg1 = 0)
+        : entry_point(entry_point), handle(handle), args{arg0, arg1}
+    {
+        if (trace_enabled.load(std::memory_order_acquire))
+            start_ns = log_now_ns();
+    }
+
+    ~TraceScope()
+    {
+        if (start_ns != 0)
+            trace_write(entry_point, start_ns, handle, args[0], args[1]);
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    trace_entry_point entry_point;
+    uint64_t handle;
+    uint64_t args[2];
+
+private:
+    uint64_t start_ns = 0;
+};
@@ -0,0 +1,346 @@
+// Copyright 2019-2022, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Offline analyzer for the layer's binary call trace
+ * @author Christoph Haag <christoph.haag@collabora.com>
+ *
+ * Reads a trace written with VK_DISPLAY_HACK_STEAMVR_TRACE, live or after the process exited, and
+ * prints the latency distribution of every entry point and a summary per thread. --timeline adds
+ * each thread's calls in order, --chrome writes the calls as a Chrome trace JSON, which Perfetto
+ * and chrome://tracing load.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vkdisplayhacksteamvr_trace.h"
+
+struct entry_point_info
+{
+  const char *name;
+  const char *args[2];
+};
+
+static const struct entry_point_info entry_point_info[] = {
+#define TRACE_INFO(name, arg0, arg1) {#name, {arg0, arg1}},
+    TRACE_ENTRY_POINTS(TRACE_INFO)
+#undef TRACE_INFO
+};
+
+static const char *entry_point_name(uint32_t entry_point)
+{
+  return entry_point < TRACE_ENTRY_POINT_COUNT ? entry_point_info[entry_point].name : "unknown";
+}
+
+static int compare_start(const void *a, const void *b)
+{
+  const struct trace_record *ra = a;
+  const struct trace_record *rb = b;
+  if (ra->start_ns != rb->start_ns)
+    return ra->start_ns < rb->start_ns ? -1 : 1;
+  return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+// by thread, then in order, for the timeline and the per thread summary
+static int compare_thread(const void *a, const void *b)
+{
+  const struct trace_record *ra = a;
+  const struct trace_record *rb = b;
+  if (ra->thread != rb->thread)
+    return ra->thread < rb->thread ? -1 : 1;
+  return compare_start(a, b);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t va = *(const uint64_t *) a;
+  uint64_t vb = *(const uint64_t *) b;
+  return va < vb ? -1 : va > vb;
+}
+
+// nearest rank on sorted values
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+  size_t rank = (size_t) (p * count);
+  return sorted[rank < count ? rank : count - 1];
+}
+
+// the records still in the ring whose slot wasn't torn by a concurrent or overtaking writer
+static struct trace_record *trace_collect(const struct trace_header *header,
+                                          const struct trace_record *ring,
+                                          size_t *count,
+                                          uint64_t *torn)
+{
+  uint64_t next = __atomic_load_n(&header->next, __ATOMIC_ACQUIRE);
+  uint64_t first = next > header->capacity ? next - header->capacity : 0;
+
+  struct trace_record *records = malloc((next - first) * sizeof(struct trace_record) + 1);
+  if (records == NULL)
+    return NULL;
+
+  *count = 0;
+  *torn = 0;
+  for (uint64_t index = first; index < next; index++) {
+    const struct trace_record *slot = &ring[index & (header->capacity - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1) {
+      (*torn)++;
+      continue;
+    }
+    struct trace_record r = *slot;
+    // rewritten while we copied it
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1) {
+      (*torn)++;
+      continue;
+    }
+    records[(*count)++] = r;
+  }
+  return records;
+}
+
+static void print_entry_points(const struct trace_record *records, size_t count)
+{
+  printf("%-40s %9s %9s %9s %9s %9s %9s %12s\n",
+         "entry point", "calls", "min ns", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "total us");
+
+  uint64_t *durations = malloc(count * sizeof(uint64_t) + 1);
+  for (uint32_t e = 0; e < TRACE_ENTRY_POINT_COUNT; e++) {
+    size_t n = 0;
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (records[i].entry_point == e) {
+        durations[n++] = records[i].duration_ns;
+        total += records[i].duration_ns;
+      }
+    }
+    if (n == 0)
+      continue;
+
+    qsort(durations, n, sizeof(uint64_t), compare_u64);
+    printf("%-40s %9zu %9llu %9llu %9llu %9llu %9llu %12.1f\n",
+           entry_point_name(e),
+           n,
+           (unsigned long long) durations[0],
+           (unsigned long long) percentile(durations, n, 0.5),
+           (unsigned long long) percentile(durations, n, 0.99),
+           (unsigned long long) percentile(durations, n, 0.999),
+           (unsigned long long) durations[n - 1],
+           total / 1000.0);
+  }
+  free(durations);
+}
+
+// expects the records sorted by thread
+static void print_threads(const struct trace_record *records, size_t count, uint64_t origin)
+{
+  printf("\n%-10s %9s %12s %12s %12s %s\n",
+         "thread", "calls", "busy us", "first ms", "last ms", "busiest entry point");
+
+  size_t begin = 0;
+  while (begin < count) {
+    uint32_t thread = records[begin].thread;
+    size_t end = begin;
+    uint64_t busy = 0;
+    uint64_t last = 0;
+    uint64_t per_entry_point[TRACE_ENTRY_POINT_COUNT] = {0};
+    for (; end < count && records[end].thread == thread; end++) {
+      const struct trace_record *r = &records[end];
+      busy += r->duration_ns;
+      if (r->start_ns + r->duration_ns > last)
+        last = r->start_ns + r->duration_ns;
+      if (r->entry_point < TRACE_ENTRY_POINT_COUNT)
+        per_entry_point[r->entry_point] += r->duration_ns;
+    }
+
+    uint32_t busiest = 0;
+    for (uint32_t e = 1; e < TRACE_ENTRY_POINT_COUNT; e++)
+      if (per_entry_point[e] > per_entry_point[busiest])
+        busiest = e;
+
+    printf("%-10u %9zu %12.1f %12.3f %12.3f %s\n",
+           thread,
+           end - begin,
+           busy / 1000.0,
+           (records[begin].start_ns - origin) / 1e6,
+           (last - origin) / 1e6,
+           entry_point_name(busiest));
+    begin = end;
+  }
+}
+
+static void print_args(FILE *out, const struct trace_record *r, const char *format)
+{
+  if (r->entry_point >= TRACE_ENTRY_POINT_COUNT)
+    return;
+  const struct entry_point_info *info = &entry_point_info[r->entry_point];
+  for (int i = 0; i < 2; i++)
+    if (info->args[i] != NULL)
+      fprintf(out, format, info->args[i], (unsigned long long) r->args[i]);
+}
+
+// expects the records sorted by thread
+static void print_timeline(const struct trace_record *records, size_t count, uint64_t origin)
+{
+  uint32_t thread = 0;
+  for (size_t i = 0; i < count; i++) {
+    const struct trace_record *r = &records[i];
+    if (i == 0 || r->thread != thread) {
+      thread = r->thread;
+      printf("\nthread %u\n", thread);
+    }
+    printf("  %14.3f us %9llu ns  %-40s 0x%llx",
+           (r->start_ns - origin) / 1e3,
+           (unsigned long long) r->duration_ns,
+           entry_point_name(r->entry_point),
+           (unsigned long long) r->handle);
+    print_args(stdout, r, " %s=%llu");
+    printf("\n");
+  }
+}
+
+// complete events in microseconds, which both chrome://tracing and Perfetto import
+static int write_chrome(const char *path,
+                        const struct trace_record *records,
+                        size_t count,
+                        const struct trace_header *header)
+{
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    printf("Could not create %s\n", path);
+    return 1;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(out,
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"vkdisplayhacksteamvr\"}}",
+          header->pid);
+  for (size_t i = 0; i < count; i++) {
+    const struct trace_record *r = &records[i];
+    fprintf(out,
+            ",\n{\"name\":\"vk%s\",\"cat\":\"vulkan\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%u,\"args\":{\"handle\":\"0x%llx\"",
+            entry_point_name(r->entry_point),
+            (r->start_ns - header->start_ns) / 1e3,
+            r->duration_ns / 1e3,
+            header->pid,
+            r->thread,
+            (unsigned long long) r->handle);
+    print_args(out, r, ",\"%s\":%llu");
+    fprintf(out, "}}");
+  }
+  fprintf(out, "\n]}\n");
+
+  bool failed = ferror(out) != 0;
+  if (fclose(out) != 0 || failed) {
+    printf("Could not write %s\n", path);
+    return 1;
+  }
+  printf("\nWrote %zu events to %s\n", count, path);
+  return 0;
+}
+
+static void usage(const char *argv0)
+{
+  printf("Usage: %s <trace> [--timeline] [--chrome <out.json>]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = NULL;
+  const char *chrome = NULL;
+  bool timeline = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--timeline") == 0) {
+      timeline = true;
+    } else if (strcmp(argv[i], "--chrome") == 0 && i + 1 < argc) {
+      chrome = argv[++i];
+    } else if (path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (path == NULL) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < TRACE_HEADER_SIZE) {
+    printf("%s is not a trace\n", path);
+    close(fd);
+    return 1;
+  }
+  size_t size = st.st_size;
+  const void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("Could not map %s\n", path);
+    return 1;
+  }
+
+  const struct trace_header *header = map;
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC
+      || header->version != TRACE_VERSION || header->record_size != sizeof(struct trace_record)
+      || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0
+      || size < TRACE_HEADER_SIZE + (size_t) header->capacity * sizeof(struct trace_record)) {
+    printf("%s has an unknown layout\n", path);
+    munmap((void *) map, size);
+    return 1;
+  }
+  if (header->entry_points != TRACE_ENTRY_POINT_COUNT)
+    printf("Trace has %u entry points, this analyzer knows %u\n",
+           header->entry_points,
+           (unsigned) TRACE_ENTRY_POINT_COUNT);
+
+  const struct trace_record *ring
+      = (const struct trace_record *) ((const char *) map + TRACE_HEADER_SIZE);
+  size_t count = 0;
+  uint64_t torn = 0;
+  struct trace_record *records = trace_collect(header, ring, &count, &torn);
+  if (records == NULL) {
+    printf("Out of memory\n");
+    munmap((void *) map, size);
+    return 1;
+  }
+
+  uint64_t written = __atomic_load_n(&header->next, __ATOMIC_RELAXED);
+  printf("pid %d: %llu calls traced, %zu in the trace, %llu torn or overwritten while reading\n\n",
+         header->pid,
+         (unsigned long long) written,
+         count,
+         (unsigned long long) torn);
+
+  int ret = 0;
+  if (count > 0) {
+    print_entry_points(records, count);
+
+    qsort(records, count, sizeof(struct trace_record), compare_thread);
+    print_threads(records, count, header->start_ns);
+    if (timeline)
+      print_timeline(records, count, header->start_ns);
+
+    if (chrome != NULL) {
+      qsort(records, count, sizeof(struct trace_record), compare_start);
+      ret = write_chrome(chrome, records, count, header);
+    }
+  }
+
+  free(records);
+  munmap((void *) map, size);
+  return ret;
+}